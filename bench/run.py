@@ -41,8 +41,8 @@ class Bench:
 
     def __gpu_pipe(self, size):
         source = "videotestsrc is-live=true ! video/x-raw,height=720,width=1280,framerate=25/1 ! queue ! tee name=t"
-        first = " ! queue ! glupload ! gpuanalysis ! fakesink"
-        analysis = " t. ! queue ! glupload ! gpuanalysis ! fakesink" * (size - 1)
+        first = " ! queue ! gpuanalysis ! fakesink"
+        analysis = " t. ! queue ! gpuanalysis ! fakesink" * (size - 1)
         #print(source + first + analysis)
         return Gst.parse_launch(source + first + analysis)
 
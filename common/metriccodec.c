@@ -0,0 +1,379 @@
+/* metriccodec.c
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+
+#include "metriccodec.h"
+#include <string.h>
+
+/* worst cases: a 64-bit delta-of-delta and a new XOR window */
+#define TIME_MAX_BITS  (5 + 64)
+#define VALUE_MAX_BITS (2 + 5 + 5 + 32)
+
+static inline void
+bits_put(MetricBits* b, guint64 v, guint n)
+{
+  while (n > 0) {
+    guint k = MIN(n, 64 - b->fill);
+    guint64 part = (k == 64) ? v : (v >> (n - k)) & ((G_GUINT64_CONSTANT(1) << k) - 1);
+
+    b->acc = (k == 64) ? part : (b->acc << k) | part;
+    b->fill += k;
+    n -= k;
+    if (b->fill == 64) {
+      for (int i = 0; i < 8; i++)
+	b->data[b->size++] = b->acc >> (56 - 8 * i);
+      b->acc = 0;
+      b->fill = 0;
+    }
+  }
+}
+
+static gsize
+bits_size(const MetricBits* b)
+{
+  return b->size + (b->fill + 7) / 8;
+}
+
+static gsize
+bits_flush(const MetricBits* b, guint8* dst)
+{
+  guint64 acc = b->fill ? b->acc << (64 - b->fill) : 0;
+  guint tail = (b->fill + 7) / 8;
+
+  memcpy(dst, b->data, b->size);
+  for (guint i = 0; i < tail; i++)
+    dst[b->size + i] = acc >> (56 - 8 * i);
+  return b->size + tail;
+}
+
+typedef struct {
+  const guint8* p;
+  const guint8* end;
+  guint64       acc;
+  guint         fill;
+} BitReader;
+
+static inline guint64
+bits_get(BitReader* r, guint n)
+{
+  guint64 rval = 0;
+
+  while (n > 0) {
+    guint k;
+
+    if (r->fill == 0) {
+      guint avail = MIN(8, r->end - r->p);
+
+      /* past the end reads as zeroes */
+      r->acc = 0;
+      for (guint i = 0; i < avail; i++)
+	r->acc |= (guint64)r->p[i] << (56 - 8 * i);
+      r->p += avail;
+      r->fill = 64;
+    }
+    k = MIN(n, r->fill);
+    rval = (k == 64) ? r->acc : (rval << k) | (r->acc >> (64 - k));
+    r->acc = (k == 64) ? 0 : r->acc << k;
+    r->fill -= k;
+    n -= k;
+  }
+  return rval;
+}
+
+static inline gint64
+sign_extend(guint64 v, guint bits)
+{
+  guint64 m = G_GUINT64_CONSTANT(1) << (bits - 1);
+
+  return (gint64)((v ^ m) - m);
+}
+
+gsize
+metric_codec_max_size(guint frames)
+{
+  return sizeof(MetricCodecHeader)
+    + ((gsize)frames * TIME_MAX_BITS + 7) / 8 + 8
+    + (((gsize)frames * VALUE_MAX_BITS + 7) / 8 + 8) * METRIC_CODEC_COLUMNS;
+}
+
+MetricEncoder*
+metric_encoder_new(guint capacity)
+{
+  MetricEncoder* rval;
+
+  if (capacity == 0) return NULL;
+
+  rval = g_new0(MetricEncoder, 1);
+  rval->capacity = capacity;
+  rval->streams[0].data = g_malloc(((gsize)capacity * TIME_MAX_BITS + 7) / 8 + 8);
+  for (guint p = 1; p <= METRIC_CODEC_COLUMNS; p++)
+    rval->streams[p].data = g_malloc(((gsize)capacity * VALUE_MAX_BITS + 7) / 8 + 8);
+  metric_encoder_reset(rval);
+  return rval;
+}
+
+void
+metric_encoder_delete(MetricEncoder* enc)
+{
+  if (enc == NULL) return;
+
+  for (guint p = 0; p <= METRIC_CODEC_COLUMNS; p++)
+    g_free(enc->streams[p].data);
+  g_free(enc);
+}
+
+void
+metric_encoder_reset(MetricEncoder* enc)
+{
+  enc->frames = 0;
+  enc->time = 0;
+  enc->delta = 0;
+  for (guint p = 0; p <= METRIC_CODEC_COLUMNS; p++) {
+    enc->streams[p].size = 0;
+    enc->streams[p].acc = 0;
+    enc->streams[p].fill = 0;
+  }
+}
+
+static inline void
+put_time(MetricEncoder* enc, gint64 time)
+{
+  MetricBits* b = &enc->streams[0];
+  gint64 delta = time - enc->time;
+  gint64 dod = delta - enc->delta;
+
+  enc->time = time;
+  enc->delta = delta;
+
+  /* frame jitter mostly lands in the 7 to 12-bit buckets */
+  if (dod == 0)
+    bits_put(b, 0x0, 1);
+  else if (dod >= -64 && dod <= 63)
+    bits_put(b, (0x2 << 7) | (dod & 0x7f), 2 + 7);
+  else if (dod >= -256 && dod <= 255)
+    bits_put(b, (0x6 << 9) | (dod & 0x1ff), 3 + 9);
+  else if (dod >= -2048 && dod <= 2047)
+    bits_put(b, (0xe << 12) | (dod & 0xfff), 4 + 12);
+  else if (dod >= G_MININT32 && dod <= G_MAXINT32) {
+    bits_put(b, 0x1e, 5);
+    bits_put(b, (guint32)dod, 32);
+  } else {
+    bits_put(b, 0x1f, 5);
+    bits_put(b, (guint64)dod, 64);
+  }
+}
+
+static inline void
+put_value(MetricEncoder* enc, guint p, guint32 v)
+{
+  MetricBits* b = &enc->streams[p + 1];
+  guint32 x = v ^ enc->value[p];
+  guint lead, trail;
+
+  enc->value[p] = v;
+  if (x == 0) {
+    bits_put(b, 0x0, 1);
+    return;
+  }
+  lead = __builtin_clz(x);
+  trail = __builtin_ctz(x);
+  if (lead >= enc->lead[p] && trail >= enc->trail[p]) {
+    /* fits the previous meaningful window */
+    bits_put(b, 0x2, 2);
+    bits_put(b, x >> enc->trail[p], 32 - enc->lead[p] - enc->trail[p]);
+  } else {
+    guint len = 32 - lead - trail;
+
+    bits_put(b, (0x3 << 10) | (lead << 5) | (len - 1), 2 + 5 + 5);
+    bits_put(b, x >> trail, len);
+    enc->lead[p] = lead;
+    enc->trail[p] = trail;
+  }
+}
+
+gboolean
+metric_encoder_push(MetricEncoder* enc,
+		    gint64 time,
+		    const gfloat values[METRIC_CODEC_PARAMS],
+		    guint32 flags)
+{
+  guint32 v[METRIC_CODEC_COLUMNS];
+
+  if (enc->frames >= enc->capacity) return FALSE;
+
+  /* the flags go as the bits of the values do */
+  memcpy(v, values, sizeof(gfloat) * METRIC_CODEC_PARAMS);
+  v[METRIC_CODEC_PARAMS] = flags;
+
+  if (enc->frames == 0) {
+    bits_put(&enc->streams[0], (guint64)time, 64);
+    enc->time = time;
+    enc->delta = 0;
+    for (guint p = 0; p < METRIC_CODEC_COLUMNS; p++) {
+      bits_put(&enc->streams[p + 1], v[p], 32);
+      enc->value[p] = v[p];
+      /* no window yet */
+      enc->lead[p] = 32;
+      enc->trail[p] = 32;
+    }
+  } else {
+    put_time(enc, time);
+    for (guint p = 0; p < METRIC_CODEC_COLUMNS; p++)
+      put_value(enc, p, v[p]);
+  }
+  enc->frames++;
+  return TRUE;
+}
+
+gsize
+metric_encoder_size(const MetricEncoder* enc)
+{
+  gsize rval = sizeof(MetricCodecHeader);
+
+  for (guint p = 0; p <= METRIC_CODEC_COLUMNS; p++)
+    rval += bits_size(&enc->streams[p]);
+  return rval;
+}
+
+gsize
+metric_encoder_finish(MetricEncoder* enc,
+		      guint8* dst)
+{
+  MetricCodecHeader header;
+  gsize rval = sizeof(header);
+
+  header.magic = METRIC_CODEC_MAGIC;
+  header.frames = enc->frames;
+  for (guint p = 0; p <= METRIC_CODEC_COLUMNS; p++) {
+    header.sizes[p] = bits_flush(&enc->streams[p], dst + rval);
+    rval += header.sizes[p];
+  }
+  memcpy(dst, &header, sizeof(header));
+  metric_encoder_reset(enc);
+  return rval;
+}
+
+static gboolean
+read_header(const guint8* block,
+	    gsize size,
+	    MetricCodecHeader* header)
+{
+  gsize total = sizeof(*header);
+
+  if (size < sizeof(*header))
+    return FALSE;
+  memcpy(header, block, sizeof(*header));
+  if (header->magic != METRIC_CODEC_MAGIC)
+    return FALSE;
+  for (guint p = 0; p <= METRIC_CODEC_COLUMNS; p++)
+    total += header->sizes[p];
+  return total <= size;
+}
+
+guint
+metric_codec_frames(const guint8* block,
+		    gsize size)
+{
+  MetricCodecHeader header;
+
+  return read_header(block, size, &header) ? header.frames : 0;
+}
+
+static void
+decode_times(BitReader* r, gint64* times, guint frames)
+{
+  gint64 time = (gint64)bits_get(r, 64);
+  gint64 delta = 0;
+
+  times[0] = time;
+  for (guint n = 1; n < frames; n++) {
+    gint64 dod;
+
+    if (bits_get(r, 1) == 0)
+      dod = 0;
+    else if (bits_get(r, 1) == 0)
+      dod = sign_extend(bits_get(r, 7), 7);
+    else if (bits_get(r, 1) == 0)
+      dod = sign_extend(bits_get(r, 9), 9);
+    else if (bits_get(r, 1) == 0)
+      dod = sign_extend(bits_get(r, 12), 12);
+    else if (bits_get(r, 1) == 0)
+      dod = sign_extend(bits_get(r, 32), 32);
+    else
+      dod = (gint64)bits_get(r, 64);
+    delta += dod;
+    time += delta;
+    times[n] = time;
+  }
+}
+
+/* the bits of a column, floats are decoded in place */
+static void
+decode_values(BitReader* r, guint32* values, guint frames)
+{
+  guint32 v = bits_get(r, 32);
+  guint lead = 0, trail = 0;
+
+  values[0] = v;
+  for (guint n = 1; n < frames; n++) {
+    if (bits_get(r, 1)) {
+      if (bits_get(r, 1)) {
+	guint h = bits_get(r, 10);
+
+	lead = h >> 5;
+	trail = 32 - lead - ((h & 0x1f) + 1);
+      }
+      v ^= (guint32)bits_get(r, 32 - lead - trail) << trail;
+    }
+    values[n] = v;
+  }
+}
+
+gboolean
+metric_codec_decode(const guint8* block,
+		    gsize size,
+		    gint64* times,
+		    gfloat* values,
+		    guint32* flags,
+		    guint stride)
+{
+  MetricCodecHeader header;
+  const guint8* p;
+  BitReader r;
+
+  if (!read_header(block, size, &header) || stride < header.frames)
+    return FALSE;
+  if (header.frames == 0)
+    return TRUE;
+
+  /* the streams are independent, one column at a time */
+  p = block + sizeof(header);
+  r = (BitReader) { p, p + header.sizes[0], 0, 0 };
+  decode_times(&r, times, header.frames);
+  p += header.sizes[0];
+  for (guint c = 0; c < METRIC_CODEC_PARAMS; c++) {
+    r = (BitReader) { p, p + header.sizes[c + 1], 0, 0 };
+    G_STATIC_ASSERT (sizeof(gfloat) == sizeof(guint32));
+    decode_values(&r, (guint32*)(values + (gsize)c * stride), header.frames);
+    p += header.sizes[c + 1];
+  }
+  if (flags) {
+    r = (BitReader) { p, p + header.sizes[METRIC_CODEC_COLUMNS], 0, 0 };
+    decode_values(&r, flags, header.frames);
+  }
+  return TRUE;
+}
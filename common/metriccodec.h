@@ -0,0 +1,97 @@
+/* metriccodec.h
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+#ifndef METRICCODEC_H
+#define METRICCODEC_H
+
+#include <glib.h>
+
+/* Streaming compression of the frame measurements in the style of
+ * Gorilla (Pelkonen et al., VLDB 2015): delta-of-delta timestamps
+ * and XOR-ed float values.
+ *
+ * A block is a MetricCodecHeader followed by one bit stream for the
+ * times, one per parameter and one for the error flags (metricshm.h
+ * bits, XOR-ed as the values are), each byte aligned, so the decoder
+ * unpacks every column on its own straight into a columnar array
+ * (the MetricColumns and metrichistory layout).
+ *
+ * The codec is used for the cpuanalysis compress payload and for
+ * metric-history exports, the history file itself keeps raw columns. */
+
+#define METRIC_CODEC_MAGIC  0x32434856 /* "VHC2" */
+/* black, luma, freeze, diff, blocky (the PARAMETER order) */
+#define METRIC_CODEC_PARAMS 5
+/* the value streams and the flags one */
+#define METRIC_CODEC_COLUMNS (METRIC_CODEC_PARAMS + 1)
+
+typedef struct {
+  guint32 magic;
+  guint32 frames;
+  /* bytes of the time stream, then of every value stream
+     and of the flags one */
+  guint32 sizes[METRIC_CODEC_COLUMNS + 1];
+} MetricCodecHeader;
+
+typedef struct {
+  guint8* data;
+  gsize   size;
+  guint64 acc;
+  guint   fill;
+} MetricBits;
+
+typedef struct {
+  guint      capacity;
+  guint      frames;
+  gint64     time;
+  gint64     delta;
+  guint32    value[METRIC_CODEC_COLUMNS];
+  guint8     lead[METRIC_CODEC_COLUMNS];
+  guint8     trail[METRIC_CODEC_COLUMNS];
+  MetricBits streams[METRIC_CODEC_COLUMNS + 1];
+} MetricEncoder;
+
+/* capacity is the number of frames of a block */
+MetricEncoder* metric_encoder_new(guint capacity);
+void           metric_encoder_delete(MetricEncoder* enc);
+void           metric_encoder_reset(MetricEncoder* enc);
+/* FALSE once the block holds capacity frames */
+gboolean       metric_encoder_push(MetricEncoder* enc,
+				   gint64 time,
+				   const gfloat values[METRIC_CODEC_PARAMS],
+				   guint32 flags);
+/* bytes metric_encoder_finish is going to write */
+gsize          metric_encoder_size(const MetricEncoder* enc);
+/* upper bound of a block of frames */
+gsize          metric_codec_max_size(guint frames);
+/* writes the block and starts a new one, returns its size */
+gsize          metric_encoder_finish(MetricEncoder* enc,
+				     guint8* dst);
+
+/* number of frames of a block, 0 if it is malformed */
+guint          metric_codec_frames(const guint8* block,
+				   gsize size);
+/* unpacks the block into times[frames], values[p * stride + n],
+ * stride >= frames, and flags[frames] unless flags is NULL */
+gboolean       metric_codec_decode(const guint8* block,
+				   gsize size,
+				   gint64* times,
+				   gfloat* values,
+				   guint32* flags,
+				   guint stride);
+
+#endif /* METRICCODEC_H */
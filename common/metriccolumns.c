@@ -0,0 +1,117 @@
+/* metriccolumns.c
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+
+#include "metriccolumns.h"
+
+static const gfloat scales[METRIC_COLUMNS_PARAMS] = METRIC_COLUMNS_SCALES;
+
+static guint
+capacity_of(guint frames)
+{
+  return (frames + 7) & ~7u;
+}
+
+gsize
+metric_columns_size(guint frames)
+{
+  return sizeof(MetricColumns)
+    + sizeof(guint16) * METRIC_COLUMNS_PARAMS * capacity_of(frames);
+}
+
+void
+metric_columns_init(MetricColumns* mc,
+		    guint frames,
+		    guint32 time_step)
+{
+  mc->time_base = 0;
+  mc->time_step = time_step;
+  mc->frames = 0;
+  mc->capacity = capacity_of(frames);
+  mc->reserved = 0;
+  mc->pad = 0;
+  for (guint p = 0; p < METRIC_COLUMNS_PARAMS; p++)
+    mc->scale[p] = scales[p];
+}
+
+static inline guint16
+quantize(gfloat v, gfloat scale)
+{
+  gfloat q = v * scale + 0.5f;
+
+  if (!(q > 0.0f)) return 0;
+  if (q >= 65535.0f) return 65535;
+  return (guint16)q;
+}
+
+void
+metric_columns_set(MetricColumns* mc,
+		   guint p,
+		   guint i,
+		   gint64 time,
+		   gfloat v)
+{
+  if (G_UNLIKELY(i >= mc->capacity || p >= METRIC_COLUMNS_PARAMS))
+    return;
+  if (i == 0)
+    mc->time_base = time;
+  metric_columns_column(mc, p)[i] = quantize(v, mc->scale[p]);
+  if (i >= mc->frames)
+    mc->frames = i + 1;
+}
+
+gboolean
+metric_columns_append(MetricColumns* mc,
+		      gint64 time,
+		      const gfloat v[METRIC_COLUMNS_PARAMS])
+{
+  guint i = mc->frames;
+
+  if (i >= mc->capacity) return FALSE;
+  if (i == 0)
+    mc->time_base = time;
+  for (guint p = 0; p < METRIC_COLUMNS_PARAMS; p++)
+    metric_columns_column(mc, p)[i] = quantize(v[p], mc->scale[p]);
+  mc->frames = i + 1;
+  return TRUE;
+}
+
+void
+metric_columns_stats(const MetricColumns* mc,
+		     guint p,
+		     gfloat* min,
+		     gfloat* max,
+		     gfloat* mean)
+{
+  const guint16* col = metric_columns_column(mc, p);
+  guint16 lo = 65535, hi = 0;
+  guint64 sum = 0;
+
+  if (mc->frames == 0) {
+    *min = *max = *mean = 0.0f;
+    return;
+  }
+  /* plain loops over u16, vectorized by the compiler */
+  for (guint i = 0; i < mc->frames; i++) {
+    lo = col[i] < lo ? col[i] : lo;
+    hi = col[i] > hi ? col[i] : hi;
+    sum += col[i];
+  }
+  *min = lo / mc->scale[p];
+  *max = hi / mc->scale[p];
+  *mean = ((gfloat)sum / mc->frames) / mc->scale[p];
+}
@@ -0,0 +1,89 @@
+/* metriccolumns.h
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+#ifndef METRICCOLUMNS_H
+#define METRICCOLUMNS_H
+
+#include <glib.h>
+
+/* Compact period storage: every metric is a contiguous column of
+ * unsigned 16-bit fixed-point values (value * scale, saturated),
+ * and the time of frame i is time_base + i * time_step.
+ * A frame takes 10 bytes instead of 32 (VideoParams) or
+ * 5 * 16 (struct point), a column is ready for SIMD aggregation.
+ *
+ * The block is self-describing: MetricColumns, then
+ * METRIC_COLUMNS_PARAMS columns of capacity samples each. */
+
+#define METRIC_COLUMNS_PARAMS 5
+/* PARAMETER order: black, luma, freeze, diff, blocky.
+ * Percentages keep 0.0015 %, levels 1/256 of a step */
+#define METRIC_COLUMNS_SCALES { 655.35f, 256.0f, 655.35f, 256.0f, 655.35f }
+
+typedef struct {
+  /* time of the frame 0 in us */
+  gint64  time_base;
+  guint32 time_step;
+  guint32 frames;
+  /* column length, a multiple of 8 */
+  guint32 capacity;
+  guint32 reserved;
+  gfloat  scale[METRIC_COLUMNS_PARAMS];
+  guint32 pad;
+} MetricColumns;
+
+gsize metric_columns_size(guint frames);
+void  metric_columns_init(MetricColumns* mc,
+			  guint frames,
+			  guint32 time_step);
+
+static inline guint16*
+metric_columns_column(const MetricColumns* mc, guint p)
+{
+  return (guint16*)(mc + 1) + (gsize)p * mc->capacity;
+}
+
+static inline gint64
+metric_columns_time(const MetricColumns* mc, guint i)
+{
+  return mc->time_base + (gint64)i * mc->time_step;
+}
+
+static inline gfloat
+metric_columns_value(const MetricColumns* mc, guint p, guint i)
+{
+  return metric_columns_column(mc, p)[i] / mc->scale[p];
+}
+
+/* sets the sample i of the metric p, frames grows to cover it */
+void  metric_columns_set(MetricColumns* mc,
+			 guint p,
+			 guint i,
+			 gint64 time,
+			 gfloat v);
+/* appends a frame, FALSE if the columns are full */
+gboolean metric_columns_append(MetricColumns* mc,
+			       gint64 time,
+			       const gfloat v[METRIC_COLUMNS_PARAMS]);
+
+void  metric_columns_stats(const MetricColumns* mc,
+			   guint p,
+			   gfloat* min,
+			   gfloat* max,
+			   gfloat* mean);
+
+#endif /* METRICCOLUMNS_H */
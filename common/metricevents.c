@@ -0,0 +1,446 @@
+/* metricevents.c
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+
+#include "metricevents.h"
+#include "metricshm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+G_STATIC_ASSERT (METRIC_EVENTS_PARAMS == METRIC_SHM_PARAMS);
+
+/* The index file next to the log */
+typedef struct {
+  guint32     magic;
+  guint32     version;
+  /* the log it was built for: its inode, the number of records
+     indexed and a copy of the last of them */
+  guint64     inode;
+  guint64     covered;
+  MetricEvent last;
+  /* spans of each array, which follow the header in order */
+  guint32     count[METRIC_EVENTS_PARAMS][METRIC_EVENT_KINDS];
+} MetricEventsIndexHeader;
+
+static gboolean
+header_is_valid(const MetricEventsHeader* hd)
+{
+  return hd->magic == METRIC_EVENTS_MAGIC
+    && hd->version == METRIC_EVENTS_VERSION
+    && hd->header_size == sizeof(MetricEventsHeader)
+    && hd->record_size == sizeof(MetricEvent)
+    && hd->params == METRIC_EVENTS_PARAMS;
+}
+
+MetricEvents*
+metric_events_create(const gchar* path,
+		     const gchar* source)
+{
+  MetricEvents* rval;
+  MetricEventsHeader header;
+  struct stat st;
+
+  if (path == NULL) return NULL;
+
+  rval = g_new0(MetricEvents, 1);
+  rval->writer = TRUE;
+  for (guint p = 0; p < METRIC_EVENTS_PARAMS; p++)
+    for (guint k = 0; k < METRIC_EVENT_KINDS; k++)
+      rval->open[p][k] = (MetricEvent) { G_MININT64, G_MININT64, p, k, 0 };
+
+  rval->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (rval->fd < 0)
+    goto error;
+  if (fstat(rval->fd, &st) < 0)
+    goto error;
+
+  if (st.st_size == 0) {
+    memset(&header, 0, sizeof(header));
+    header.magic = METRIC_EVENTS_MAGIC;
+    header.version = METRIC_EVENTS_VERSION;
+    header.header_size = sizeof(MetricEventsHeader);
+    header.record_size = sizeof(MetricEvent);
+    header.params = METRIC_EVENTS_PARAMS;
+    g_strlcpy(header.source, source ? source : "", sizeof(header.source));
+    if (write(rval->fd, &header, sizeof(header)) != sizeof(header))
+      goto error;
+  } else if (pread(rval->fd, &header, sizeof(header), 0) != sizeof(header)
+	     || !header_is_valid(&header)) {
+    /* never append to a file that is not ours */
+    goto error;
+  }
+  return rval;
+
+ error:
+  if (rval->fd >= 0)
+    close(rval->fd);
+  g_free(rval);
+  return NULL;
+}
+
+/* FALSE if the span is lost, a partly written record is cut
+   off so that the records after it stay readable */
+static gboolean
+writer_close_span(MetricEvents* ev, MetricEvent* span)
+{
+  struct stat st;
+  ssize_t rc = -1;
+
+  if (fstat(ev->fd, &st) == 0) {
+    /* O_APPEND writes of one record do not interleave */
+    do
+      rc = write(ev->fd, span, sizeof(*span));
+    while (rc < 0 && errno == EINTR);
+    if (rc > 0 && rc != sizeof(*span))
+      rc = ftruncate(ev->fd, st.st_size) < 0 ? -1 : 0;
+  }
+  span->from = G_MININT64;
+  return rc == sizeof(*span);
+}
+
+gboolean
+metric_events_track(MetricEvents* ev,
+		    gint64 time,
+		    guint32 flags)
+{
+  gboolean rval = TRUE;
+
+  for (guint p = 0; p < METRIC_EVENTS_PARAMS; p++)
+    for (guint k = 0; k < METRIC_EVENT_KINDS; k++) {
+      MetricEvent* span = &ev->open[p][k];
+      guint32 bit = (k == METRIC_EVENT_CONT)
+	? METRIC_SHM_CONT_FLAG(p) : METRIC_SHM_PEAK_FLAG(p);
+
+      if (flags & bit) {
+	if (span->from == G_MININT64)
+	  span->from = time;
+	span->to = time;
+      } else if (span->from != G_MININT64) {
+	rval &= writer_close_span(ev, span);
+      }
+    }
+  return rval;
+}
+
+static int
+event_cmp(const void* a, const void* b)
+{
+  const MetricEvent* x = a;
+  const MetricEvent* y = b;
+
+  return (x->from > y->from) - (x->from < y->from);
+}
+
+/* merged in place: sorted by from and disjoint, so to is sorted as well */
+static guint
+spans_merge(MetricEvent* spans, guint count)
+{
+  guint n = 0;
+
+  if (count == 0) return 0;
+  for (guint i = 1; i < count; i++) {
+    MetricEvent* last = &spans[n];
+
+    if (spans[i].from <= last->to) {
+      if (spans[i].to > last->to)
+	last->to = spans[i].to;
+    } else {
+      spans[++n] = spans[i];
+    }
+  }
+  return n + 1;
+}
+
+/* the indexed spans followed by the records appended since,
+   sorted on their own and merged into the index in one pass */
+static void
+index_update(MetricEventIndex* idx, MetricEvent* tail, guint tail_count)
+{
+  MetricEvent* spans;
+  guint i = 0, j = 0, n = 0;
+
+  if (tail_count == 0) return;
+  qsort(tail, tail_count, sizeof(MetricEvent), event_cmp);
+
+  spans = g_new(MetricEvent, idx->count + tail_count);
+  while (i < idx->count || j < tail_count)
+    if (j == tail_count || (i < idx->count && idx->spans[i].from <= tail[j].from))
+      spans[n++] = idx->spans[i++];
+    else
+      spans[n++] = tail[j++];
+
+  if (!idx->mapped)
+    g_free(idx->spans);
+  idx->spans = spans;
+  idx->count = spans_merge(spans, n);
+  idx->mapped = FALSE;
+}
+
+static gchar*
+index_path(const gchar* path)
+{
+  return g_strconcat(path, ".idx", NULL);
+}
+
+/* The spans of a valid index point into its mapping, the number of
+   log records it covers is returned, 0 if there is none to use */
+static guint64
+index_load(MetricEvents* ev, const gchar* path, int log_fd,
+	   const struct stat* log_st, guint64 records)
+{
+  gchar* ipath = index_path(path);
+  const MetricEventsIndexHeader* hd;
+  MetricEvent last;
+  struct stat st;
+  guint64 total = 0;
+  const MetricEvent* spans;
+  void* mem;
+  int fd;
+
+  fd = open(ipath, O_RDONLY);
+  g_free(ipath);
+  if (fd < 0)
+    return 0;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hd)) {
+    close(fd);
+    return 0;
+  }
+  mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+    return 0;
+
+  hd = mem;
+  for (guint p = 0; p < METRIC_EVENTS_PARAMS; p++)
+    for (guint k = 0; k < METRIC_EVENT_KINDS; k++)
+      total += hd->count[p][k];
+
+  /* built for this very log, which has not been rewritten since */
+  if (hd->magic != METRIC_EVENTS_INDEX_MAGIC
+      || hd->version != METRIC_EVENTS_VERSION
+      || hd->inode != (guint64)log_st->st_ino
+      || hd->covered == 0
+      || hd->covered > records
+      || (gsize)st.st_size != sizeof(*hd) + total * sizeof(MetricEvent)
+      || pread(log_fd, &last, sizeof(last),
+	       sizeof(MetricEventsHeader) + (hd->covered - 1) * sizeof(MetricEvent))
+      != sizeof(last)
+      || memcmp(&last, &hd->last, sizeof(last)) != 0) {
+    munmap(mem, st.st_size);
+    return 0;
+  }
+
+  ev->index_map = mem;
+  ev->index_map_size = st.st_size;
+  spans = (const MetricEvent*)(hd + 1);
+  for (guint p = 0; p < METRIC_EVENTS_PARAMS; p++)
+    for (guint k = 0; k < METRIC_EVENT_KINDS; k++) {
+      MetricEventIndex* idx = &ev->index[p][k];
+
+      idx->spans = (MetricEvent*)spans;
+      idx->count = hd->count[p][k];
+      idx->mapped = TRUE;
+      spans += idx->count;
+    }
+  return hd->covered;
+}
+
+/* Written aside and renamed, a reader without write access to
+   the directory simply goes on sorting the records it reads */
+static void
+index_store(const MetricEvents* ev, const gchar* path,
+	    const struct stat* log_st, guint64 covered, const MetricEvent* last)
+{
+  gchar* ipath = index_path(path);
+  MetricEventsIndexHeader hd;
+  GByteArray* data = g_byte_array_new();
+
+  memset(&hd, 0, sizeof(hd));
+  hd.magic = METRIC_EVENTS_INDEX_MAGIC;
+  hd.version = METRIC_EVENTS_VERSION;
+  hd.inode = log_st->st_ino;
+  hd.covered = covered;
+  hd.last = *last;
+  for (guint p = 0; p < METRIC_EVENTS_PARAMS; p++)
+    for (guint k = 0; k < METRIC_EVENT_KINDS; k++)
+      hd.count[p][k] = ev->index[p][k].count;
+
+  g_byte_array_append(data, (const guint8*)&hd, sizeof(hd));
+  for (guint p = 0; p < METRIC_EVENTS_PARAMS; p++)
+    for (guint k = 0; k < METRIC_EVENT_KINDS; k++)
+      g_byte_array_append(data, (const guint8*)ev->index[p][k].spans,
+			  ev->index[p][k].count * sizeof(MetricEvent));
+  g_file_set_contents(ipath, (const gchar*)data->data, data->len, NULL);
+
+  g_byte_array_free(data, TRUE);
+  g_free(ipath);
+}
+
+MetricEvents*
+metric_events_open(const gchar* path)
+{
+  MetricEvents* rval;
+  MetricEventsHeader header;
+  MetricEvent* tail;
+  guint tail_count[METRIC_EVENTS_PARAMS][METRIC_EVENT_KINDS] = { { 0 } };
+  MetricEvent* tails[METRIC_EVENTS_PARAMS][METRIC_EVENT_KINDS];
+  struct stat st;
+  guint64 records, covered;
+  gsize n;
+
+  if (path == NULL) return NULL;
+
+  rval = g_new0(MetricEvents, 1);
+  rval->fd = open(path, O_RDONLY);
+  if (rval->fd < 0)
+    goto error;
+  if (fstat(rval->fd, &st) < 0
+      || pread(rval->fd, &header, sizeof(header), 0) != sizeof(header)
+      || !header_is_valid(&header))
+    goto error;
+  g_strlcpy(rval->source, header.source, sizeof(rval->source));
+
+  /* a torn last record of a live log is ignored */
+  records = (st.st_size - sizeof(header)) / sizeof(MetricEvent);
+  covered = index_load(rval, path, rval->fd, &st, records);
+
+  /* only the records appended since the index was stored are read */
+  n = records - covered;
+  if (n == 0)
+    goto done;
+  tail = g_new(MetricEvent, n);
+  if (pread(rval->fd, tail, n * sizeof(MetricEvent),
+	    sizeof(header) + covered * sizeof(MetricEvent))
+      != (ssize_t)(n * sizeof(MetricEvent))) {
+    g_free(tail);
+    goto error;
+  }
+
+  for (gsize i = 0; i < n; i++)
+    if (tail[i].param < METRIC_EVENTS_PARAMS && tail[i].kind < METRIC_EVENT_KINDS)
+      tail_count[tail[i].param][tail[i].kind]++;
+  for (guint p = 0; p < METRIC_EVENTS_PARAMS; p++)
+    for (guint k = 0; k < METRIC_EVENT_KINDS; k++) {
+      tails[p][k] = g_new(MetricEvent, tail_count[p][k] ? tail_count[p][k] : 1);
+      tail_count[p][k] = 0;
+    }
+  for (gsize i = 0; i < n; i++)
+    if (tail[i].param < METRIC_EVENTS_PARAMS && tail[i].kind < METRIC_EVENT_KINDS)
+      tails[tail[i].param][tail[i].kind][tail_count[tail[i].param][tail[i].kind]++] = tail[i];
+
+  for (guint p = 0; p < METRIC_EVENTS_PARAMS; p++)
+    for (guint k = 0; k < METRIC_EVENT_KINDS; k++) {
+      index_update(&rval->index[p][k], tails[p][k], tail_count[p][k]);
+      g_free(tails[p][k]);
+    }
+
+  index_store(rval, path, &st, records, &tail[n - 1]);
+  g_free(tail);
+
+ done:
+  close(rval->fd);
+  rval->fd = -1;
+  return rval;
+
+ error:
+  metric_events_close(rval);
+  return NULL;
+}
+
+const MetricEvent*
+metric_events_overlap(const MetricEvents* ev,
+		      guint param,
+		      MetricEventKind kind,
+		      gint64 from,
+		      gint64 to,
+		      guint* count)
+{
+  const MetricEventIndex* idx;
+  guint lo, hi, first;
+
+  *count = 0;
+  if (param >= METRIC_EVENTS_PARAMS || kind >= METRIC_EVENT_KINDS || from > to)
+    return NULL;
+  idx = &ev->index[param][kind];
+
+  /* the first span ending at or after from */
+  lo = 0, hi = idx->count;
+  while (lo < hi) {
+    guint mid = lo + (hi - lo) / 2;
+
+    if (idx->spans[mid].to < from)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  first = lo;
+
+  /* past the last span starting at or before to */
+  hi = idx->count;
+  while (lo < hi) {
+    guint mid = lo + (hi - lo) / 2;
+
+    if (idx->spans[mid].from <= to)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  *count = lo - first;
+  return *count ? &idx->spans[first] : NULL;
+}
+
+guint
+metric_events_count(const MetricEvents* ev,
+		    guint param,
+		    MetricEventKind kind,
+		    gint64 from,
+		    gint64 to)
+{
+  guint count;
+
+  metric_events_overlap(ev, param, kind, from, to, &count);
+  return count;
+}
+
+void
+metric_events_close(MetricEvents* ev)
+{
+  if (ev == NULL) return;
+
+  if (ev->writer) {
+    for (guint p = 0; p < METRIC_EVENTS_PARAMS; p++)
+      for (guint k = 0; k < METRIC_EVENT_KINDS; k++)
+	if (ev->open[p][k].from != G_MININT64)
+	  writer_close_span(ev, &ev->open[p][k]);
+  } else {
+    for (guint p = 0; p < METRIC_EVENTS_PARAMS; p++)
+      for (guint k = 0; k < METRIC_EVENT_KINDS; k++)
+	if (!ev->index[p][k].mapped)
+	  g_free(ev->index[p][k].spans);
+    if (ev->index_map)
+      munmap(ev->index_map, ev->index_map_size);
+  }
+  if (ev->fd >= 0)
+    close(ev->fd);
+  g_free(ev);
+}
@@ -0,0 +1,118 @@
+/* metricevents.h
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+#ifndef METRICEVENTS_H
+#define METRICEVENTS_H
+
+#include <glib.h>
+
+/* Per-channel log of the error spans: the runs of frames with
+ * a continuous or peak error raised, as flagged by the analysers
+ * (bits of metricshm.h). The writer turns the per-frame flags into
+ * spans and appends each one once it is closed, so the file only
+ * grows on error transitions.
+ *
+ * The reader keeps one array per parameter and kind, sorted and
+ * merged into disjoint spans. Both ends are then sorted, so the
+ * spans overlapping a window are a contiguous run found with two
+ * binary searches.
+ *
+ * The arrays are stored next to the log as PATH.idx along with the
+ * number of records they cover. An open maps them and only reads,
+ * sorts and merges in the records appended since, the index is then
+ * stored again if the directory is writable. */
+
+#define METRIC_EVENTS_MAGIC   0x56454856 /* "VHEV" */
+#define METRIC_EVENTS_VERSION 1
+#define METRIC_EVENTS_INDEX_MAGIC 0x58494856 /* "VHIX" */
+/* black, luma, freeze, diff, blocky (the PARAMETER order) */
+#define METRIC_EVENTS_PARAMS  5
+
+typedef enum {
+  METRIC_EVENT_CONT,
+  METRIC_EVENT_PEAK,
+  METRIC_EVENT_KINDS
+} MetricEventKind;
+
+typedef struct {
+  guint32 magic;
+  guint32 version;
+  guint32 header_size;
+  guint32 record_size;
+  guint32 params;
+  guint32 reserved;
+  /* NUL-terminated element name */
+  gchar   source[32];
+} MetricEventsHeader;
+
+typedef struct {
+  /* times of the first and the last frame of the span in us */
+  gint64  from;
+  gint64  to;
+  guint16 param;
+  guint16 kind;
+  guint32 reserved;
+} MetricEvent;
+
+typedef struct {
+  MetricEvent* spans;
+  guint        count;
+  /* spans point into the stored index */
+  gboolean     mapped;
+} MetricEventIndex;
+
+typedef struct {
+  int              fd;
+  gboolean         writer;
+  /* writer: the spans still open, from == G_MININT64 if none */
+  MetricEvent      open[METRIC_EVENTS_PARAMS][METRIC_EVENT_KINDS];
+  /* reader */
+  gchar            source[32];
+  MetricEventIndex index[METRIC_EVENTS_PARAMS][METRIC_EVENT_KINDS];
+  gpointer         index_map;
+  gsize            index_map_size;
+} MetricEvents;
+
+/* writer side, appends to an existing log */
+MetricEvents* metric_events_create(const gchar* path,
+				   const gchar* source);
+/* flags of one frame, closed spans are written out,
+   FALSE if one of them could not be */
+gboolean      metric_events_track(MetricEvents* ev,
+				  gint64 time,
+				  guint32 flags);
+
+/* reader side, NULL if the file is missing or of another version */
+MetricEvents* metric_events_open(const gchar* path);
+/* the spans overlapping [from, to], they are contiguous in the
+ * index: returns the first one and *count their number */
+const MetricEvent* metric_events_overlap(const MetricEvents* ev,
+					 guint param,
+					 MetricEventKind kind,
+					 gint64 from,
+					 gint64 to,
+					 guint* count);
+guint         metric_events_count(const MetricEvents* ev,
+				  guint param,
+				  MetricEventKind kind,
+				  gint64 from,
+				  gint64 to);
+
+/* the writer closes the open spans at their last frame */
+void          metric_events_close(MetricEvents* ev);
+
+#endif /* METRICEVENTS_H */
@@ -0,0 +1,73 @@
+/* metricevents_tool.c
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+
+/* metric-events PARAM FROM TO FILE...
+ *   for every event log with spans of the parameter (black, luma,
+ *   freeze, diff, blocky) overlapping [FROM, TO] (in us) prints
+ *   "file source cont peak", the numbers of the overlapping
+ *   continuous and peak error spans */
+
+#include "metricevents.h"
+#include <stdio.h>
+
+static const gchar* params[METRIC_EVENTS_PARAMS] =
+  { "black", "luma", "freeze", "diff", "blocky" };
+
+static int
+param_of_string(const gchar* s)
+{
+  for (int p = 0; p < METRIC_EVENTS_PARAMS; p++)
+    if (g_ascii_strcasecmp(s, params[p]) == 0)
+      return p;
+  return -1;
+}
+
+int
+main(int argc, char** argv)
+{
+  gint64 from, to;
+  int p, rc = 0;
+
+  if (argc < 5) {
+    fprintf(stderr, "usage: %s PARAM FROM TO FILE...\n", argv[0]);
+    return 2;
+  }
+  if ((p = param_of_string(argv[1])) < 0) {
+    fprintf(stderr, "unknown parameter %s\n", argv[1]);
+    return 2;
+  }
+  from = g_ascii_strtoll(argv[2], NULL, 10);
+  to = g_ascii_strtoll(argv[3], NULL, 10);
+
+  for (int i = 4; i < argc; i++) {
+    MetricEvents* ev = metric_events_open(argv[i]);
+    guint cont, peak;
+
+    if (ev == NULL) {
+      fprintf(stderr, "%s is not a metric event log\n", argv[i]);
+      rc = 1;
+      continue;
+    }
+    cont = metric_events_count(ev, p, METRIC_EVENT_CONT, from, to);
+    peak = metric_events_count(ev, p, METRIC_EVENT_PEAK, from, to);
+    if (cont || peak)
+      printf("%s %s %u %u\n", argv[i], ev->source, cont, peak);
+    metric_events_close(ev);
+  }
+  return rc;
+}
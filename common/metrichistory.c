@@ -0,0 +1,396 @@
+/* metrichistory.c
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+
+#include "metrichistory.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+G_STATIC_ASSERT (sizeof(MetricHistoryHeader) <= METRIC_HISTORY_HEADER_SIZE);
+G_STATIC_ASSERT (sizeof(MetricHistoryChunk) == 64);
+
+static gsize
+page_size(void)
+{
+  return sysconf(_SC_PAGESIZE);
+}
+
+static gsize
+page_round(gsize size)
+{
+  gsize page = page_size();
+
+  return (size + page - 1) / page * page;
+}
+
+static gsize
+chunk_bytes(guint chunk_frames)
+{
+  return sizeof(MetricHistoryChunk)
+    + chunk_frames * (sizeof(gint64)
+		      + sizeof(gfloat) * METRIC_HISTORY_PARAMS
+		      + sizeof(guint32));
+}
+
+/* The writer pads the header and the chunks to its page size, a file
+   written on a system of smaller pages is still read by mapping from
+   the page the data starts in */
+static gboolean
+header_is_valid(const MetricHistoryHeader* hd)
+{
+  return hd->magic == METRIC_HISTORY_MAGIC
+    && hd->version == METRIC_HISTORY_VERSION
+    && hd->header_size >= METRIC_HISTORY_HEADER_SIZE
+    && hd->header_size % 8 == 0
+    && hd->params == METRIC_HISTORY_PARAMS
+    && hd->chunk_frames > 0
+    && hd->chunk_size >= chunk_bytes(hd->chunk_frames)
+    && hd->chunk_size % 8 == 0;
+}
+
+/* length bytes at offset, which needs not be page aligned */
+static void*
+map_range(int fd, gsize length, goffset offset, int prot)
+{
+  gsize delta = offset % page_size();
+  guint8* mem = mmap(NULL, length + delta, prot, MAP_SHARED, fd, offset - delta);
+
+  return mem == MAP_FAILED ? NULL : mem + delta;
+}
+
+static void
+unmap_range(void* mem, gsize length, goffset offset)
+{
+  gsize delta = offset % page_size();
+
+  munmap((guint8*)mem - delta, length + delta);
+}
+
+static goffset
+chunk_offset(const MetricHistory* h, guint64 n)
+{
+  return h->header_size + n * h->chunk_size;
+}
+
+static MetricHistoryChunk*
+writer_map_chunk(MetricHistory* h, guint64 n)
+{
+  return map_range(h->fd, h->chunk_size, chunk_offset(h, n),
+		   PROT_READ | PROT_WRITE);
+}
+
+MetricHistory*
+metric_history_create(const gchar* path,
+		      const gchar* source,
+		      guint chunk_frames)
+{
+  MetricHistory* rval;
+  struct stat st;
+  void* mem;
+
+  if (path == NULL || chunk_frames == 0) return NULL;
+
+  rval = g_new0(MetricHistory, 1);
+  rval->writer = TRUE;
+  rval->last = G_MININT64;
+  rval->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (rval->fd < 0)
+    goto error;
+  /* a single writer per file, held until the close */
+  if (flock(rval->fd, LOCK_EX | LOCK_NB) < 0)
+    goto error;
+  if (fstat(rval->fd, &st) < 0)
+    goto error;
+  /* never clobber a file that is not ours */
+  if (st.st_size > 0 && st.st_size < METRIC_HISTORY_HEADER_SIZE)
+    goto error;
+  if (st.st_size == 0
+      && ftruncate(rval->fd, MAX(page_round(sizeof(MetricHistoryHeader)),
+				 METRIC_HISTORY_HEADER_SIZE)) < 0)
+    goto error;
+
+  mem = mmap(NULL, sizeof(MetricHistoryHeader), PROT_READ | PROT_WRITE,
+	     MAP_SHARED, rval->fd, 0);
+  if (mem == MAP_FAILED)
+    goto error;
+  rval->header = (MetricHistoryHeader*)mem;
+
+  if (st.st_size == 0) {
+    /* both page aligned here, the chunks are then mapped as they are */
+    rval->header->version = METRIC_HISTORY_VERSION;
+    rval->header->header_size = MAX(page_round(sizeof(MetricHistoryHeader)),
+				    METRIC_HISTORY_HEADER_SIZE);
+    rval->header->chunk_frames = chunk_frames;
+    rval->header->chunk_size = page_round(chunk_bytes(chunk_frames));
+    rval->header->params = METRIC_HISTORY_PARAMS;
+    rval->header->chunks = 0;
+    g_strlcpy(rval->header->source, source ? source : "",
+	      sizeof(rval->header->source));
+    /* readers check magic last */
+    __atomic_store_n(&rval->header->magic, METRIC_HISTORY_MAGIC, __ATOMIC_RELEASE);
+  } else if (!header_is_valid(rval->header)) {
+    goto error;
+  }
+
+  /* the layout of an existing file wins */
+  rval->header_size = rval->header->header_size;
+  rval->chunk_frames = rval->header->chunk_frames;
+  rval->chunk_size = rval->header->chunk_size;
+  rval->size = chunk_offset(rval, rval->header->chunks);
+
+  if (rval->header->chunks > 0) {
+    rval->current = writer_map_chunk(rval, rval->header->chunks - 1);
+    if (rval->current == NULL)
+      goto error;
+    if (rval->current->frames > 0)
+      rval->last = rval->current->last;
+  }
+  return rval;
+
+ error:
+  if (rval->header)
+    munmap(rval->header, sizeof(MetricHistoryHeader));
+  if (rval->fd >= 0)
+    close(rval->fd);
+  g_free(rval);
+  return NULL;
+}
+
+static gboolean
+writer_next_chunk(MetricHistory* h)
+{
+  guint64 n = h->header->chunks;
+
+  if (h->current)
+    unmap_range(h->current, h->chunk_size, chunk_offset(h, n - 1));
+  h->current = NULL;
+
+  /* the new pages read as zeroes, frames included */
+  if (ftruncate(h->fd, chunk_offset(h, n + 1)) < 0)
+    return FALSE;
+  h->current = writer_map_chunk(h, n);
+  if (h->current == NULL)
+    return FALSE;
+  h->size = chunk_offset(h, n + 1);
+  __atomic_store_n(&h->header->chunks, n + 1, __ATOMIC_RELEASE);
+  return TRUE;
+}
+
+gboolean
+metric_history_append(MetricHistory* h,
+		      gint64 time,
+		      const gfloat values[METRIC_HISTORY_PARAMS],
+		      guint32 flags)
+{
+  MetricHistoryChunk* c;
+  gint64* times;
+  gfloat* column;
+  guint i;
+
+  if (h->current == NULL || h->current->frames >= h->chunk_frames)
+    if (!writer_next_chunk(h))
+      return FALSE;
+
+  c = h->current;
+  i = c->frames;
+  /* keeps the binary searches valid across wall-clock steps */
+  if (time < h->last)
+    time = h->last;
+
+  times = (gint64*)(c + 1);
+  column = (gfloat*)(times + h->chunk_frames);
+  times[i] = time;
+  for (guint p = 0; p <= METRIC_HISTORY_PARAMS; p++, column += h->chunk_frames) {
+    if (p < METRIC_HISTORY_PARAMS)
+      column[i] = values[p];
+    else
+      ((guint32*)column)[i] = flags;
+  }
+  if (i == 0)
+    c->first = time;
+  __atomic_store_n(&c->last, time, __ATOMIC_RELAXED);
+  __atomic_store_n(&c->frames, i + 1, __ATOMIC_RELEASE);
+  h->last = time;
+  return TRUE;
+}
+
+static gboolean
+reader_map_chunks(MetricHistory* h, gsize size)
+{
+  guint64 n = size > h->header_size ? (size - h->header_size) / h->chunk_size : 0;
+  void* mem;
+
+  if (h->chunks)
+    unmap_range(h->chunks, h->mapped_chunks * h->chunk_size, h->header_size);
+  h->chunks = NULL;
+  h->mapped_chunks = 0;
+  h->size = h->header_size;
+
+  if (n == 0)
+    return TRUE;
+  mem = map_range(h->fd, n * h->chunk_size, h->header_size, PROT_READ);
+  if (mem == NULL)
+    return FALSE;
+  h->chunks = (guint8*)mem;
+  h->mapped_chunks = n;
+  h->size = chunk_offset(h, n);
+  return TRUE;
+}
+
+MetricHistory*
+metric_history_open(const gchar* path)
+{
+  MetricHistory* rval;
+  struct stat st;
+  void* mem;
+
+  if (path == NULL) return NULL;
+
+  rval = g_new0(MetricHistory, 1);
+  rval->fd = open(path, O_RDONLY);
+  if (rval->fd < 0)
+    goto error;
+  if (fstat(rval->fd, &st) < 0 || st.st_size < METRIC_HISTORY_HEADER_SIZE)
+    goto error;
+
+  mem = mmap(NULL, sizeof(MetricHistoryHeader), PROT_READ, MAP_SHARED, rval->fd, 0);
+  if (mem == MAP_FAILED)
+    goto error;
+  rval->header = (MetricHistoryHeader*)mem;
+  if (__atomic_load_n(&rval->header->magic, __ATOMIC_ACQUIRE) != METRIC_HISTORY_MAGIC
+      || !header_is_valid(rval->header))
+    goto error;
+
+  rval->header_size = rval->header->header_size;
+  rval->chunk_frames = rval->header->chunk_frames;
+  rval->chunk_size = rval->header->chunk_size;
+  if (!reader_map_chunks(rval, st.st_size))
+    goto error;
+  return rval;
+
+ error:
+  if (rval->header)
+    munmap(rval->header, sizeof(MetricHistoryHeader));
+  if (rval->fd >= 0)
+    close(rval->fd);
+  g_free(rval);
+  return NULL;
+}
+
+gboolean
+metric_history_refresh(MetricHistory* h)
+{
+  struct stat st;
+
+  if (h->writer || fstat(h->fd, &st) < 0)
+    return FALSE;
+  if ((gsize)st.st_size <= h->size)
+    return TRUE;
+  return reader_map_chunks(h, st.st_size);
+}
+
+guint64
+metric_history_chunks(const MetricHistory* h)
+{
+  guint64 n = __atomic_load_n(&h->header->chunks, __ATOMIC_ACQUIRE);
+
+  /* the file may have grown past the reader's mapping */
+  return MIN(n, h->mapped_chunks);
+}
+
+guint64
+metric_history_find_chunk(const MetricHistory* h,
+			  gint64 time)
+{
+  guint64 lo = 0, hi = metric_history_chunks(h);
+
+  /* the first chunk ending at or after time */
+  while (lo < hi) {
+    guint64 mid = lo + (hi - lo) / 2;
+    const MetricHistoryChunk* c = metric_history_chunk(h, mid);
+
+    if (__atomic_load_n(&c->frames, __ATOMIC_ACQUIRE) > 0
+	&& __atomic_load_n(&c->last, __ATOMIC_RELAXED) >= time)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+/* index of the first time in t[0, n) for which before is FALSE */
+static guint
+times_bound(const gint64* t, guint n, gint64 time, gboolean upper)
+{
+  guint lo = 0, hi = n;
+
+  while (lo < hi) {
+    guint mid = lo + (hi - lo) / 2;
+
+    if (upper ? t[mid] <= time : t[mid] < time)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+guint
+metric_history_chunk_range(const MetricHistory* h,
+			   guint64 n,
+			   gint64 from,
+			   gint64 to,
+			   guint* first)
+{
+  const MetricHistoryChunk* c;
+  const gint64* times;
+  guint frames, lo, hi;
+
+  *first = 0;
+  if (n >= metric_history_chunks(h) || from > to)
+    return 0;
+
+  c = metric_history_chunk(h, n);
+  frames = __atomic_load_n(&c->frames, __ATOMIC_ACQUIRE);
+  times = metric_history_chunk_times(h, c);
+  lo = times_bound(times, frames, from, FALSE);
+  hi = times_bound(times, frames, to, TRUE);
+  *first = lo;
+  return hi > lo ? hi - lo : 0;
+}
+
+void
+metric_history_close(MetricHistory* h)
+{
+  if (h == NULL) return;
+
+  if (h->writer) {
+    if (h->current)
+      unmap_range(h->current, h->chunk_size,
+		  chunk_offset(h, h->header->chunks - 1));
+  } else if (h->chunks) {
+    unmap_range(h->chunks, h->mapped_chunks * h->chunk_size, h->header_size);
+  }
+  munmap(h->header, sizeof(MetricHistoryHeader));
+  /* the lock goes along with the descriptor */
+  close(h->fd);
+  g_free(h);
+}
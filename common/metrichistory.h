@@ -0,0 +1,145 @@
+/* metrichistory.h
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+#ifndef METRICHISTORY_H
+#define METRICHISTORY_H
+
+#include <glib.h>
+
+/* Append-only per-channel history of the frame measurements,
+ * kept in a regular file and read through mmap.
+ *
+ * The file is a MetricHistoryHeader padded to header_size bytes
+ * followed by fixed-size chunks of chunk_frames frames each. The
+ * writer pads both to its page size, header_size and chunk_size
+ * are recorded so that systems of other page sizes read the file. A chunk is
+ * a MetricHistoryChunk, then the time column, one value column
+ * per parameter and the flags column, so a range of one metric
+ * is a contiguous array. Chunks are in time order (the writer
+ * never lets the time go backwards), so a time lookup is
+ * a binary search over the chunks and then within one.
+ *
+ * A single writer holds an flock on the file and maps only the
+ * chunk being filled, it publishes frames with release stores,
+ * readers may follow a live file with metric_history_refresh. */
+
+#define METRIC_HISTORY_MAGIC   0x484d4856 /* "VHMH" */
+#define METRIC_HISTORY_VERSION 1
+/* black, luma, freeze, diff, blocky (the PARAMETER order) */
+#define METRIC_HISTORY_PARAMS  5
+/* header_size at least, the page size of the writer if larger */
+#define METRIC_HISTORY_HEADER_SIZE 4096
+/* about 2.7 min at 25 fps, 132 KiB */
+#define METRIC_HISTORY_CHUNK_FRAMES 4096
+
+typedef struct {
+  guint32 magic;
+  guint32 version;
+  guint32 header_size;
+  guint32 chunk_size;
+  guint32 chunk_frames;
+  guint32 params;
+  /* chunks started, only the last one may be partial */
+  guint64 chunks;
+  /* NUL-terminated element name */
+  gchar   source[32];
+} MetricHistoryHeader;
+
+typedef struct {
+  /* times of the first and the last frame in us */
+  gint64  first;
+  gint64  last;
+  guint32 frames;
+  guint32 reserved[11];
+} MetricHistoryChunk;
+
+typedef struct {
+  gboolean             writer;
+  int                  fd;
+  gsize                size;
+  guint32              header_size;
+  guint32              chunk_size;
+  guint32              chunk_frames;
+  MetricHistoryHeader* header;
+  /* reader: all the chunks mapped, writer: the current one */
+  guint8*              chunks;
+  guint64              mapped_chunks;
+  MetricHistoryChunk*  current;
+  /* writer: time of the last frame appended */
+  gint64               last;
+} MetricHistory;
+
+/* writer side, an existing file of the same layout is appended to,
+   NULL if another writer has it open */
+MetricHistory* metric_history_create(const gchar* path,
+				     const gchar* source,
+				     guint chunk_frames);
+/* flags use the metricshm.h bits */
+gboolean       metric_history_append(MetricHistory* h,
+				     gint64 time,
+				     const gfloat values[METRIC_HISTORY_PARAMS],
+				     guint32 flags);
+
+/* reader side, NULL if the file is missing or of another version */
+MetricHistory* metric_history_open(const gchar* path);
+/* maps the chunks appended since the open */
+gboolean       metric_history_refresh(MetricHistory* h);
+guint64        metric_history_chunks(const MetricHistory* h);
+
+static inline const MetricHistoryChunk*
+metric_history_chunk(const MetricHistory* h, guint64 n)
+{
+  return (const MetricHistoryChunk*)(h->chunks + n * h->chunk_size);
+}
+
+static inline const gint64*
+metric_history_chunk_times(const MetricHistory* h,
+			   const MetricHistoryChunk* c)
+{
+  return (const gint64*)(c + 1);
+}
+
+static inline const gfloat*
+metric_history_chunk_values(const MetricHistory* h,
+			    const MetricHistoryChunk* c,
+			    guint p)
+{
+  return (const gfloat*)(metric_history_chunk_times(h, c) + h->chunk_frames)
+    + (gsize)p * h->chunk_frames;
+}
+
+static inline const guint32*
+metric_history_chunk_flags(const MetricHistory* h,
+			   const MetricHistoryChunk* c)
+{
+  return (const guint32*)metric_history_chunk_values(h, c, METRIC_HISTORY_PARAMS);
+}
+
+/* the first chunk that may hold frames at or after time */
+guint64        metric_history_find_chunk(const MetricHistory* h,
+					 gint64 time);
+/* the frames of the chunk n within [from, to]: *first is the index
+ * of the first one in the chunk columns, returns their number */
+guint          metric_history_chunk_range(const MetricHistory* h,
+					  guint64 n,
+					  gint64 from,
+					  gint64 to,
+					  guint* first);
+
+void           metric_history_close(MetricHistory* h);
+
+#endif /* METRICHISTORY_H */
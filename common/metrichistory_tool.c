@@ -0,0 +1,167 @@
+/* metrichistory_tool.c
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+
+/* metric-history FILE
+ *   prints the file layout and the time span it covers
+ * metric-history FILE PARAM [FROM [TO]]
+ *   prints "time value flags" for every frame of the parameter
+ *   (black, luma, freeze, diff, blocky) with the time, in us,
+ *   within [FROM, TO]
+ * metric-history FILE export [FROM [TO]]
+ *   writes the frames within [FROM, TO] to stdout as metriccodec
+ *   blocks, one per chunk, the block headers delimit them. The
+ *   values and the flags are encoded, the file is not rewritten */
+
+#include "metrichistory.h"
+#include "metriccodec.h"
+#include <stdio.h>
+#include <string.h>
+
+static const gchar* params[METRIC_HISTORY_PARAMS] =
+  { "black", "luma", "freeze", "diff", "blocky" };
+
+static int
+param_of_string(const gchar* s)
+{
+  for (int p = 0; p < METRIC_HISTORY_PARAMS; p++)
+    if (g_ascii_strcasecmp(s, params[p]) == 0)
+      return p;
+  return -1;
+}
+
+static void
+print_info(const MetricHistory* h)
+{
+  guint64 chunks = metric_history_chunks(h);
+  guint64 frames = 0;
+
+  for (guint64 n = 0; n < chunks; n++)
+    frames += metric_history_chunk(h, n)->frames;
+
+  printf("source:       %s\n", h->header->source);
+  printf("chunk frames: %u\n", h->chunk_frames);
+  printf("chunks:       %llu\n", (unsigned long long)chunks);
+  printf("frames:       %llu\n", (unsigned long long)frames);
+  if (frames > 0)
+    printf("time:         %lld .. %lld\n",
+	   (long long)metric_history_chunk(h, 0)->first,
+	   (long long)metric_history_chunk(h, chunks - 1)->last);
+}
+
+static void
+print_range(const MetricHistory* h,
+	    guint p,
+	    gint64 from,
+	    gint64 to)
+{
+  guint64 chunks = metric_history_chunks(h);
+
+  for (guint64 n = metric_history_find_chunk(h, from); n < chunks; n++) {
+    const MetricHistoryChunk* c = metric_history_chunk(h, n);
+    const gint64* times = metric_history_chunk_times(h, c);
+    const gfloat* values = metric_history_chunk_values(h, c, p);
+    const guint32* flags = metric_history_chunk_flags(h, c);
+    guint first;
+    guint count = metric_history_chunk_range(h, n, from, to, &first);
+
+    if (count == 0 && c->first > to)
+      break;
+    for (guint i = first; i < first + count; i++)
+      printf("%lld %f %u\n", (long long)times[i], values[i], flags[i]);
+  }
+}
+
+G_STATIC_ASSERT (METRIC_CODEC_PARAMS == METRIC_HISTORY_PARAMS);
+
+static int
+export_range(const MetricHistory* h,
+	     gint64 from,
+	     gint64 to)
+{
+  MetricEncoder* enc = metric_encoder_new(h->chunk_frames);
+  guint8* block = g_malloc(metric_codec_max_size(h->chunk_frames));
+  guint64 chunks = metric_history_chunks(h);
+  int rc = 0;
+
+  for (guint64 n = metric_history_find_chunk(h, from); n < chunks; n++) {
+    const MetricHistoryChunk* c = metric_history_chunk(h, n);
+    const gint64* times = metric_history_chunk_times(h, c);
+    const guint32* flags = metric_history_chunk_flags(h, c);
+    guint first;
+    guint count = metric_history_chunk_range(h, n, from, to, &first);
+    gsize size;
+
+    if (count == 0 && c->first > to)
+      break;
+    if (count == 0)
+      continue;
+    for (guint i = first; i < first + count; i++) {
+      gfloat v[METRIC_HISTORY_PARAMS];
+
+      for (guint p = 0; p < METRIC_HISTORY_PARAMS; p++)
+	v[p] = metric_history_chunk_values(h, c, p)[i];
+      metric_encoder_push(enc, times[i], v, flags[i]);
+    }
+    size = metric_encoder_finish(enc, block);
+    if (fwrite(block, 1, size, stdout) != size) {
+      rc = 1;
+      break;
+    }
+  }
+  metric_encoder_delete(enc);
+  g_free(block);
+  return rc;
+}
+
+int
+main(int argc, char** argv)
+{
+  MetricHistory* h;
+  gint64 from = G_MININT64, to = G_MAXINT64;
+  gboolean export = FALSE;
+  int p = -1, rc = 0;
+
+  if (argc < 2 || argc > 5) {
+    fprintf(stderr, "usage: %s FILE [PARAM|export [FROM [TO]]]\n", argv[0]);
+    return 2;
+  }
+  if (argc > 2 && g_ascii_strcasecmp(argv[2], "export") == 0)
+    export = TRUE;
+  else if (argc > 2 && (p = param_of_string(argv[2])) < 0) {
+    fprintf(stderr, "unknown parameter %s\n", argv[2]);
+    return 2;
+  }
+  if (argc > 3)
+    from = g_ascii_strtoll(argv[3], NULL, 10);
+  if (argc > 4)
+    to = g_ascii_strtoll(argv[4], NULL, 10);
+
+  h = metric_history_open(argv[1]);
+  if (h == NULL) {
+    fprintf(stderr, "%s is not a metric history file\n", argv[1]);
+    return 1;
+  }
+  if (export)
+    rc = export_range(h, from, to);
+  else if (p < 0)
+    print_info(h);
+  else
+    print_range(h, p, from, to);
+  metric_history_close(h);
+  return rc;
+}
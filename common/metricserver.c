@@ -0,0 +1,559 @@
+/* metricserver.c
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+
+#define _GNU_SOURCE
+#include "metricserver.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* records a channel keeps until the server thread takes them */
+#define CHANNEL_PENDING_MAX 4096
+/* bytes queued for a client before its batches are dropped */
+#define CLIENT_OUT_MAX      (1 << 20)
+#define CLIENT_IN_MAX       4096
+#define FLUSH_INTERVAL_MS   100
+
+typedef struct {
+  gint64  time;
+  guint32 flags;
+  gfloat  values[METRIC_SRV_PARAMS];
+} Record;
+
+struct _MetricChannel {
+  MetricServer* server;
+  guint32       id;
+  gchar*        name;
+  GMutex        lock;
+  GArray*       pending;
+  guint32       overflow;
+};
+
+typedef struct {
+  gchar*  pattern;
+  guint32 metrics;
+} Filter;
+
+typedef struct {
+  int         fd;
+  GByteArray* in;
+  GByteArray* out;
+  guint       out_pos;
+  GArray*     filters;
+  GHashTable* announced;
+  guint32     dropped;
+  gboolean    dead;
+} Client;
+
+struct _MetricServer {
+  gchar*     path;
+  int        listen_fd;
+  int        wake[2];
+  GThread*   thread;
+  volatile gint running;
+  /* subscribers, so that idle channels skip the push */
+  volatile gint clients_n;
+  /* channels, taken by the server thread while flushing */
+  GMutex     lock;
+  GPtrArray* channels;
+  guint32    next_id;
+  /* server thread only */
+  GPtrArray* clients;
+  GArray*    scratch;
+};
+
+static GMutex      servers_lock;
+static GHashTable* servers = NULL;
+
+static Client*
+client_new(int fd)
+{
+  Client* c = g_new0(Client, 1);
+
+  c->fd = fd;
+  c->in = g_byte_array_new();
+  c->out = g_byte_array_new();
+  c->filters = g_array_new(FALSE, FALSE, sizeof(Filter));
+  c->announced = g_hash_table_new(g_direct_hash, g_direct_equal);
+  return c;
+}
+
+static void
+client_clear_filters(Client* c)
+{
+  for (guint i = 0; i < c->filters->len; i++)
+    g_free(g_array_index(c->filters, Filter, i).pattern);
+  g_array_set_size(c->filters, 0);
+}
+
+static void
+client_free(gpointer p)
+{
+  Client* c = (Client*)p;
+
+  close(c->fd);
+  client_clear_filters(c);
+  g_array_free(c->filters, TRUE);
+  g_hash_table_destroy(c->announced);
+  g_byte_array_free(c->in, TRUE);
+  g_byte_array_free(c->out, TRUE);
+  g_free(c);
+}
+
+static void
+client_queue(Client* c, gconstpointer data, guint size)
+{
+  g_byte_array_append(c->out, (const guint8*)data, size);
+}
+
+static guint32
+client_metrics(Client* c, const gchar* name)
+{
+  guint32 metrics = 0;
+
+  for (guint i = 0; i < c->filters->len; i++) {
+    Filter* f = &g_array_index(c->filters, Filter, i);
+    if (g_pattern_match_simple(f->pattern, name))
+      metrics |= f->metrics;
+  }
+  return metrics & METRIC_SRV_ALL_PARAMS;
+}
+
+static void
+client_send_batch(Client* c,
+		  MetricChannel* ch,
+		  const Record* rec,
+		  guint count,
+		  guint32 metrics)
+{
+  guint k = __builtin_popcount(metrics);
+  gsize rec_size = sizeof(gint64) + sizeof(guint32) + sizeof(gfloat) * k;
+  gsize size = sizeof(MetricSrvBatch) + rec_size * count;
+  gboolean announce = !g_hash_table_contains(c->announced, GUINT_TO_POINTER(ch->id));
+  MetricSrvBatch batch;
+
+  /* a slow reader loses the whole batch, the analysis goes on */
+  if (c->out->len - c->out_pos + size + sizeof(MetricSrvChannel) > CLIENT_OUT_MAX) {
+    c->dropped += count;
+    return;
+  }
+
+  if (announce) {
+    MetricSrvChannel msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.header.size = sizeof(msg);
+    msg.header.type = METRIC_SRV_CHANNEL;
+    msg.channel = ch->id;
+    g_strlcpy(msg.name, ch->name, sizeof(msg.name));
+    client_queue(c, &msg, sizeof(msg));
+    g_hash_table_add(c->announced, GUINT_TO_POINTER(ch->id));
+  }
+
+  batch.header.size = size;
+  batch.header.type = METRIC_SRV_BATCH;
+  batch.channel = ch->id;
+  batch.metrics = metrics;
+  batch.count = count;
+  batch.dropped = c->dropped;
+  c->dropped = 0;
+  client_queue(c, &batch, sizeof(batch));
+
+  for (guint i = 0; i < count; i++) {
+    client_queue(c, &rec[i].time, sizeof(gint64));
+    client_queue(c, &rec[i].flags, sizeof(guint32));
+    for (guint p = 0; p < METRIC_SRV_PARAMS; p++)
+      if (metrics & (1u << p))
+	client_queue(c, &rec[i].values[p], sizeof(gfloat));
+  }
+}
+
+static void
+client_handle(Client* c, const MetricSrvHeader* msg)
+{
+  switch (msg->type) {
+  case METRIC_SRV_SUBSCRIBE: {
+    const MetricSrvSubscribe* sub = (const MetricSrvSubscribe*)msg;
+    Filter f;
+
+    if (msg->size != sizeof(MetricSrvSubscribe)) {
+      c->dead = TRUE;
+      return;
+    }
+    f.pattern = g_strndup(sub->pattern, sizeof(sub->pattern));
+    f.metrics = sub->metrics;
+    g_array_append_val(c->filters, f);
+    break;
+  }
+  case METRIC_SRV_UNSUBSCRIBE:
+    client_clear_filters(c);
+    break;
+  default:
+    /* unknown requests are ignored */
+    break;
+  }
+}
+
+static void
+client_read(Client* c)
+{
+  guint8 buf[1024];
+  gssize n;
+
+  while ((n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+    g_byte_array_append(c->in, buf, n);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+    c->dead = TRUE;
+    return;
+  }
+
+  while (!c->dead && c->in->len >= sizeof(MetricSrvHeader)) {
+    MetricSrvHeader header;
+
+    memcpy(&header, c->in->data, sizeof(header));
+    if (header.size < sizeof(header) || header.size > CLIENT_IN_MAX) {
+      c->dead = TRUE;
+      return;
+    }
+    if (c->in->len < header.size)
+      break;
+    if (header.size <= sizeof(MetricSrvSubscribe)) {
+      MetricSrvSubscribe msg;
+      memcpy(&msg, c->in->data, header.size);
+      client_handle(c, &msg.header);
+    }
+    g_byte_array_remove_range(c->in, 0, header.size);
+  }
+}
+
+static void
+client_write(Client* c)
+{
+  while (c->out_pos < c->out->len) {
+    gssize n = send(c->fd, c->out->data + c->out_pos, c->out->len - c->out_pos,
+		    MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	c->dead = TRUE;
+      break;
+    }
+    c->out_pos += n;
+  }
+  if (c->out_pos == c->out->len) {
+    g_byte_array_set_size(c->out, 0);
+    c->out_pos = 0;
+  } else if (c->out_pos > c->out->len / 2) {
+    g_byte_array_remove_range(c->out, 0, c->out_pos);
+    c->out_pos = 0;
+  }
+}
+
+static void
+server_accept(MetricServer* srv)
+{
+  int fd;
+
+  while ((fd = accept4(srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    Client* c = client_new(fd);
+    MetricSrvHello hello;
+
+    hello.header.size = sizeof(hello);
+    hello.header.type = METRIC_SRV_HELLO;
+    hello.version = METRIC_SRV_VERSION;
+    hello.params = METRIC_SRV_PARAMS;
+    client_queue(c, &hello, sizeof(hello));
+    g_ptr_array_add(srv->clients, c);
+  }
+  g_atomic_int_set(&srv->clients_n, srv->clients->len);
+}
+
+static void
+server_flush(MetricServer* srv)
+{
+  g_mutex_lock(&srv->lock);
+  for (guint i = 0; i < srv->channels->len; i++) {
+    MetricChannel* ch = g_ptr_array_index(srv->channels, i);
+    guint32 overflow;
+
+    /* the channel lock is only held for the copy */
+    g_mutex_lock(&ch->lock);
+    g_array_set_size(srv->scratch, 0);
+    g_array_append_vals(srv->scratch, ch->pending->data, ch->pending->len);
+    g_array_set_size(ch->pending, 0);
+    overflow = ch->overflow;
+    ch->overflow = 0;
+    g_mutex_unlock(&ch->lock);
+
+    if (srv->scratch->len == 0 && overflow == 0)
+      continue;
+
+    for (guint j = 0; j < srv->clients->len; j++) {
+      Client* c = g_ptr_array_index(srv->clients, j);
+      guint32 metrics = client_metrics(c, ch->name);
+
+      if (metrics == 0)
+	continue;
+      c->dropped += overflow;
+      if (srv->scratch->len)
+	client_send_batch(c, ch, (const Record*)srv->scratch->data,
+			  srv->scratch->len, metrics);
+    }
+  }
+  g_mutex_unlock(&srv->lock);
+}
+
+static gpointer
+server_loop(gpointer data)
+{
+  MetricServer* srv = (MetricServer*)data;
+  GArray* fds = g_array_new(FALSE, FALSE, sizeof(struct pollfd));
+  gint64 next_flush = g_get_monotonic_time() + FLUSH_INTERVAL_MS * 1000;
+
+  while (g_atomic_int_get(&srv->running)) {
+    struct pollfd pfd;
+    gint64 now;
+    int timeout;
+
+    g_array_set_size(fds, 0);
+    pfd.fd = srv->listen_fd;
+    pfd.events = POLLIN;
+    g_array_append_val(fds, pfd);
+    pfd.fd = srv->wake[0];
+    g_array_append_val(fds, pfd);
+    for (guint i = 0; i < srv->clients->len; i++) {
+      Client* c = g_ptr_array_index(srv->clients, i);
+      pfd.fd = c->fd;
+      pfd.events = POLLIN | (c->out_pos < c->out->len ? POLLOUT : 0);
+      g_array_append_val(fds, pfd);
+    }
+
+    now = g_get_monotonic_time();
+    timeout = next_flush > now ? (int)((next_flush - now) / 1000) : 0;
+    if (poll((struct pollfd*)fds->data, fds->len, timeout) < 0 && errno != EINTR)
+      break;
+
+    if (g_array_index(fds, struct pollfd, 1).revents & POLLIN) {
+      guint8 buf[64];
+      while (read(srv->wake[0], buf, sizeof(buf)) > 0)
+	;
+    }
+    if (g_array_index(fds, struct pollfd, 0).revents & POLLIN)
+      server_accept(srv);
+
+    for (guint i = 2; i < fds->len; i++) {
+      struct pollfd* p = &g_array_index(fds, struct pollfd, i);
+      Client* c = g_ptr_array_index(srv->clients, i - 2);
+      if (p->revents & (POLLIN | POLLHUP | POLLERR))
+	client_read(c);
+    }
+
+    if (g_get_monotonic_time() >= next_flush) {
+      server_flush(srv);
+      next_flush = g_get_monotonic_time() + FLUSH_INTERVAL_MS * 1000;
+    }
+
+    for (guint i = 0; i < srv->clients->len; ) {
+      Client* c = g_ptr_array_index(srv->clients, i);
+      if (!c->dead)
+	client_write(c);
+      if (c->dead)
+	g_ptr_array_remove_index_fast(srv->clients, i);
+      else
+	i++;
+    }
+    g_atomic_int_set(&srv->clients_n, srv->clients->len);
+  }
+
+  g_array_free(fds, TRUE);
+  return NULL;
+}
+
+/* TRUE if a server, of this process or of another one, accepts
+   connections at addr. A socket nobody listens on is a stale one */
+static gboolean
+server_is_live(const struct sockaddr_un* addr)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  gboolean live;
+
+  if (fd < 0)
+    return FALSE;
+  live = connect(fd, (const struct sockaddr*)addr, sizeof(*addr)) == 0
+    || errno == EAGAIN;
+  close(fd);
+  return live;
+}
+
+static MetricServer*
+server_new(const gchar* path)
+{
+  MetricServer* srv;
+  struct sockaddr_un addr;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return NULL;
+
+  srv = g_new0(MetricServer, 1);
+  srv->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (srv->listen_fd < 0)
+    goto error;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  /* never taken over from a live server */
+  if (server_is_live(&addr))
+    goto error_close;
+  /* a stale socket of a previous run */
+  unlink(path);
+  if (bind(srv->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+      || listen(srv->listen_fd, 16) < 0)
+    goto error_close;
+  if (pipe2(srv->wake, O_NONBLOCK | O_CLOEXEC) < 0)
+    goto error_unlink;
+
+  srv->path = g_strdup(path);
+  g_mutex_init(&srv->lock);
+  srv->channels = g_ptr_array_new();
+  srv->clients = g_ptr_array_new_with_free_func(client_free);
+  srv->scratch = g_array_new(FALSE, FALSE, sizeof(Record));
+  srv->next_id = 1;
+  srv->running = 1;
+  srv->thread = g_thread_new("metricserver", server_loop, srv);
+  return srv;
+
+ error_unlink:
+  unlink(path);
+ error_close:
+  close(srv->listen_fd);
+ error:
+  g_free(srv);
+  return NULL;
+}
+
+static void
+server_free(MetricServer* srv)
+{
+  gssize n;
+
+  g_atomic_int_set(&srv->running, 0);
+  /* the pipe is non-blocking, a full one wakes the thread anyway */
+  n = write(srv->wake[1], "", 1);
+  (void)n;
+  g_thread_join(srv->thread);
+
+  g_ptr_array_free(srv->clients, TRUE);
+  g_ptr_array_free(srv->channels, TRUE);
+  g_array_free(srv->scratch, TRUE);
+  g_mutex_clear(&srv->lock);
+  close(srv->wake[0]);
+  close(srv->wake[1]);
+  close(srv->listen_fd);
+  unlink(srv->path);
+  g_free(srv->path);
+  g_free(srv);
+}
+
+MetricChannel*
+metric_channel_register(const gchar* path,
+			const gchar* name)
+{
+  MetricServer* srv;
+  MetricChannel* ch;
+
+  if (path == NULL || name == NULL) return NULL;
+
+  g_mutex_lock(&servers_lock);
+  if (servers == NULL)
+    servers = g_hash_table_new(g_str_hash, g_str_equal);
+  srv = g_hash_table_lookup(servers, path);
+  if (srv == NULL) {
+    srv = server_new(path);
+    if (srv == NULL) {
+      g_mutex_unlock(&servers_lock);
+      return NULL;
+    }
+    g_hash_table_insert(servers, srv->path, srv);
+  }
+
+  ch = g_new0(MetricChannel, 1);
+  ch->server = srv;
+  ch->name = g_strdup(name);
+  ch->pending = g_array_sized_new(FALSE, FALSE, sizeof(Record), 256);
+  g_mutex_init(&ch->lock);
+
+  g_mutex_lock(&srv->lock);
+  ch->id = srv->next_id++;
+  g_ptr_array_add(srv->channels, ch);
+  g_mutex_unlock(&srv->lock);
+
+  g_mutex_unlock(&servers_lock);
+  return ch;
+}
+
+void
+metric_channel_unregister(MetricChannel* ch)
+{
+  MetricServer* srv;
+
+  if (ch == NULL) return;
+  srv = ch->server;
+
+  g_mutex_lock(&servers_lock);
+  g_mutex_lock(&srv->lock);
+  g_ptr_array_remove_fast(srv->channels, ch);
+  g_mutex_unlock(&srv->lock);
+
+  if (srv->channels->len == 0) {
+    g_hash_table_remove(servers, srv->path);
+    server_free(srv);
+  }
+  g_mutex_unlock(&servers_lock);
+
+  g_mutex_clear(&ch->lock);
+  g_array_free(ch->pending, TRUE);
+  g_free(ch->name);
+  g_free(ch);
+}
+
+void
+metric_channel_push(MetricChannel* ch,
+		    gint64 time,
+		    const gfloat values[METRIC_SRV_PARAMS],
+		    guint32 flags)
+{
+  Record rec;
+
+  /* nobody to send it to */
+  if (g_atomic_int_get(&ch->server->clients_n) == 0)
+    return;
+
+  rec.time = time;
+  rec.flags = flags;
+  memcpy(rec.values, values, sizeof(rec.values));
+
+  g_mutex_lock(&ch->lock);
+  if (ch->pending->len < CHANNEL_PENDING_MAX)
+    g_array_append_val(ch->pending, rec);
+  else
+    ch->overflow++;
+  g_mutex_unlock(&ch->lock);
+}
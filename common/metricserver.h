@@ -0,0 +1,107 @@
+/* metricserver.h
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+#ifndef METRICSERVER_H
+#define METRICSERVER_H
+
+#include <glib.h>
+
+/* Process-wide metrics endpoint: one Unix domain socket per path,
+ * shared by every analyser instance of the process. The registry
+ * lives in libmetricserver.so, linked by both cpuanalysis and
+ * gpuanalysis, so the elements of the two plugins share it too.
+ * A path some other process serves is never taken over, the
+ * channels registered on it fail instead. Each instance
+ * registers a named channel and pushes its frames, a server thread
+ * sends them to the subscribers as length-prefixed binary batches.
+ *
+ * Every message starts with MetricSrvHeader, size includes it.
+ * Client to server:
+ *   SUBSCRIBE   MetricSrvSubscribe, adds a filter: channels matching
+ *               the glob pattern, the metrics in the bit mask
+ *   UNSUBSCRIBE header only, drops all the filters
+ * Server to client:
+ *   HELLO       MetricSrvHello, once on connect
+ *   CHANNEL     MetricSrvChannel, before the first batch of a channel
+ *   BATCH       MetricSrvBatch and count records of
+ *               { gint64 time; guint32 flags; gfloat values[k]; }
+ *               packed, where values are the k subscribed metrics
+ *               in the PARAMETER order and flags are as in metricshm.h
+ *
+ * The analysers never wait for the clients: a subscriber whose
+ * socket does not drain loses whole batches, reported in the
+ * dropped field of its next batch. */
+
+#define METRIC_SRV_VERSION  1
+#define METRIC_SRV_PARAMS   5
+#define METRIC_SRV_ALL_PARAMS ((1u << METRIC_SRV_PARAMS) - 1)
+
+enum {
+  METRIC_SRV_SUBSCRIBE   = 1,
+  METRIC_SRV_UNSUBSCRIBE = 2,
+  METRIC_SRV_HELLO       = 0x10,
+  METRIC_SRV_CHANNEL     = 0x11,
+  METRIC_SRV_BATCH       = 0x12,
+};
+
+typedef struct {
+  guint32 size;
+  guint32 type;
+} MetricSrvHeader;
+
+typedef struct {
+  MetricSrvHeader header;
+  guint32 metrics;
+  gchar   pattern[60];
+} MetricSrvSubscribe;
+
+typedef struct {
+  MetricSrvHeader header;
+  guint32 version;
+  guint32 params;
+} MetricSrvHello;
+
+typedef struct {
+  MetricSrvHeader header;
+  guint32 channel;
+  gchar   name[60];
+} MetricSrvChannel;
+
+typedef struct {
+  MetricSrvHeader header;
+  guint32 channel;
+  guint32 metrics;
+  guint32 count;
+  /* records lost by this subscriber since its previous batch */
+  guint32 dropped;
+} MetricSrvBatch;
+
+typedef struct _MetricServer  MetricServer;
+typedef struct _MetricChannel MetricChannel;
+
+/* the server of the path is started with its first channel
+ * and stopped with the last one */
+MetricChannel* metric_channel_register(const gchar* path,
+				       const gchar* name);
+void           metric_channel_unregister(MetricChannel* ch);
+/* streaming thread side, only takes the channel's own lock */
+void           metric_channel_push(MetricChannel* ch,
+				   gint64 time,
+				   const gfloat values[METRIC_SRV_PARAMS],
+				   guint32 flags);
+
+#endif /* METRICSERVER_H */
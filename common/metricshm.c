@@ -0,0 +1,214 @@
+/* metricshm.c
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+
+#include "metricshm.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static gchar*
+metric_shm_path(const gchar* name)
+{
+  /* shm_open wants a single leading slash */
+  return name[0] == '/' ? g_strdup(name) : g_strconcat("/", name, NULL);
+}
+
+MetricShm*
+metric_shm_create(const gchar* name,
+		  const gchar* source,
+		  guint capacity)
+{
+  MetricShm* rval;
+  gsize size;
+  void* mem;
+  int fd;
+
+  if (name == NULL || capacity == 0) return NULL;
+
+  size = sizeof(MetricShmHeader) + sizeof(MetricShmRecord) * capacity;
+  rval = g_new0(MetricShm, 1);
+  rval->name = metric_shm_path(name);
+
+  fd = shm_open(rval->name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if (fd < 0)
+    goto error;
+  if (ftruncate(fd, size) < 0) {
+    close(fd);
+    shm_unlink(rval->name);
+    goto error;
+  }
+  mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    shm_unlink(rval->name);
+    goto error;
+  }
+
+  rval->size = size;
+  rval->writer = TRUE;
+  rval->header = (MetricShmHeader*)mem;
+  rval->records = (MetricShmRecord*)(rval->header + 1);
+
+  /* ftruncate gives zeroed pages, so all the slots are free */
+  rval->header->header_size = sizeof(MetricShmHeader);
+  rval->header->record_size = sizeof(MetricShmRecord);
+  rval->header->capacity = capacity;
+  rval->header->params = METRIC_SHM_PARAMS;
+  rval->header->version = METRIC_SHM_VERSION;
+  g_strlcpy(rval->header->source, source ? source : "", sizeof(rval->header->source));
+  /* readers check magic last */
+  __atomic_store_n(&rval->header->magic, METRIC_SHM_MAGIC, __ATOMIC_RELEASE);
+  return rval;
+
+ error:
+  g_free(rval->name);
+  g_free(rval);
+  return NULL;
+}
+
+void
+metric_shm_write(MetricShm* shm,
+		 gint64 time,
+		 const gfloat values[METRIC_SHM_PARAMS],
+		 guint32 flags)
+{
+  guint64 n = shm->header->head;
+  MetricShmRecord* rec = &shm->records[n % shm->header->capacity];
+  guint32 seq = rec->seq;
+
+  __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  rec->flags = flags;
+  rec->frame = n;
+  rec->time = time;
+  memcpy(rec->values, values, sizeof(rec->values));
+
+  __atomic_store_n(&rec->seq, seq + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&shm->header->head, n + 1, __ATOMIC_RELEASE);
+}
+
+MetricShm*
+metric_shm_open(const gchar* name)
+{
+  MetricShm* rval;
+  MetricShmHeader header;
+  struct stat st;
+  void* mem;
+  int fd;
+
+  if (name == NULL) return NULL;
+
+  rval = g_new0(MetricShm, 1);
+  rval->name = metric_shm_path(name);
+
+  fd = shm_open(rval->name, O_RDONLY, 0);
+  if (fd < 0)
+    goto error;
+  if (fstat(fd, &st) < 0 || (gsize)st.st_size < sizeof(MetricShmHeader)) {
+    close(fd);
+    goto error;
+  }
+  mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+    goto error;
+
+  rval->size = st.st_size;
+  rval->header = (MetricShmHeader*)mem;
+
+  header.magic = __atomic_load_n(&rval->header->magic, __ATOMIC_ACQUIRE);
+  memcpy(&header.version, &rval->header->version, sizeof(guint32) * 5);
+  if (header.magic != METRIC_SHM_MAGIC
+      || header.version != METRIC_SHM_VERSION
+      || header.header_size != sizeof(MetricShmHeader)
+      || header.record_size != sizeof(MetricShmRecord)
+      || header.params != METRIC_SHM_PARAMS
+      || rval->size < header.header_size + (gsize)header.record_size * header.capacity) {
+    munmap(mem, rval->size);
+    goto error;
+  }
+  rval->records = (MetricShmRecord*)(rval->header + 1);
+  return rval;
+
+ error:
+  g_free(rval->name);
+  g_free(rval);
+  return NULL;
+}
+
+guint
+metric_shm_read(MetricShm* shm,
+		guint64* next,
+		MetricShmRecord* dst,
+		guint max,
+		guint64* lost)
+{
+  guint64 capacity = shm->header->capacity;
+  guint64 head = __atomic_load_n(&shm->header->head, __ATOMIC_ACQUIRE);
+  guint64 skipped = 0;
+  guint n = 0;
+
+  /* the oldest records are already gone */
+  if (head > capacity && *next < head - capacity) {
+    skipped = head - capacity - *next;
+    *next = head - capacity;
+  }
+
+  while (n < max && *next < head) {
+    MetricShmRecord* rec = &shm->records[*next % capacity];
+    guint32 seq0 = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+
+    /* being written right now, the rest is newer anyway */
+    if (seq0 & 1)
+      break;
+    memcpy(&dst[n], rec, sizeof(MetricShmRecord));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq0)
+      continue;
+
+    if (dst[n].frame != *next) {
+      /* the writer lapped us while copying */
+      if (dst[n].frame > *next) {
+	skipped++;
+	(*next)++;
+      }
+      continue;
+    }
+    n++;
+    (*next)++;
+  }
+
+  if (lost)
+    *lost = skipped;
+  return n;
+}
+
+void
+metric_shm_close(MetricShm* shm)
+{
+  if (shm == NULL) return;
+
+  munmap(shm->header, shm->size);
+  if (shm->writer)
+    shm_unlink(shm->name);
+  g_free(shm->name);
+  g_free(shm);
+}
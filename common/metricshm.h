@@ -0,0 +1,101 @@
+/* metricshm.h
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+#ifndef METRICSHM_H
+#define METRICSHM_H
+
+#include <glib.h>
+
+/* Per-frame metrics exported into a named POSIX shared memory
+ * object (/dev/shm/<name>), so monitoring processes can follow
+ * an analyser without hosting the pipeline.
+ *
+ * The layout is fixed and versioned, native byte order:
+ *   MetricShmHeader, then capacity MetricShmRecord slots.
+ * Record n lives in slot n % capacity. The writer never blocks
+ * or makes syscalls per frame: each slot is guarded by a seqlock
+ * (seq is odd while the slot is written) and head counts the
+ * records published so far. Readers only map the object read-only. */
+
+#define METRIC_SHM_MAGIC   0x4d534856 /* "VHSM" */
+#define METRIC_SHM_VERSION 1
+/* black, luma, freeze, diff, blocky (the PARAMETER order) */
+#define METRIC_SHM_PARAMS  5
+/* records kept by the analysers, minutes at the usual frame rates */
+#define METRIC_SHM_CAPACITY 8192
+
+typedef struct {
+  guint32 magic;
+  guint32 version;
+  guint32 header_size;
+  guint32 record_size;
+  guint32 capacity;
+  guint32 params;
+  /* number of records published */
+  guint64 head;
+  /* NUL-terminated element name, "cpuanalysis" or "gpuanalysis" */
+  gchar   source[32];
+} MetricShmHeader;
+
+typedef struct {
+  guint32 seq;
+  /* bit p: continuous error of the parameter p, bit 8 + p: peak error */
+  guint32 flags;
+  /* the record number, slots are reused once the readers lag
+     behind by more than capacity records */
+  guint64 frame;
+  /* wall-clock time in us */
+  gint64  time;
+  gfloat  values[METRIC_SHM_PARAMS];
+  guint32 reserved;
+} MetricShmRecord;
+
+#define METRIC_SHM_CONT_FLAG(p) (1u << (p))
+#define METRIC_SHM_PEAK_FLAG(p) (1u << (8 + (p)))
+
+typedef struct {
+  gchar*           name;
+  gsize            size;
+  gboolean         writer;
+  MetricShmHeader* header;
+  MetricShmRecord* records;
+} MetricShm;
+
+/* writer side, the object is created (or truncated) and
+ * unlinked again on close */
+MetricShm* metric_shm_create(const gchar* name,
+			     const gchar* source,
+			     guint capacity);
+void       metric_shm_write(MetricShm* shm,
+			    gint64 time,
+			    const gfloat values[METRIC_SHM_PARAMS],
+			    guint32 flags);
+
+/* reader side, NULL if the object is missing or of another version */
+MetricShm* metric_shm_open(const gchar* name);
+/* copies up to max records starting from *next, *next is moved
+ * past the last copied one. Records already overwritten are
+ * skipped, *lost (nullable) receives their number */
+guint      metric_shm_read(MetricShm* shm,
+			   guint64* next,
+			   MetricShmRecord* dst,
+			   guint max,
+			   guint64* lost);
+
+void       metric_shm_close(MetricShm* shm);
+
+#endif /* METRICSHM_H */
@@ -5,6 +5,7 @@ typedef struct {
   float noise;
   unsigned int right_diff;
   unsigned int down_diff;
+  unsigned int visible;
 } BLOCK;
 
 #endif /* BLOCK_H */
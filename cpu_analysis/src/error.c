@@ -32,8 +32,27 @@ param_to_string (PARAMETER p)
         }
 }
 
+static void
+errors_track (Errors* e, PARAMETER p, ErrSpanKind k, gboolean raised, gint64 time)
+{
+        ErrSpan* s = &e->track[p][k];
+
+        if (raised) {
+                if (s->closed) {
+                        s->from   = time;
+                        s->closed = FALSE;
+                }
+                s->to = time;
+        } else if (!s->closed) {
+                s->closed = TRUE;
+                if (G_LIKELY(e->spans && e->spans_count < e->spans_total))
+                        e->spans[e->spans_count++] = *s;
+        }
+}
+
 void
-err_flags_cmp (ErrFlags* flags, BOUNDARY* bounds, gint64 time, gboolean upper, float* dur, float dur_d, float val)
+err_flags_cmp (ErrFlags* flags, BOUNDARY* bounds, gint64 time, gboolean upper, float* dur, float dur_d, float val,
+               Errors* spans, PARAMETER p)
 {
         ErrFlags flag = { FALSE, FALSE, time };
         if (bounds->peak_en) {
@@ -49,6 +68,49 @@ err_flags_cmp (ErrFlags* flags, BOUNDARY* bounds, gint64 time, gboolean upper, f
                 flag.cont = *dur > bounds->duration;
         }
         *flags = flag;
+        if (spans) {
+                errors_track (spans, p, ERR_SPAN_CONT, flag.cont, time);
+                errors_track (spans, p, ERR_SPAN_PEAK, flag.peak, time);
+        }
+}
+
+GstBufferPool*
+payload_pool_new(gsize size)
+{
+        GstBufferPool* pool = gst_buffer_pool_new ();
+        GstStructure*  config = gst_buffer_pool_get_config (pool);
+
+        /* one being filled, one held by the consumer */
+        gst_buffer_pool_config_set_params (config, NULL, size, 2, 0);
+
+        if (! gst_buffer_pool_set_config (pool, config)
+            || ! gst_buffer_pool_set_active (pool, TRUE)) {
+                gst_object_unref (pool);
+                return NULL;
+        }
+        return pool;
+}
+
+void
+payload_pool_delete(GstBufferPool* pool)
+{
+        /* buffers still held by consumers keep the pool alive */
+        gst_buffer_pool_set_active (pool, FALSE);
+        gst_object_unref (pool);
+}
+
+gpointer
+payload_acquire(GstBufferPool* pool, GstBuffer** buf, GstMapInfo* map)
+{
+        *buf = NULL;
+        if (gst_buffer_pool_acquire_buffer (pool, buf, NULL) != GST_FLOW_OK)
+                return NULL;
+        if (! gst_buffer_map (*buf, map, GST_MAP_WRITE)) {
+                gst_buffer_unref (*buf);
+                *buf = NULL;
+                return NULL;
+        }
+        return map->data;
 }
 
 Errors*
@@ -64,7 +126,20 @@ errors_new(guint fr)
 
         rval->frames_total = fr;
         rval->current = 0;
-        rval->err_flags = (ErrFlags*) malloc (sizeof(ErrFlags) * PARAM_NUMBER * fr);
+        /* a span takes two frames to be closed, plus the one
+           carried over from the previous period and the open one */
+        rval->spans_total = PARAM_NUMBER * ERR_SPAN_KINDS * (fr / 2 + 2);
+        rval->spans_count = 0;
+        for (int p = 0; p < PARAM_NUMBER; p++)
+                for (int k = 0; k < ERR_SPAN_KINDS; k++) {
+                        rval->track[p][k] = (ErrSpan) { 0, 0, p, k, TRUE };
+                }
+        rval->pool = payload_pool_new (sizeof(ErrSpan) * rval->spans_total);
+        if ( ! rval->pool ) {
+                free(rval);
+                return NULL;
+        }
+        rval->spans = payload_acquire (rval->pool, &rval->buffer, &rval->map);
         return rval;
 }
 
@@ -72,24 +147,29 @@ void
 errors_reset(Errors* e)
 {
         e->current = 0;
+        e->spans_count = 0;
+        for (int p = 0; p < PARAM_NUMBER; p++)
+                for (int k = 0; k < ERR_SPAN_KINDS; k++)
+                        e->track[p][k].closed = TRUE;
 }
 
 void
 errors_delete(Errors* e)
 {
-        free(e->err_flags);
+        if (e->buffer) {
+                gst_buffer_unmap (e->buffer, &e->map);
+                gst_buffer_unref (e->buffer);
+        }
+        payload_pool_delete (e->pool);
         free(e);
         e = NULL;
 }
 
 gint
-errors_append(Errors* e, ErrFlags flags [PARAM_NUMBER])
+errors_append(Errors* e)
 {
         if (e->current >= e->frames_total) return -1;
-        for (int p = 0; p < PARAM_NUMBER; p++) {
-                int pos = p * e->frames_total + e->current;             
-                e->err_flags[pos] = flags[p];
-        }
+        if (G_UNLIKELY(e->spans == NULL)) return -1;
         e->current++;
         return 0;
 }
@@ -100,14 +180,30 @@ errors_is_full(Errors* e)
         return e->current == e->frames_total;
 }
 
-gpointer
-errors_dump(Errors* e, gsize* sz)
+GstBuffer*
+errors_pull_out(Errors* e, gsize* sz)
 {
+        GstBuffer* rval = e->buffer;
+
         if (sz == NULL) return NULL;
 
-        *sz = e->frames_total;
-        int size      = sizeof(ErrFlags) * e->frames_total * PARAM_NUMBER;
-        ErrFlags* buf = (ErrFlags*) malloc (size);
-        memcpy(buf, e->err_flags, size);
-        return buf;
+        if (e->spans != NULL) {
+                for (int p = 0; p < PARAM_NUMBER; p++)
+                        for (int k = 0; k < ERR_SPAN_KINDS; k++) {
+                                if (!e->track[p][k].closed
+                                    && e->spans_count < e->spans_total)
+                                        e->spans[e->spans_count++] = e->track[p][k];
+                        }
+        }
+        *sz = e->spans_count;
+        if (rval != NULL) {
+                gst_buffer_unmap (rval, &e->map);
+                /* the pool restores the size on release */
+                gst_buffer_set_size (rval, sizeof(ErrSpan) * (*sz));
+        }
+
+        e->current     = 0;
+        e->spans_count = 0;
+        e->spans       = payload_acquire (e->pool, &e->buffer, &e->map);
+        return rval;
 }
@@ -22,20 +22,54 @@ typedef struct {
         gint64   time;
 } ErrFlags;
 
-/*                  flags    boundaries  timestamp uppre_bound? duration duration_d value    */
-void err_flags_cmp (ErrFlags*, BOUNDARY*, gint64, gboolean, float*, float, float);
+/* Period payloads are kept right in the pooled buffers
+ * that are passed to the data signal, so no copy is made and
+ * the buffers are recycled once the consumer drops them */
+GstBufferPool* payload_pool_new(gsize);
+void           payload_pool_delete(GstBufferPool*);
+/*                        pool            buffer      map       */
+gpointer       payload_acquire(GstBufferPool*, GstBuffer**, GstMapInfo*);
 
+typedef enum { ERR_SPAN_CONT, ERR_SPAN_PEAK, ERR_SPAN_KINDS } ErrSpanKind;
+
+/* A run of frames with an error raised, from and to are
+ * the times of its first and last frame */
+typedef struct {
+        gint64   from;
+        gint64   to;
+        guint16  param;
+        guint16  kind;
+        /* FALSE if the error is still raised at the period end,
+           the span is dumped again until it is closed */
+        gboolean closed;
+} ErrSpan;
+
+/* The errors of a period are kept as the span transitions only:
+ * the spans closed within the period followed by the open ones */
 typedef struct {
-        guint     frames_total;
-        guint     current;
-        ErrFlags* err_flags;
+        guint          frames_total;
+        guint          current;
+        guint          spans_total;
+        guint          spans_count;
+        ErrSpan*       spans;
+        /* the latest span of each parameter and kind */
+        ErrSpan        track [PARAM_NUMBER][ERR_SPAN_KINDS];
+        GstBufferPool* pool;
+        GstBuffer*     buffer;
+        GstMapInfo     map;
 } Errors;
 
-Errors*  errors_new(guint);
-void     errors_reset(Errors*);
-void     errors_delete(Errors*);
-gint     errors_append(Errors*, ErrFlags[PARAM_NUMBER]);
-gboolean errors_is_full(Errors*);
-gpointer errors_dump(Errors*, gsize*);
+/*                  flags    boundaries  timestamp uppre_bound? duration duration_d value spans(nullable) param */
+void err_flags_cmp (ErrFlags*, BOUNDARY*, gint64, gboolean, float*, float, float, Errors*, PARAMETER);
+
+Errors*    errors_new(guint);
+void       errors_reset(Errors*);
+void       errors_delete(Errors*);
+/* counts the frame, the flags are tracked by err_flags_cmp */
+gint       errors_append(Errors*);
+gboolean   errors_is_full(Errors*);
+/* hands over the filled buffer (sized to the spans, *sz is
+ * their number) and takes a fresh one from the pool */
+GstBuffer* errors_pull_out(Errors*, gsize*);
 
 #endif /* BOUNDARY_H */
@@ -78,6 +78,10 @@ static gboolean
 gst_cpu_analysis_start        (GstBaseTransform * trans);
 static gboolean
 gst_cpu_analysis_stop         (GstBaseTransform * trans);
+static GstFlowReturn
+gst_cpu_analysis_prepare_output_buffer (GstBaseTransform * trans,
+                                        GstBuffer * inbuf,
+                                        GstBuffer ** outbuf);
 static gboolean
 gst_cpu_analysis_set_info     (GstVideoFilter * filter,
                                GstCaps * incaps,
@@ -93,6 +97,7 @@ gst_cpu_analysis_transform_frame_ip (GstVideoFilter * filter,
 enum
   {
     DATA_SIGNAL,
+    SUMMARY_SIGNAL,
     LAST_SIGNAL
   };
 
@@ -130,6 +135,16 @@ enum
     PROP_BLOCKY_PEAK_EN,
     PROP_BLOCKY_DURATION,
     PROP_MARK_BLOCKS,
+    PROP_BATCH_PERIODS,
+    PROP_ATTACH_META,
+    PROP_SUMMARY,
+    PROP_RING_SIZE,
+    PROP_SHM_NAME,
+    PROP_METRICS_SOCKET,
+    PROP_COMPACT,
+    PROP_HISTORY_FILE,
+    PROP_EVENTS_FILE,
+    PROP_COMPRESS,
     LAST_PROP
   };
 
@@ -139,10 +154,10 @@ static GParamSpec *properties[LAST_PROP] = { NULL, };
 /* pad templates */
 
 #define VIDEO_SRC_CAPS                                          \
-  GST_VIDEO_CAPS_MAKE("{ I420, NV12, NV21, YV12, IYUV }")
+  GST_VIDEO_CAPS_MAKE("{ I420, NV12, NV21, YV12, IYUV, I420_10LE, P010_10LE, YUY2, UYVY, YVYU }")
 
 #define VIDEO_SINK_CAPS                                         \
-  GST_VIDEO_CAPS_MAKE("{ I420, NV12, NV21, YV12, IYUV }")
+  GST_VIDEO_CAPS_MAKE("{ I420, NV12, NV21, YV12, IYUV, I420_10LE, P010_10LE, YUY2, UYVY, YVYU }")
 
 /* class initialization */
 
@@ -185,6 +200,8 @@ gst_cpu_analysis_class_init (GstVideoAnalysisClass * klass)
   gobject_class->finalize = gst_cpu_analysis_finalize;
   base_transform_class->start = GST_DEBUG_FUNCPTR (gst_cpu_analysis_start);
   base_transform_class->stop = GST_DEBUG_FUNCPTR (gst_cpu_analysis_stop);
+  base_transform_class->prepare_output_buffer =
+    GST_DEBUG_FUNCPTR (gst_cpu_analysis_prepare_output_buffer);
   video_filter_class->set_info = GST_DEBUG_FUNCPTR (gst_cpu_analysis_set_info);
   video_filter_class->transform_frame_ip = GST_DEBUG_FUNCPTR (gst_cpu_analysis_transform_frame_ip);
 
@@ -193,6 +210,11 @@ gst_cpu_analysis_class_init (GstVideoAnalysisClass * klass)
                  G_STRUCT_OFFSET(GstVideoAnalysisClass, data_signal), NULL, NULL,
                  g_cclosure_marshal_generic, G_TYPE_NONE,
                  4, G_TYPE_UINT64, GST_TYPE_BUFFER, G_TYPE_UINT64, GST_TYPE_BUFFER);
+  signals[SUMMARY_SIGNAL] =
+    g_signal_new("summary", G_TYPE_FROM_CLASS(klass), G_SIGNAL_RUN_LAST,
+                 G_STRUCT_OFFSET(GstVideoAnalysisClass, summary_signal), NULL, NULL,
+                 g_cclosure_marshal_generic, G_TYPE_NONE,
+                 1, GST_TYPE_BUFFER);
         
   properties [PROP_PERIOD] =
     g_param_spec_float("period", "Period",
@@ -302,8 +324,48 @@ gst_cpu_analysis_class_init (GstVideoAnalysisClass * klass)
                        0., G_MAXFLOAT, 1., G_PARAM_READWRITE);
   properties [PROP_MARK_BLOCKS] =
     g_param_spec_uint("mark_blocks", "Mark_blocks",
-                      "Mark borders of visible blocks",
+                      "Outline visible blocks with a GstVideoOverlayCompositionMeta",
                       0, 256, 0, G_PARAM_READWRITE);
+  properties [PROP_BATCH_PERIODS] =
+    g_param_spec_uint("batch_periods", "Batch periods",
+                      "Number of periods passed to the data callback at once",
+                      1, MAX_BATCH, 1, G_PARAM_READWRITE);
+  properties [PROP_ATTACH_META] =
+    g_param_spec_boolean("attach_meta", "Attach meta",
+                         "Attach GstCpuAnalysisMeta with the frame measurements to each buffer",
+                         FALSE, G_PARAM_READWRITE);
+  properties [PROP_SUMMARY] =
+    g_param_spec_boolean("summary", "Summary",
+                         "Emit a fixed-size VideoSummary per period instead of the per-frame data",
+                         FALSE, G_PARAM_READWRITE);
+  properties [PROP_RING_SIZE] =
+    g_param_spec_uint("ring_size", "Ring size",
+                      "Frames kept for gst_cpu_analysis_pull instead of the per-frame data, 0 disables the ring (read on the first start)",
+                      0, G_MAXUINT16, 0, G_PARAM_READWRITE);
+  properties [PROP_SHM_NAME] =
+    g_param_spec_string("shm_name", "Shared memory name",
+                        "Publish the frame measurements into /dev/shm/<shm_name> (see metricshm.h), NULL disables the export",
+                        NULL, G_PARAM_READWRITE);
+  properties [PROP_METRICS_SOCKET] =
+    g_param_spec_string("metrics_socket", "Metrics socket",
+                        "Stream the frame measurements as the element-named channel of the process-wide Unix socket server at this path (see metricserver.h), NULL disables it",
+                        NULL, G_PARAM_READWRITE);
+  properties [PROP_COMPACT] =
+    g_param_spec_boolean("compact", "Compact",
+                         "Keep the period data as 16-bit fixed-point columns (MetricColumns) instead of VideoParams (read on caps change)",
+                         FALSE, G_PARAM_READWRITE);
+  properties [PROP_HISTORY_FILE] =
+    g_param_spec_string("history_file", "History file",
+                        "Append the frame measurements to this memory-mapped history file (see metrichistory.h), NULL disables it",
+                        NULL, G_PARAM_READWRITE);
+  properties [PROP_EVENTS_FILE] =
+    g_param_spec_string("events_file", "Events file",
+                        "Append the error spans to this event log with an interval index (see metricevents.h), NULL disables it",
+                        NULL, G_PARAM_READWRITE);
+  properties [PROP_COMPRESS] =
+    g_param_spec_boolean("compress", "Compress",
+                         "Pass the period data as a metriccodec block (delta-of-delta times, XOR-ed values), wins over compact (read on caps change)",
+                         FALSE, G_PARAM_READWRITE);
 
   g_object_class_install_properties(gobject_class, LAST_PROP, properties);
 }
@@ -323,13 +385,39 @@ gst_cpu_analysis_init (GstVideoAnalysis *cpu_analysis)
     cpu_analysis->params_boundary[i].duration = 1.;
   }
   cpu_analysis->mark_blocks = 0;
+  cpu_analysis->batch_periods = 1;
+  cpu_analysis->attach_meta = FALSE;
+  cpu_analysis->summary = FALSE;
+  cpu_analysis->ring_size = 0;
+  cpu_analysis->shm_name = NULL;
+  cpu_analysis->metrics_socket = NULL;
+  cpu_analysis->compact = FALSE;
+  cpu_analysis->compress = FALSE;
+  cpu_analysis->history_file = NULL;
+  cpu_analysis->events_file = NULL;
   cpu_analysis->period = 0.5;
   /* private */
   for (guint i = 0; i < PARAM_NUMBER; i++) {
     cpu_analysis->cont_err_duration[i] = 0.;
   }
-  cpu_analysis->past_buffer = (guint8*)malloc(4096*4096);
-  cpu_analysis->blocks = (BLOCK*)malloc(512*512);
+  cpu_analysis->sample_size = 1;
+  cpu_analysis->depth_shift = 0;
+  cpu_analysis->luma_step = 1;
+  cpu_analysis->luma_offset = 0;
+  cpu_analysis->past_buffer = NULL;
+  cpu_analysis->band_buffer = NULL;
+  cpu_analysis->blocks = NULL;
+  cpu_analysis->mark_pixels = NULL;
+  cpu_analysis->summary_data = NULL;
+  cpu_analysis->ring = NULL;
+  cpu_analysis->shm = NULL;
+  cpu_analysis->channel = NULL;
+  cpu_analysis->history = NULL;
+  cpu_analysis->events = NULL;
+
+  /* the frames are only read, so buffers are passed through
+     untouched and never copied to be made writable */
+  gst_base_transform_set_passthrough (GST_BASE_TRANSFORM (cpu_analysis), TRUE);
 }
 
 void
@@ -433,6 +521,40 @@ gst_cpu_analysis_set_property (GObject * object,
   case PROP_MARK_BLOCKS:
     cpu_analysis->mark_blocks = g_value_get_uint(value);
     break;
+  case PROP_BATCH_PERIODS:
+    cpu_analysis->batch_periods = g_value_get_uint(value);
+    break;
+  case PROP_ATTACH_META:
+    cpu_analysis->attach_meta = g_value_get_boolean(value);
+    break;
+  case PROP_SUMMARY:
+    cpu_analysis->summary = g_value_get_boolean(value);
+    break;
+  case PROP_RING_SIZE:
+    cpu_analysis->ring_size = g_value_get_uint(value);
+    break;
+  case PROP_SHM_NAME:
+    g_free(cpu_analysis->shm_name);
+    cpu_analysis->shm_name = g_value_dup_string(value);
+    break;
+  case PROP_METRICS_SOCKET:
+    g_free(cpu_analysis->metrics_socket);
+    cpu_analysis->metrics_socket = g_value_dup_string(value);
+    break;
+  case PROP_COMPACT:
+    cpu_analysis->compact = g_value_get_boolean(value);
+    break;
+  case PROP_HISTORY_FILE:
+    g_free(cpu_analysis->history_file);
+    cpu_analysis->history_file = g_value_dup_string(value);
+    break;
+  case PROP_EVENTS_FILE:
+    g_free(cpu_analysis->events_file);
+    cpu_analysis->events_file = g_value_dup_string(value);
+    break;
+  case PROP_COMPRESS:
+    cpu_analysis->compress = g_value_get_boolean(value);
+    break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     break;
@@ -540,12 +662,204 @@ gst_cpu_analysis_get_property (GObject * object,
   case PROP_MARK_BLOCKS: 
     g_value_set_uint(value, cpu_analysis->mark_blocks);
     break;
+  case PROP_BATCH_PERIODS:
+    g_value_set_uint(value, cpu_analysis->batch_periods);
+    break;
+  case PROP_ATTACH_META:
+    g_value_set_boolean(value, cpu_analysis->attach_meta);
+    break;
+  case PROP_SUMMARY:
+    g_value_set_boolean(value, cpu_analysis->summary);
+    break;
+  case PROP_RING_SIZE:
+    g_value_set_uint(value, cpu_analysis->ring_size);
+    break;
+  case PROP_SHM_NAME:
+    g_value_set_string(value, cpu_analysis->shm_name);
+    break;
+  case PROP_METRICS_SOCKET:
+    g_value_set_string(value, cpu_analysis->metrics_socket);
+    break;
+  case PROP_COMPACT:
+    g_value_set_boolean(value, cpu_analysis->compact);
+    break;
+  case PROP_HISTORY_FILE:
+    g_value_set_string(value, cpu_analysis->history_file);
+    break;
+  case PROP_EVENTS_FILE:
+    g_value_set_string(value, cpu_analysis->events_file);
+    break;
+  case PROP_COMPRESS:
+    g_value_set_boolean(value, cpu_analysis->compress);
+    break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     break;
   }
 }
 
+/* callbacks */
+
+struct _GstVideoAnalysisCallbacksRef {
+  gint refs;
+  GstVideoAnalysisCallbacks callbacks;
+  gpointer user_data;
+  GDestroyNotify notify;
+};
+
+/* the current callbacks for a call, NULL if unset */
+static GstVideoAnalysisCallbacksRef *
+gst_cpu_analysis_callbacks_get (GstVideoAnalysis *cpu_analysis)
+{
+  GstVideoAnalysisCallbacksRef *ref;
+
+  GST_OBJECT_LOCK (cpu_analysis);
+  ref = cpu_analysis->callbacks;
+  if (ref)
+    g_atomic_int_inc (&ref->refs);
+  GST_OBJECT_UNLOCK (cpu_analysis);
+  return ref;
+}
+
+/* ref may be NULL, the data goes along with the last ref */
+static void
+gst_cpu_analysis_callbacks_unref (GstVideoAnalysisCallbacksRef *ref)
+{
+  if (ref == NULL || !g_atomic_int_dec_and_test (&ref->refs))
+    return;
+  if (ref->notify)
+    ref->notify (ref->user_data);
+  g_free (ref);
+}
+
+static gboolean
+gst_cpu_analysis_has_data_callback (GstVideoAnalysis *cpu_analysis)
+{
+  gboolean rval;
+
+  GST_OBJECT_LOCK (cpu_analysis);
+  rval = cpu_analysis->callbacks && cpu_analysis->callbacks->callbacks.data;
+  GST_OBJECT_UNLOCK (cpu_analysis);
+  return rval;
+}
+
+static void
+gst_cpu_analysis_batch_release (GstVideoAnalysis *cpu_analysis)
+{
+  for (guint i = 0; i < cpu_analysis->batch_len; i++)
+    for (guint b = 0; b < 2; b++) {
+      gst_buffer_unmap (cpu_analysis->batch_buffers[i][b],
+                        &cpu_analysis->batch_maps[i][b]);
+      gst_buffer_unref (cpu_analysis->batch_buffers[i][b]);
+    }
+  cpu_analysis->batch_len = 0;
+}
+
+static void
+gst_cpu_analysis_batch_flush (GstVideoAnalysis *cpu_analysis)
+{
+  GstVideoAnalysisCallbacksRef *ref;
+
+  if (cpu_analysis->batch_len == 0)
+    return;
+
+  ref = gst_cpu_analysis_callbacks_get (cpu_analysis);
+  if (ref && ref->callbacks.data)
+    ref->callbacks.data (cpu_analysis,
+                         cpu_analysis->batch,
+                         cpu_analysis->batch_len,
+                         ref->user_data);
+  gst_cpu_analysis_callbacks_unref (ref);
+
+  gst_cpu_analysis_batch_release (cpu_analysis);
+}
+
+/* keeps the period payloads mapped until the batch is full */
+static void
+gst_cpu_analysis_batch_push (GstVideoAnalysis *cpu_analysis,
+                             GstBuffer *db, gsize ds,
+                             GstBuffer *eb, gsize es)
+{
+  guint n = cpu_analysis->batch_len;
+  GstMapInfo *maps = cpu_analysis->batch_maps[n];
+
+  if (!gst_buffer_map (db, &maps[0], GST_MAP_READ))
+    return;
+  if (!gst_buffer_map (eb, &maps[1], GST_MAP_READ)) {
+    gst_buffer_unmap (db, &maps[0]);
+    return;
+  }
+
+  cpu_analysis->batch_buffers[n][0] = gst_buffer_ref (db);
+  cpu_analysis->batch_buffers[n][1] = gst_buffer_ref (eb);
+  cpu_analysis->batch[n].params       = NULL;
+  cpu_analysis->batch[n].columns      = NULL;
+  cpu_analysis->batch[n].encoded      = NULL;
+  cpu_analysis->batch[n].encoded_size = 0;
+  if (cpu_analysis->data->encoder) {
+    cpu_analysis->batch[n].encoded      = maps[0].data;
+    cpu_analysis->batch[n].encoded_size = maps[0].size;
+  } else if (cpu_analysis->data->compact)
+    cpu_analysis->batch[n].columns    = (const MetricColumns*) maps[0].data;
+  else
+    cpu_analysis->batch[n].params     = (const VideoParams*) maps[0].data;
+  cpu_analysis->batch[n].frames       = ds;
+  cpu_analysis->batch[n].spans        = (const ErrSpan*) maps[1].data;
+  cpu_analysis->batch[n].n_spans      = es;
+  cpu_analysis->batch_len++;
+
+  if (cpu_analysis->batch_len >= cpu_analysis->batch_periods)
+    gst_cpu_analysis_batch_flush (cpu_analysis);
+}
+
+void
+gst_cpu_analysis_set_callbacks (GstVideoAnalysis *cpu_analysis,
+                                const GstVideoAnalysisCallbacks *callbacks,
+                                gpointer user_data,
+                                GDestroyNotify notify)
+{
+  GstVideoAnalysisCallbacksRef *ref = NULL;
+  GstVideoAnalysisCallbacksRef *old;
+
+  g_return_if_fail (GST_IS_VIDEOANALYSIS (cpu_analysis));
+
+  if (callbacks || notify) {
+    ref = g_new0 (GstVideoAnalysisCallbacksRef, 1);
+    ref->refs = 1;
+    if (callbacks)
+      ref->callbacks = *callbacks;
+    ref->user_data = user_data;
+    ref->notify = notify;
+  }
+
+  GST_OBJECT_LOCK (cpu_analysis);
+  old = cpu_analysis->callbacks;
+  cpu_analysis->callbacks = ref;
+  GST_OBJECT_UNLOCK (cpu_analysis);
+
+  /* a call in progress keeps the old data until it returns */
+  gst_cpu_analysis_callbacks_unref (old);
+}
+
+guint
+gst_cpu_analysis_pull (GstVideoAnalysis *cpu_analysis,
+                       MetricRecord *dst,
+                       guint max,
+                       guint *overflow)
+{
+  g_return_val_if_fail (GST_IS_VIDEOANALYSIS (cpu_analysis), 0);
+
+  if (cpu_analysis->ring == NULL) {
+    if (overflow)
+      *overflow = 0;
+    return 0;
+  }
+
+  if (overflow)
+    *overflow = metric_ring_take_overflow (cpu_analysis->ring);
+  return metric_ring_pull (cpu_analysis->ring, dst, 0, max);
+}
+
 void
 gst_cpu_analysis_dispose (GObject * object)
 {
@@ -564,17 +878,146 @@ gst_cpu_analysis_finalize (GObject * object)
   GST_DEBUG_OBJECT (cpu_analysis, "finalize");
 
   free(cpu_analysis->past_buffer);
+  free(cpu_analysis->band_buffer);
   free(cpu_analysis->blocks);
+  if (cpu_analysis->mark_pixels)
+    gst_buffer_unref (cpu_analysis->mark_pixels);
+  if (cpu_analysis->ring)
+    metric_ring_delete (cpu_analysis->ring);
+  g_free (cpu_analysis->shm_name);
+  g_free (cpu_analysis->history_file);
+  g_free (cpu_analysis->events_file);
+  g_free (cpu_analysis->metrics_socket);
+
+  gst_cpu_analysis_batch_release (cpu_analysis);
+  gst_cpu_analysis_callbacks_unref (cpu_analysis->callbacks);
+  cpu_analysis->callbacks = NULL;
   
   G_OBJECT_CLASS (gst_cpu_analysis_parent_class)->finalize (object);
 }
 
+/* metas need a writable buffer object, but never writable memory,
+   so a shared buffer gets a shallow copy instead of a frame copy */
+static GstFlowReturn
+gst_cpu_analysis_prepare_output_buffer (GstBaseTransform * trans,
+                                        GstBuffer * inbuf,
+                                        GstBuffer ** outbuf)
+{
+  GstVideoAnalysis *cpu_analysis = GST_VIDEOANALYSIS (trans);
+
+  if ((cpu_analysis->attach_meta || cpu_analysis->mark_blocks)
+      && !gst_buffer_is_writable (inbuf)) {
+    *outbuf = gst_buffer_copy (inbuf);
+    return *outbuf ? GST_FLOW_OK : GST_FLOW_ERROR;
+  }
+
+  *outbuf = inbuf;
+  return GST_FLOW_OK;
+}
+
+/* 8x8 white outline, shared by every rectangle of the overlay */
+static GstBuffer *
+gst_cpu_analysis_mark_pixels_new (void)
+{
+  GstBuffer *buffer = gst_buffer_new_allocate (NULL, 8 * 8 * 4, NULL);
+  GstMapInfo map;
+
+  gst_buffer_map (buffer, &map, GST_MAP_WRITE);
+  for (guint y = 0; y < 8; y++)
+    for (guint x = 0; x < 8; x++) {
+      gboolean border = (x == 0 || x == 7 || y == 0 || y == 7);
+      memset (map.data + 4 * (x + 8 * y), border ? 0xff : 0x00, 4);
+    }
+  gst_buffer_unmap (buffer, &map);
+
+  gst_buffer_add_video_meta (buffer, GST_VIDEO_FRAME_FLAG_NONE,
+                             GST_VIDEO_OVERLAY_COMPOSITION_FORMAT_RGB, 8, 8);
+  return buffer;
+}
+
+/* visible blocks flagged by the analysis are outlined
+   by the overlay instead of being drawn into the frame */
+static void
+gst_cpu_analysis_add_overlay (GstVideoAnalysis *cpu_analysis,
+                              GstBuffer *buffer,
+                              guint width,
+                              guint height)
+{
+  GstVideoOverlayComposition *comp = NULL;
+  guint w_blocks = width / 8;
+  guint h_blocks = height / 8;
+
+  if (cpu_analysis->mark_pixels == NULL)
+    cpu_analysis->mark_pixels = gst_cpu_analysis_mark_pixels_new ();
+
+  for (guint j = 1; j < h_blocks - 1; j++)
+    for (guint i = 1; i < w_blocks - 1; i++) {
+      GstVideoOverlayRectangle *rect;
+
+      if (!cpu_analysis->blocks[i + j * w_blocks].visible)
+        continue;
+
+      rect = gst_video_overlay_rectangle_new_raw (cpu_analysis->mark_pixels,
+                                                  8 * i, 8 * j, 8, 8,
+                                                  GST_VIDEO_OVERLAY_FORMAT_FLAG_NONE);
+      if (comp == NULL)
+        comp = gst_video_overlay_composition_new (rect);
+      else
+        gst_video_overlay_composition_add_rectangle (comp, rect);
+      gst_video_overlay_rectangle_unref (rect);
+    }
+
+  if (comp) {
+    gst_buffer_add_video_overlay_composition_meta (buffer, comp);
+    gst_video_overlay_composition_unref (comp);
+  }
+}
+
 static gboolean
 gst_cpu_analysis_start (GstBaseTransform * trans)
 {
   GstVideoAnalysis *cpu_analysis = GST_VIDEOANALYSIS (trans);
 
   GST_DEBUG_OBJECT (cpu_analysis, "start");
+
+  /* never reallocated, so consumers may pull at any time */
+  if (cpu_analysis->ring == NULL && cpu_analysis->ring_size > 0)
+    cpu_analysis->ring = metric_ring_new (cpu_analysis->ring_size);
+
+  if (cpu_analysis->shm_name) {
+    cpu_analysis->shm = metric_shm_create (cpu_analysis->shm_name,
+                                           "cpuanalysis",
+                                           METRIC_SHM_CAPACITY);
+    if (cpu_analysis->shm == NULL)
+      GST_WARNING_OBJECT (cpu_analysis, "Could not create shared memory %s",
+                          cpu_analysis->shm_name);
+  }
+
+  if (cpu_analysis->metrics_socket) {
+    cpu_analysis->channel = metric_channel_register (cpu_analysis->metrics_socket,
+                                                     GST_OBJECT_NAME (cpu_analysis));
+    if (cpu_analysis->channel == NULL)
+      GST_WARNING_OBJECT (cpu_analysis, "Could not serve metrics at %s",
+                          cpu_analysis->metrics_socket);
+  }
+
+  if (cpu_analysis->history_file) {
+    cpu_analysis->history = metric_history_create (cpu_analysis->history_file,
+                                                   GST_OBJECT_NAME (cpu_analysis),
+                                                   METRIC_HISTORY_CHUNK_FRAMES);
+    if (cpu_analysis->history == NULL)
+      GST_WARNING_OBJECT (cpu_analysis, "Could not open history file %s,"
+                          " another writer may have it open",
+                          cpu_analysis->history_file);
+  }
+
+  if (cpu_analysis->events_file) {
+    cpu_analysis->events = metric_events_create (cpu_analysis->events_file,
+                                                 GST_OBJECT_NAME (cpu_analysis));
+    if (cpu_analysis->events == NULL)
+      GST_WARNING_OBJECT (cpu_analysis, "Could not open event log %s",
+                          cpu_analysis->events_file);
+  }
  
   return TRUE;
 }
@@ -586,10 +1029,26 @@ gst_cpu_analysis_stop (GstBaseTransform * trans)
 
   GST_DEBUG_OBJECT (cpu_analysis, "stop");
 
+  gst_cpu_analysis_batch_flush (cpu_analysis);
+
+  metric_shm_close (cpu_analysis->shm);
+  cpu_analysis->shm = NULL;
+  metric_channel_unregister (cpu_analysis->channel);
+  cpu_analysis->channel = NULL;
+  metric_history_close (cpu_analysis->history);
+  cpu_analysis->history = NULL;
+  metric_events_close (cpu_analysis->events);
+  cpu_analysis->events = NULL;
+
   if(cpu_analysis->data != NULL)
     video_data_delete(cpu_analysis->data);
   if(cpu_analysis->errors != NULL)
     errors_delete(cpu_analysis->errors);
+  if(cpu_analysis->summary_data != NULL)
+    video_summary_delete(cpu_analysis->summary_data);
+  cpu_analysis->data = NULL;
+  cpu_analysis->errors = NULL;
+  cpu_analysis->summary_data = NULL;
   return TRUE;
 }
 
@@ -608,17 +1067,115 @@ gst_cpu_analysis_set_info (GstVideoFilter * filter,
   cpu_analysis->fps_period = (float) in_info->fps_d / (float) in_info->fps_n;
   int period = (int)(cpu_analysis->period / cpu_analysis->fps_period);
 
+  gst_cpu_analysis_batch_flush (cpu_analysis);
+
   if (cpu_analysis->data != NULL)
     video_data_delete(cpu_analysis->data);
   if(cpu_analysis->errors != NULL)
     errors_delete(cpu_analysis->errors);
+  if(cpu_analysis->summary_data != NULL)
+    video_summary_delete(cpu_analysis->summary_data);
         
-  cpu_analysis->data   = video_data_new(period);
+  if (cpu_analysis->compress)
+    cpu_analysis->data = video_data_new_encoded(period);
+  else if (cpu_analysis->compact)
+    cpu_analysis->data = video_data_new_columns(period,
+                                                cpu_analysis->fps_period * G_USEC_PER_SEC);
+  else
+    cpu_analysis->data = video_data_new(period);
   cpu_analysis->errors = errors_new(period);
+  cpu_analysis->summary_data = video_summary_new(period);
+
+  /* luma sample layout: 8-bit or 16-bit container,
+     depth_shift is how far the samples are from the 8-bit scale,
+     luma_step > 1 for the packed 4:2:2 formats */
+  cpu_analysis->sample_size = GST_VIDEO_INFO_COMP_DEPTH(in_info, 0) > 8 ? 2 : 1;
+  cpu_analysis->depth_shift = GST_VIDEO_INFO_COMP_DEPTH(in_info, 0) - 8
+    + GST_VIDEO_FORMAT_INFO_SHIFT(in_info->finfo, 0);
+  cpu_analysis->luma_step = GST_VIDEO_INFO_COMP_PSTRIDE(in_info, 0)
+    / cpu_analysis->sample_size;
+  cpu_analysis->luma_offset = GST_VIDEO_INFO_COMP_POFFSET(in_info, 0);
+
+  free(cpu_analysis->past_buffer);
+  free(cpu_analysis->band_buffer);
+  free(cpu_analysis->blocks);
+  cpu_analysis->past_buffer = (guint8*)calloc(in_info->width * in_info->height,
+                                              cpu_analysis->sample_size);
+  cpu_analysis->band_buffer = NULL;
+  if (cpu_analysis->luma_step > 1)
+    cpu_analysis->band_buffer = (guint8*)malloc(8 * in_info->width);
+  cpu_analysis->blocks = (BLOCK*)malloc(sizeof(BLOCK)
+                                        * (in_info->width / 8)
+                                        * (in_info->height / 8));
         
   return TRUE;
 }
 
+static void
+gst_cpu_analysis_emit_summary (GstVideoAnalysis *cpu_analysis)
+{
+  GstVideoAnalysisCallbacksRef *ref;
+  VideoSummary summary;
+
+  video_summary_pull_out (cpu_analysis->summary_data, &summary);
+
+  if (g_signal_has_handler_pending (cpu_analysis, signals[SUMMARY_SIGNAL], 0, FALSE)) {
+    GstBuffer *sb = gst_buffer_new_allocate (NULL, sizeof (VideoSummary), NULL);
+
+    gst_buffer_fill (sb, 0, &summary, sizeof (VideoSummary));
+    g_signal_emit (cpu_analysis, signals[SUMMARY_SIGNAL], 0, sb);
+    gst_buffer_unref (sb);
+  }
+
+  ref = gst_cpu_analysis_callbacks_get (cpu_analysis);
+  if (ref && ref->callbacks.summary)
+    ref->callbacks.summary (cpu_analysis, &summary, ref->user_data);
+  gst_cpu_analysis_callbacks_unref (ref);
+}
+
+G_STATIC_ASSERT (PARAM_NUMBER == METRIC_SHM_PARAMS);
+G_STATIC_ASSERT (PARAM_NUMBER == METRIC_SRV_PARAMS);
+G_STATIC_ASSERT (PARAM_NUMBER == METRIC_HISTORY_PARAMS);
+
+/* the metricshm.h bits of the frame errors */
+static guint32
+gst_cpu_analysis_flag_mask (ErrFlags eflags[PARAM_NUMBER])
+{
+  guint32 flags = 0;
+
+  for (int p = 0; p < PARAM_NUMBER; p++) {
+    if (eflags[p].cont)
+      flags |= METRIC_SHM_CONT_FLAG(p);
+    if (eflags[p].peak)
+      flags |= METRIC_SHM_PEAK_FLAG(p);
+  }
+  return flags;
+}
+
+/* out-of-process consumers: shared memory, the socket server,
+   the history file and the event log */
+static void
+gst_cpu_analysis_export (GstVideoAnalysis *cpu_analysis,
+                         VideoParams *params,
+                         ErrFlags eflags[PARAM_NUMBER])
+{
+  gfloat values[METRIC_SHM_PARAMS];
+  guint32 flags = gst_cpu_analysis_flag_mask(eflags);
+
+  for (int p = 0; p < PARAM_NUMBER; p++)
+    values[p] = param_of_video_params(params, p);
+  if (cpu_analysis->shm)
+    metric_shm_write(cpu_analysis->shm, params->time, values, flags);
+  if (cpu_analysis->channel)
+    metric_channel_push(cpu_analysis->channel, params->time, values, flags);
+  if (cpu_analysis->history)
+    metric_history_append(cpu_analysis->history, params->time, values, flags);
+  if (cpu_analysis->events
+      && !metric_events_track(cpu_analysis->events, params->time, flags))
+    GST_WARNING_OBJECT (cpu_analysis, "Could not log an error span to %s",
+                        cpu_analysis->events_file);
+}
+
 #include <time.h>
 /* transform */
 static GstFlowReturn
@@ -634,35 +1191,69 @@ gst_cpu_analysis_transform_frame_ip (GstVideoFilter * filter,
   GST_DEBUG_OBJECT (cpu_analysis, "transform_frame_ip");
 
   gint64 tm = g_get_real_time ();
+
+  if (cpu_analysis->summary
+      && video_summary_is_full(cpu_analysis->summary_data))
+    gst_cpu_analysis_emit_summary(cpu_analysis);
         
   if (video_data_is_full(cpu_analysis->data)
       || errors_is_full(cpu_analysis->errors) ){
 
-    gsize ds, es;
-    gpointer d = video_data_dump(cpu_analysis->data, &ds);
-    gpointer e = errors_dump(cpu_analysis->errors, &es);
-                        
-    video_data_reset(cpu_analysis->data);
-    errors_reset(cpu_analysis->errors);
-                
-    GstBuffer* db = gst_buffer_new_wrapped (d, sizeof(d));
-    GstBuffer* eb = gst_buffer_new_wrapped (e, sizeof(e));
-
-    g_signal_emit(cpu_analysis, signals[DATA_SIGNAL], 0, ds, db, es, eb);
+    gsize ds = 0, es = 0;
+    /* payloads are moved out, the storage is refilled from the pools */
+    GstBuffer* db = video_data_pull_out(cpu_analysis->data, &ds);
+    GstBuffer* eb = errors_pull_out(cpu_analysis->errors, &es);
+
+    if (db && eb) {
+      /* avoid the generic marshaller when nobody is connected */
+      if (g_signal_has_handler_pending (cpu_analysis, signals[DATA_SIGNAL], 0, FALSE))
+        g_signal_emit(cpu_analysis, signals[DATA_SIGNAL], 0, ds, db, es, eb);
+      if (gst_cpu_analysis_has_data_callback (cpu_analysis))
+        gst_cpu_analysis_batch_push (cpu_analysis, db, ds, eb, es);
+    }
+
+    /* back to the pools unless the consumer keeps a ref */
+    if (db)
+      gst_buffer_unref (db);
+    if (eb)
+      gst_buffer_unref (eb);
   }
 
   start = clock ();
   /* params */
-  analyse_buffer(frame->data[0],
-                 cpu_analysis->past_buffer,
-                 frame->info.stride[0],
-                 frame->info.width,
-                 frame->info.height,
-                 cpu_analysis->black_pixel_lb,
-                 cpu_analysis->pixel_diff_lb,
-                 cpu_analysis->mark_blocks,
-                 cpu_analysis->blocks,
-                 &params);
+  if (cpu_analysis->luma_step > 1)
+    analyse_buffer_packed(frame->data[0],
+                          cpu_analysis->band_buffer,
+                          cpu_analysis->past_buffer,
+                          frame->info.stride[0],
+                          frame->info.width,
+                          frame->info.height,
+                          cpu_analysis->luma_offset,
+                          cpu_analysis->black_pixel_lb,
+                          cpu_analysis->pixel_diff_lb,
+                          cpu_analysis->blocks,
+                          &params);
+  else if (cpu_analysis->sample_size == 1)
+    analyse_buffer(frame->data[0],
+                   cpu_analysis->past_buffer,
+                   frame->info.stride[0],
+                   frame->info.width,
+                   frame->info.height,
+                   cpu_analysis->black_pixel_lb,
+                   cpu_analysis->pixel_diff_lb,
+                   cpu_analysis->blocks,
+                   &params);
+  else
+    analyse_buffer_16(frame->data[0],
+                      (guint16*)cpu_analysis->past_buffer,
+                      frame->info.stride[0] / 2,
+                      frame->info.width,
+                      frame->info.height,
+                      cpu_analysis->depth_shift,
+                      cpu_analysis->black_pixel_lb,
+                      cpu_analysis->pixel_diff_lb,
+                      cpu_analysis->blocks,
+                      &params);
 
   end = clock ();
   cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
@@ -677,7 +1268,9 @@ gst_cpu_analysis_transform_frame_ip (GstVideoFilter * filter,
                                                            
         
   params.time = tm;
-  /* errors */
+  /* errors, the period spans are only kept for the data payload */
+  Errors *spans = (cpu_analysis->summary || cpu_analysis->ring)
+    ? NULL : cpu_analysis->errors;
   for (int p = 0; p < PARAM_NUMBER; p++) {
     float par = param_of_video_params(&params, p);
     err_flags_cmp(&(eflags[p]),
@@ -685,11 +1278,29 @@ gst_cpu_analysis_transform_frame_ip (GstVideoFilter * filter,
                   tm, TRUE,
                   &(cpu_analysis->cont_err_duration[p]),
                   cpu_analysis->fps_period,
-                  par);
+                  par,
+                  spans, p);
   }
-  /* append params and errors */
-  video_data_append(cpu_analysis->data, &params);        
-  errors_append(cpu_analysis->errors, eflags);        
+  /* append params and errors, unless they are only folded
+     into the period summary or left in the ring for the consumer */
+  if (cpu_analysis->summary)
+    video_summary_append(cpu_analysis->summary_data, &params, eflags);
+  if (cpu_analysis->ring)
+    metric_ring_push(cpu_analysis->ring, &params, eflags);
+  if (cpu_analysis->shm || cpu_analysis->channel
+      || cpu_analysis->history || cpu_analysis->events)
+    gst_cpu_analysis_export(cpu_analysis, &params, eflags);
+  if (!cpu_analysis->summary && !cpu_analysis->ring) {
+    video_data_append(cpu_analysis->data, &params,
+                      gst_cpu_analysis_flag_mask(eflags));
+    errors_append(cpu_analysis->errors);
+  }
+
+  if (cpu_analysis->attach_meta)
+    gst_buffer_add_cpu_analysis_meta(frame->buffer, &params, eflags);
+  if (cpu_analysis->mark_blocks)
+    gst_cpu_analysis_add_overlay(cpu_analysis, frame->buffer,
+                                 frame->info.width, frame->info.height);
 
   return GST_FLOW_OK;
 }
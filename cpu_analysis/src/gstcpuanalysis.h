@@ -25,6 +25,12 @@
 #include "videodata.h"
 #include "block.h"
 #include "error.h"
+#include "gstcpuanalysismeta.h"
+#include "metricring.h"
+#include "metricshm.h"
+#include "metricserver.h"
+#include "metrichistory.h"
+#include "metricevents.h"
 
 G_BEGIN_DECLS
 
@@ -39,9 +45,42 @@ G_BEGIN_DECLS
 #define GST_IS_VIDEOANALYSIS_CLASS(obj)                                 \
         (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_VIDEOANALYSIS))
 
+#define MAX_BATCH 32
+
 typedef struct _GstVideoAnalysis GstVideoAnalysis;
 typedef struct _GstVideoAnalysisClass GstVideoAnalysisClass;
 
+/* One period of measurements as it is passed to the callbacks */
+typedef struct {
+        /* params is NULL and columns is set with the compact property,
+           encoded (a metriccodec block) with the compress property */
+        const VideoParams   *params;
+        const MetricColumns *columns;
+        const guint8        *encoded;
+        gsize                encoded_size;
+        guint                frames;
+        /* error spans closed in the period, then the open ones */
+        const ErrSpan       *spans;
+        guint                n_spans;
+} GstVideoAnalysisPeriod;
+
+typedef struct {
+        /* Called on the streaming thread with batch_periods periods,
+           the data is only valid for the duration of the call */
+        void (*data) (GstVideoAnalysis *filter,
+                      const GstVideoAnalysisPeriod *periods,
+                      guint n_periods,
+                      gpointer user_data);
+        /* Called on the streaming thread once a period
+           when the summary property is set */
+        void (*summary) (GstVideoAnalysis *filter,
+                         const VideoSummary *summary,
+                         gpointer user_data);
+} GstVideoAnalysisCallbacks;
+
+/* The callbacks along with their data, held by the calls in progress */
+typedef struct _GstVideoAnalysisCallbacksRef GstVideoAnalysisCallbacksRef;
+
 struct _GstVideoAnalysis
 {
         GstVideoFilter base_cpu_analysis;
@@ -52,13 +91,43 @@ struct _GstVideoAnalysis
         guint    pixel_diff_lb;
         BOUNDARY params_boundary [PARAM_NUMBER];
         guint    mark_blocks;
+        guint    batch_periods;
+        gboolean attach_meta;
+        gboolean summary;
+        guint    ring_size;
+        gchar   *shm_name;
+        gchar   *metrics_socket;
+        gboolean compact;
+        gboolean compress;
+        gchar   *history_file;
+        gchar   *events_file;
         /* private */
         float fps_period;
         gfloat cont_err_duration [PARAM_NUMBER];
+        guint  sample_size;
+        guint  depth_shift;
+        guint  luma_step;
+        guint  luma_offset;
         guint8 *past_buffer;
+        guint8 *band_buffer;
         VideoData *data;
         Errors    *errors;
+        VideoSummaryData *summary_data;
+        /* created on the first start, lives as long as the element */
+        MetricRing *ring;
+        MetricShm  *shm;
+        MetricChannel *channel;
+        MetricHistory *history;
+        MetricEvents  *events;
         BLOCK *blocks;
+        GstBuffer *mark_pixels;
+        /* callbacks, replaced under the object lock, NULL if unset */
+        GstVideoAnalysisCallbacksRef *callbacks;
+        /* periods waiting for the callback */
+        guint                  batch_len;
+        GstVideoAnalysisPeriod batch [MAX_BATCH];
+        GstBuffer             *batch_buffers [MAX_BATCH][2];
+        GstMapInfo             batch_maps [MAX_BATCH][2];
 };
 
 struct _GstVideoAnalysisClass
@@ -66,10 +135,27 @@ struct _GstVideoAnalysisClass
         GstVideoFilterClass base_cpu_analysis_class;
 
         void (*data_signal) (GstVideoFilter *filter, guint64 ds, GstBuffer* d, guint64 es, GstBuffer* e);
+        void (*summary_signal) (GstVideoFilter *filter, GstBuffer* s);
 };
 
 GType gst_cpu_analysis_get_type (void);
 
+/* Typed alternative to the data signal, NULL callbacks unset them.
+   notify is called once the callbacks in progress have returned,
+   then possibly on the streaming thread */
+void gst_cpu_analysis_set_callbacks (GstVideoAnalysis *filter,
+                                     const GstVideoAnalysisCallbacks *callbacks,
+                                     gpointer user_data,
+                                     GDestroyNotify notify);
+
+/* Pulls up to max of the oldest frames from the metric ring
+   (ring_size > 0) on the caller's thread, overflow (nullable)
+   receives the number of frames dropped since the last pull */
+guint gst_cpu_analysis_pull (GstVideoAnalysis *filter,
+                             MetricRecord *dst,
+                             guint max,
+                             guint *overflow);
+
 G_END_DECLS
 
 #endif
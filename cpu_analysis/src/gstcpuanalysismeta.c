@@ -0,0 +1,93 @@
+/* gstcpuanalysismeta.c
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+
+#include "gstcpuanalysismeta.h"
+#include <string.h>
+
+GType
+gst_cpu_analysis_meta_api_get_type (void)
+{
+        static gsize type = 0;
+        static const gchar *tags[] = { NULL };
+
+        if (g_once_init_enter (&type)) {
+                GType _type = gst_meta_api_type_register ("GstCpuAnalysisMetaAPI", tags);
+                g_once_init_leave (&type, _type);
+        }
+        return type;
+}
+
+static gboolean
+gst_cpu_analysis_meta_init (GstMeta *meta, gpointer params, GstBuffer *buffer)
+{
+        GstCpuAnalysisMeta *ameta = (GstCpuAnalysisMeta *) meta;
+
+        memset (&ameta->params, 0, sizeof (ameta->params));
+        memset (ameta->flags, 0, sizeof (ameta->flags));
+        return TRUE;
+}
+
+static gboolean
+gst_cpu_analysis_meta_transform (GstBuffer *dest, GstMeta *meta,
+                                 GstBuffer *buffer, GQuark type, gpointer data)
+{
+        GstCpuAnalysisMeta *ameta = (GstCpuAnalysisMeta *) meta;
+
+        /* measurements describe the whole picture, so only
+           plain copies keep them */
+        if (! GST_META_TRANSFORM_IS_COPY (type))
+                return FALSE;
+
+        return gst_buffer_add_cpu_analysis_meta (dest, &ameta->params, ameta->flags) != NULL;
+}
+
+const GstMetaInfo *
+gst_cpu_analysis_meta_get_info (void)
+{
+        static const GstMetaInfo *meta_info = NULL;
+
+        if (g_once_init_enter ((GstMetaInfo **) &meta_info)) {
+                const GstMetaInfo *mi =
+                        gst_meta_register (GST_CPU_ANALYSIS_META_API_TYPE,
+                                           "GstCpuAnalysisMeta",
+                                           sizeof (GstCpuAnalysisMeta),
+                                           gst_cpu_analysis_meta_init,
+                                           NULL,
+                                           gst_cpu_analysis_meta_transform);
+                g_once_init_leave ((GstMetaInfo **) &meta_info, (GstMetaInfo *) mi);
+        }
+        return meta_info;
+}
+
+GstCpuAnalysisMeta *
+gst_buffer_add_cpu_analysis_meta (GstBuffer *buffer,
+                                  const VideoParams *params,
+                                  const ErrFlags flags [PARAM_NUMBER])
+{
+        GstCpuAnalysisMeta *meta;
+
+        g_return_val_if_fail (GST_IS_BUFFER (buffer), NULL);
+
+        meta = (GstCpuAnalysisMeta *) gst_buffer_add_meta (buffer, GST_CPU_ANALYSIS_META_INFO, NULL);
+        if (meta == NULL)
+                return NULL;
+
+        meta->params = *params;
+        memcpy (meta->flags, flags, sizeof (meta->flags));
+        return meta;
+}
@@ -0,0 +1,50 @@
+/* gstcpuanalysismeta.h
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+#ifndef _GST_CPU_ANALYSIS_META_H_
+#define _GST_CPU_ANALYSIS_META_H_
+
+#include <gst/gst.h>
+
+#include "videodata.h"
+#include "error.h"
+
+G_BEGIN_DECLS
+
+#define GST_CPU_ANALYSIS_META_API_TYPE (gst_cpu_analysis_meta_api_get_type())
+#define GST_CPU_ANALYSIS_META_INFO     (gst_cpu_analysis_meta_get_info())
+
+/* Measurements of the very frame the meta is attached to */
+typedef struct {
+        GstMeta     meta;
+        VideoParams params;
+        ErrFlags    flags [PARAM_NUMBER];
+} GstCpuAnalysisMeta;
+
+GType               gst_cpu_analysis_meta_api_get_type (void);
+const GstMetaInfo * gst_cpu_analysis_meta_get_info (void);
+
+#define gst_buffer_get_cpu_analysis_meta(b)                             \
+        ((GstCpuAnalysisMeta*)gst_buffer_get_meta((b),GST_CPU_ANALYSIS_META_API_TYPE))
+
+GstCpuAnalysisMeta * gst_buffer_add_cpu_analysis_meta (GstBuffer *buffer,
+                                                       const VideoParams *params,
+                                                       const ErrFlags flags [PARAM_NUMBER]);
+
+G_END_DECLS
+
+#endif /* _GST_CPU_ANALYSIS_META_H_ */
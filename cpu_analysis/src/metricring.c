@@ -0,0 +1,120 @@
+/* metricring.c
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+
+#include "metricring.h"
+#include <malloc.h>
+#include <string.h>
+
+MetricRing*
+metric_ring_new(guint capacity)
+{
+  MetricRing* rval;
+  guint size = 1;
+
+  if (capacity == 0) return NULL;
+  while (size < capacity)
+    size <<= 1;
+
+  rval = (MetricRing*)malloc(sizeof(MetricRing));
+  if (!rval) return NULL;
+  rval->records = (MetricRecord*)malloc(sizeof(MetricRecord) * size);
+  if (!rval->records) {
+    free(rval);
+    return NULL;
+  }
+  rval->mask = size - 1;
+  rval->head = 0;
+  rval->tail = 0;
+  rval->overflow = 0;
+  return rval;
+}
+
+void
+metric_ring_delete(MetricRing* r)
+{
+  free(r->records);
+  free(r);
+}
+
+guint
+metric_ring_capacity(MetricRing* r)
+{
+  return r->mask + 1;
+}
+
+gboolean
+metric_ring_push(MetricRing* r,
+		 VideoParams* par,
+		 ErrFlags flags[PARAM_NUMBER])
+{
+  guint head = (guint)r->head;
+  guint tail = (guint)g_atomic_int_get(&r->tail);
+  MetricRecord* rec;
+
+  if (head - tail > r->mask) {
+    g_atomic_int_inc(&r->overflow);
+    return FALSE;
+  }
+
+  rec = &r->records[head & r->mask];
+  rec->params = *par;
+  memcpy(rec->flags, flags, sizeof(rec->flags));
+  /* publishes the record */
+  g_atomic_int_set(&r->head, (gint)(head + 1));
+  return TRUE;
+}
+
+guint
+metric_ring_available(MetricRing* r)
+{
+  return (guint)g_atomic_int_get(&r->head) - (guint)r->tail;
+}
+
+guint
+metric_ring_pull(MetricRing* r,
+		 MetricRecord* dst,
+		 guint skip,
+		 guint max)
+{
+  guint tail = (guint)r->tail;
+  guint avail = (guint)g_atomic_int_get(&r->head) - tail;
+  guint n, first;
+
+  if (skip >= avail) {
+    /* nothing past skip, the skipped frames are still dropped */
+    g_atomic_int_set(&r->tail, (gint)(tail + avail));
+    return 0;
+  }
+  n = MIN(max, avail - skip);
+  tail += skip;
+
+  /* at most two contiguous pieces */
+  first = MIN(n, metric_ring_capacity(r) - (tail & r->mask));
+  memcpy(dst, &r->records[tail & r->mask], sizeof(MetricRecord) * first);
+  memcpy(dst + first, r->records, sizeof(MetricRecord) * (n - first));
+
+  /* releases the slots to the producer */
+  g_atomic_int_set(&r->tail, (gint)(tail + n));
+  return n;
+}
+
+guint
+metric_ring_take_overflow(MetricRing* r)
+{
+  return (guint)g_atomic_int_and((volatile guint*)&r->overflow, 0);
+}
@@ -0,0 +1,67 @@
+/* metricring.h
+ *
+ * Copyright (C) 2016 freyr <sky_rider_93@mail.ru> 
+ *
+ * This file is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU Lesser General Public License as 
+ * published by the Free Software Foundation; either version 3 of the 
+ * License, or (at your option) any later version. 
+ *
+ * This file is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+ * Lesser General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License 
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+*/
+#ifndef METRICRING_H
+#define METRICRING_H
+
+#include <glib.h>
+#include "videodata.h"
+#include "error.h"
+
+/* One frame as it is stored in the ring */
+typedef struct {
+  VideoParams params;
+  ErrFlags    flags[PARAM_NUMBER];
+} MetricRecord;
+
+/* Single-producer/single-consumer ring: the streaming thread
+ * appends without locks or allocation, a consumer pulls at its
+ * own pace on its own thread. When the ring is full new frames
+ * are dropped and counted instead of blocking the producer.
+ * head and tail are free-running, capacity is a power of two. */
+typedef struct {
+  guint         mask;
+  /* written by the producer only */
+  volatile gint head;
+  /* written by the consumer only */
+  volatile gint tail;
+  /* bumped by the producer, taken by the consumer */
+  volatile gint overflow;
+  MetricRecord* records;
+} MetricRing;
+
+/* capacity is rounded up to a power of two */
+MetricRing* metric_ring_new(guint capacity);
+void        metric_ring_delete(MetricRing* r);
+guint       metric_ring_capacity(MetricRing* r);
+/* producer side */
+gboolean    metric_ring_push(MetricRing* r,
+			     VideoParams* par,
+			     ErrFlags flags[PARAM_NUMBER]);
+/* consumer side: number of frames ready to be pulled */
+guint       metric_ring_available(MetricRing* r);
+/* copies up to max oldest frames starting skip frames
+ * past the tail into dst, then drops everything up to
+ * the last copied one, returns the number copied */
+guint       metric_ring_pull(MetricRing* r,
+			     MetricRecord* dst,
+			     guint skip,
+			     guint max);
+/* frames dropped because the ring was full, since the last call */
+guint       metric_ring_take_overflow(MetricRing* r);
+
+#endif /* METRICRING_H */
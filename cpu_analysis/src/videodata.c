@@ -19,6 +19,8 @@
 #include "videodata.h"
 #include <malloc.h>
 #include <string.h>
+#include <stdlib.h>
+#include <math.h>
 
 float
 param_of_video_params (VideoParams* vp, PARAMETER p)
@@ -42,24 +44,128 @@ video_data_new(guint fr)
   rval = (VideoData*)malloc(sizeof(VideoData));
   rval->frames = fr;
   rval->current = 0;
-  rval->data = (VideoParams*)malloc(sizeof(VideoParams) * fr);
+  rval->pool = payload_pool_new(sizeof(VideoParams) * fr);
+  if (!rval->pool) {
+    free(rval);
+    return NULL;
+  }
+  rval->compact = FALSE;
+  rval->columns = NULL;
+  rval->time_step = 0;
+  rval->encoder = NULL;
+  rval->data = (VideoParams*)payload_acquire(rval->pool, &rval->buffer, &rval->map);
+  return rval;
+}
+
+G_STATIC_ASSERT (PARAM_NUMBER == METRIC_COLUMNS_PARAMS);
+
+static void
+video_data_acquire_columns(VideoData* dt)
+{
+  dt->columns = (MetricColumns*)payload_acquire(dt->pool, &dt->buffer, &dt->map);
+  if (dt->columns)
+    metric_columns_init(dt->columns, dt->frames, dt->time_step);
+}
+
+VideoData*
+video_data_new_columns(guint fr, guint32 time_step)
+{
+  if (fr == 0) return NULL;
+
+  VideoData* rval;
+  rval = (VideoData*)malloc(sizeof(VideoData));
+  rval->frames = fr;
+  rval->current = 0;
+  rval->data = NULL;
+  rval->compact = TRUE;
+  rval->time_step = time_step;
+  rval->encoder = NULL;
+  rval->pool = payload_pool_new(metric_columns_size(fr));
+  if (!rval->pool) {
+    free(rval);
+    return NULL;
+  }
+  video_data_acquire_columns(rval);
   return rval;
 }
+
+G_STATIC_ASSERT (PARAM_NUMBER == METRIC_CODEC_PARAMS);
+
+VideoData*
+video_data_new_encoded(guint fr)
+{
+  if (fr == 0) return NULL;
+
+  VideoData* rval;
+  rval = (VideoData*)malloc(sizeof(VideoData));
+  rval->frames = fr;
+  rval->current = 0;
+  rval->data = NULL;
+  rval->compact = FALSE;
+  rval->columns = NULL;
+  rval->time_step = 0;
+  rval->pool = payload_pool_new(metric_codec_max_size(fr));
+  if (!rval->pool) {
+    free(rval);
+    return NULL;
+  }
+  rval->encoder = metric_encoder_new(fr);
+  payload_acquire(rval->pool, &rval->buffer, &rval->map);
+  return rval;
+}
+
+void
+video_data_reset(VideoData* dt)
+{
+  dt->current = 0;
+  if (dt->columns)
+    dt->columns->frames = 0;
+  if (dt->encoder)
+    metric_encoder_reset(dt->encoder);
+}
   
 void
 video_data_delete(VideoData* dt)
 {
-  free(dt->data);
+  if (dt->buffer) {
+    gst_buffer_unmap(dt->buffer, &dt->map);
+    gst_buffer_unref(dt->buffer);
+  }
+  payload_pool_delete(dt->pool);
+  metric_encoder_delete(dt->encoder);
   dt->data = NULL;
+  dt->columns = NULL;
+  dt->encoder = NULL;
   free(dt);
   dt = NULL;
 }
 
 gint
 video_data_append(VideoData* dt,
-		  VideoParams* par)
+		  VideoParams* par,
+		  guint32 flags)
 {
   if(dt->current == dt->frames) return -1;
+  if(dt->encoder) {
+    gfloat v[PARAM_NUMBER];
+
+    for (guint p = 0; p < PARAM_NUMBER; p++)
+      v[p] = param_of_video_params(par, p);
+    metric_encoder_push(dt->encoder, par->time, v, flags);
+    dt->current++;
+    return 0;
+  }
+  if(dt->compact) {
+    gfloat v[PARAM_NUMBER];
+
+    if(G_UNLIKELY(dt->columns == NULL)) return -1;
+    for (guint p = 0; p < PARAM_NUMBER; p++)
+      v[p] = param_of_video_params(par, p);
+    metric_columns_append(dt->columns, par->time, v);
+    dt->current++;
+    return 0;
+  }
+  if(G_UNLIKELY(dt->data == NULL)) return -1;
   guint i = dt->current;
   dt->data[i] = *par;
   dt->current++;
@@ -75,14 +181,230 @@ video_data_is_full(VideoData* dt)
 
 #include <glib/gprintf.h>
 
-gpointer
-video_data_dump(VideoData* dt, gsize* sz) {
+GstBuffer*
+video_data_pull_out(VideoData* dt, gsize* sz) {
+        GstBuffer* rval = dt->buffer;
+
         if (sz == NULL) return NULL;
         
-        *sz         = dt->current;
-        VideoParams* buf = (VideoParams*) malloc(sizeof(VideoParams) * (*sz));
-        memcpy(buf, dt->data, (sizeof(VideoParams) * (*sz)));
-        return buf;
+        *sz = dt->current;
+        if (rval != NULL) {
+                gsize size = sizeof(VideoParams) * (*sz);
+
+                if (dt->encoder)
+                        size = metric_encoder_finish(dt->encoder, dt->map.data);
+                gst_buffer_unmap(rval, &dt->map);
+                /* the pool restores the size on release,
+                   the columns are strided by the capacity */
+                if (!dt->compact)
+                        gst_buffer_set_size(rval, size);
+        }
+
+        dt->current = 0;
+        if (dt->encoder) {
+                metric_encoder_reset(dt->encoder);
+                payload_acquire(dt->pool, &dt->buffer, &dt->map);
+        } else if (dt->compact)
+                video_data_acquire_columns(dt);
+        else
+                dt->data = (VideoParams*)payload_acquire(dt->pool, &dt->buffer, &dt->map);
+        return rval;
+}
+
+static void
+quantile_sketch_init(QuantileSketch* qs, double p)
+{
+  for (guint i = 0; i < 5; i++)
+    qs->n[i] = i;
+  qs->np[0] = 0.0;
+  qs->np[1] = 2.0 * p;
+  qs->np[2] = 4.0 * p;
+  qs->np[3] = 2.0 + 2.0 * p;
+  qs->np[4] = 4.0;
+  qs->dn[0] = 0.0;
+  qs->dn[1] = p / 2.0;
+  qs->dn[2] = p;
+  qs->dn[3] = (1.0 + p) / 2.0;
+  qs->dn[4] = 1.0;
+  qs->count = 0;
+}
+
+static int
+double_cmp(const void* a, const void* b)
+{
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static void
+quantile_sketch_add(QuantileSketch* qs, double x)
+{
+  guint k;
+
+  /* the first five observations are the markers */
+  if (qs->count < 5) {
+    qs->q[qs->count++] = x;
+    if (qs->count == 5)
+      qsort(qs->q, 5, sizeof(double), double_cmp);
+    return;
+  }
+  qs->count++;
+
+  if (x < qs->q[0]) {
+    qs->q[0] = x;
+    k = 0;
+  } else if (x >= qs->q[4]) {
+    qs->q[4] = x;
+    k = 3;
+  } else {
+    for (k = 0; x >= qs->q[k + 1]; k++)
+      ;
+  }
+
+  for (guint i = k + 1; i < 5; i++)
+    qs->n[i] += 1.0;
+  for (guint i = 0; i < 5; i++)
+    qs->np[i] += qs->dn[i];
+
+  /* moving the middle markers towards their desired positions */
+  for (guint i = 1; i < 4; i++) {
+    double d = qs->np[i] - qs->n[i];
+
+    if ((d >= 1.0 && qs->n[i + 1] - qs->n[i] > 1.0)
+	|| (d <= -1.0 && qs->n[i - 1] - qs->n[i] < -1.0)) {
+      double ds = d > 0 ? 1.0 : -1.0;
+      /* piecewise-parabolic prediction */
+      double q = qs->q[i] + ds / (qs->n[i + 1] - qs->n[i - 1])
+	* ((qs->n[i] - qs->n[i - 1] + ds) * (qs->q[i + 1] - qs->q[i])
+	   / (qs->n[i + 1] - qs->n[i])
+	   + (qs->n[i + 1] - qs->n[i] - ds) * (qs->q[i] - qs->q[i - 1])
+	   / (qs->n[i] - qs->n[i - 1]));
+
+      if (qs->q[i - 1] < q && q < qs->q[i + 1]) {
+	qs->q[i] = q;
+      } else {
+	/* linear one otherwise */
+	int j = i + (int)ds;
+	qs->q[i] += ds * (qs->q[j] - qs->q[i]) / (qs->n[j] - qs->n[i]);
+      }
+      qs->n[i] += ds;
+    }
+  }
+}
+
+static double
+quantile_sketch_get(QuantileSketch* qs, double p)
+{
+  double q[5];
+  double pos;
+  guint  ind;
+
+  /* the middle marker only tracks the quantile once it has moved,
+     with five samples the markers are those samples in order */
+  if (qs->count > 5)
+    return qs->q[2];
+  if (qs->count == 0)
+    return 0.0;
+
+  /* interpolated between the closest ranks for the short periods */
+  memcpy(q, qs->q, sizeof(double) * qs->count);
+  qsort(q, qs->count, sizeof(double), double_cmp);
+  pos = p * (qs->count - 1);
+  ind = (guint)pos;
+  if (ind + 1 >= qs->count)
+    return q[qs->count - 1];
+  return q[ind] + (pos - ind) * (q[ind + 1] - q[ind]);
+}
+
+VideoSummaryData*
+video_summary_new(guint fr)
+{
+  if (fr == 0) return NULL;
+
+  VideoSummaryData* rval;
+  rval = (VideoSummaryData*)malloc(sizeof(VideoSummaryData));
+  if (!rval) return NULL;
+  rval->frames = fr;
+  video_summary_reset(rval);
+  return rval;
+}
+
+void
+video_summary_delete(VideoSummaryData* sd)
+{
+  free(sd);
+}
+
+void
+video_summary_reset(VideoSummaryData* sd)
+{
+  sd->current = 0;
+  sd->from = 0;
+  sd->to = 0;
+  for (guint p = 0; p < PARAM_NUMBER; p++) {
+    sd->min[p] = G_MAXDOUBLE;
+    sd->max[p] = -G_MAXDOUBLE;
+    sd->mean[p] = 0.0;
+    sd->m2[p] = 0.0;
+    sd->cont_err[p] = 0;
+    sd->peak_err[p] = 0;
+    quantile_sketch_init(&sd->p95[p], 0.95);
+  }
+}
+
+void
+video_summary_append(VideoSummaryData* sd,
+		     VideoParams* par,
+		     ErrFlags flags[PARAM_NUMBER])
+{
+  if (sd->current == 0)
+    sd->from = par->time;
+  sd->to = par->time;
+  sd->current++;
+
+  for (guint p = 0; p < PARAM_NUMBER; p++) {
+    double v = param_of_video_params(par, p);
+    /* Welford's running mean and variance */
+    double delta = v - sd->mean[p];
+
+    sd->mean[p] += delta / sd->current;
+    sd->m2[p] += delta * (v - sd->mean[p]);
+    if (v < sd->min[p]) sd->min[p] = v;
+    if (v > sd->max[p]) sd->max[p] = v;
+    quantile_sketch_add(&sd->p95[p], v);
+    sd->cont_err[p] += flags[p].cont ? 1 : 0;
+    sd->peak_err[p] += flags[p].peak ? 1 : 0;
+  }
+}
+
+gboolean
+video_summary_is_full(VideoSummaryData* sd)
+{
+  return sd->current >= sd->frames;
+}
+
+void
+video_summary_pull_out(VideoSummaryData* sd, VideoSummary* rval)
+{
+  rval->from = sd->from;
+  rval->to = sd->to;
+  rval->frames = sd->current;
+
+  for (guint p = 0; p < PARAM_NUMBER; p++) {
+    ParamSummary* ps = &rval->params[p];
+    gboolean empty = (sd->current == 0);
+
+    ps->min = empty ? 0.0 : sd->min[p];
+    ps->max = empty ? 0.0 : sd->max[p];
+    ps->mean = sd->mean[p];
+    ps->stddev = sd->current > 1 ? sqrt(sd->m2[p] / (sd->current - 1)) : 0.0;
+    ps->p95 = quantile_sketch_get(&sd->p95[p], 0.95);
+    ps->cont_err = sd->cont_err[p];
+    ps->peak_err = sd->peak_err[p];
+  }
+
+  video_summary_reset(sd);
 }
 
 gchar*
@@ -95,14 +417,27 @@ video_data_to_string(VideoData* dt,
   gchar* string;
 
   string = g_strdup_printf("v%d:%d:%d", stream, prog, pid);
+  /* the encoded frames are only readable from the payload */
+  if (dt->encoder)
+    return string;
   for (i = 0; i < dt->frames; i++) {
     gchar* pr_str = string;
-    gchar* tmp = g_strdup_printf(":*:%f:%f:%f:%f:%f",
-				 dt->data[i].frozen_pix,
-				 dt->data[i].black_pix,
-				 dt->data[i].blocks,
-				 dt->data[i].avg_bright,
-				 dt->data[i].avg_diff);
+    gchar* tmp;
+
+    if (dt->columns)
+      tmp = g_strdup_printf(":*:%f:%f:%f:%f:%f",
+			    metric_columns_value(dt->columns, FREEZE, i),
+			    metric_columns_value(dt->columns, BLACK, i),
+			    metric_columns_value(dt->columns, BLOCKY, i),
+			    metric_columns_value(dt->columns, LUMA, i),
+			    metric_columns_value(dt->columns, DIFF, i));
+    else
+      tmp = g_strdup_printf(":*:%f:%f:%f:%f:%f",
+			    dt->data[i].frozen_pix,
+			    dt->data[i].black_pix,
+			    dt->data[i].blocks,
+			    dt->data[i].avg_bright,
+			    dt->data[i].avg_diff);
     string = g_strconcat(pr_str, tmp, NULL);
     g_free(tmp);
     g_free(pr_str);
@@ -21,6 +21,8 @@
 #include <glib.h>
 #include <gst/gst.h>
 #include "error.h"
+#include "metriccolumns.h"
+#include "metriccodec.h"
 
 #define DATA_MARKER 0x8BA820F0
 
@@ -42,15 +44,91 @@ struct __VideoData {
   guint current;
   guint frames;
   VideoParams* data;
+  /* compact storage: data is NULL and the payload
+     is a MetricColumns block instead (see metriccolumns.h) */
+  gboolean compact;
+  MetricColumns* columns;
+  guint32 time_step;
+  /* encoded storage: data is NULL, the frames are packed by
+     encoder and the payload is a metriccodec block */
+  MetricEncoder* encoder;
+  /* data or columns is the mapped payload of buffer */
+  GstBufferPool* pool;
+  GstBuffer* buffer;
+  GstMapInfo map;
 };
 
 VideoData* video_data_new(guint fr);
-#define video_data_reset(dt)(dt->current = 0)
+/* time_step is the frame period in us */
+VideoData* video_data_new_columns(guint fr, guint32 time_step);
+VideoData* video_data_new_encoded(guint fr);
+void video_data_reset(VideoData* dt);
 void video_data_delete(VideoData* dt);
+/* flags are the metricshm.h error bits of the frame, only the
+   encoded payload keeps them, the other layouts leave the errors
+   to the Errors spans */
 gint video_data_append(VideoData* dt,
-		       VideoParams* par);
+		       VideoParams* par,
+		       guint32 flags);
 gboolean video_data_is_full(VideoData* dt);
-gpointer video_data_dump(VideoData* dt, gsize* sz);
+/* hands over the filled buffer (sized to the appended
+ * frames or the encoded block, the whole block for the
+ * columns) and takes a fresh one from the pool */
+GstBuffer* video_data_pull_out(VideoData* dt, gsize* sz);
+/* Summary mode: instead of the per-frame arrays each period is
+ * reduced to a fixed-size VideoSummary, the moments are kept
+ * running and p95 is a P^2 estimate (Jain, Chlamtac) */
+typedef struct {
+  float min;
+  float max;
+  float mean;
+  float stddev;
+  float p95;
+  /* number of frames with the error flag raised */
+  guint cont_err;
+  guint peak_err;
+} ParamSummary;
+
+typedef struct {
+  /* times of the first and the last frame */
+  gint64 from;
+  gint64 to;
+  guint  frames;
+  ParamSummary params[PARAM_NUMBER];
+} VideoSummary;
+
+typedef struct {
+  double q[5];
+  double n[5];
+  double np[5];
+  double dn[5];
+  guint  count;
+} QuantileSketch;
+
+typedef struct {
+  guint  frames;
+  guint  current;
+  gint64 from;
+  gint64 to;
+  double min[PARAM_NUMBER];
+  double max[PARAM_NUMBER];
+  double mean[PARAM_NUMBER];
+  double m2[PARAM_NUMBER];
+  guint  cont_err[PARAM_NUMBER];
+  guint  peak_err[PARAM_NUMBER];
+  QuantileSketch p95[PARAM_NUMBER];
+} VideoSummaryData;
+
+VideoSummaryData* video_summary_new(guint fr);
+void video_summary_delete(VideoSummaryData* sd);
+void video_summary_reset(VideoSummaryData* sd);
+void video_summary_append(VideoSummaryData* sd,
+			  VideoParams* par,
+			  ErrFlags flags[PARAM_NUMBER]);
+gboolean video_summary_is_full(VideoSummaryData* sd);
+/* fills the period summary and starts a new period */
+void video_summary_pull_out(VideoSummaryData* sd, VideoSummary* rval);
+
 /* convert data into string 
  * format:
  * channel:*:frozen_pix:black_pix:blocks:avg_bright:avg_diff:*:frozen_pix:black_pix:blocks:avg_bright:avg_diff
@@ -1,34 +1,55 @@
 #include <glib.h>
 #include <gst/gl/gl.h>
 
-struct accumulator {
-        GLfloat frozen;
-        GLfloat black;
-        GLfloat bright;
-        GLfloat diff;
-        GLfloat noize;
-        GLint   visible;
-};
+/* struct accumulator is declared in gstgpuanalysis.h */
+
+/* GL_KHR_shader_subgroup, missing from older GL headers */
+#ifndef GL_SUBGROUP_SUPPORTED_STAGES_KHR
+#define GL_SUBGROUP_SUPPORTED_STAGES_KHR   0x9533
+#define GL_SUBGROUP_SUPPORTED_FEATURES_KHR 0x9534
+#define GL_SUBGROUP_FEATURE_BASIC_BIT_KHR  0x00000001
+#define GL_SUBGROUP_FEATURE_ARITHMETIC_BIT_KHR 0x00000004
+#endif
+
+/* Block statistics and visibility in a single pass. A workgroup
+   covers TILE_SIZE x TILE_SIZE blocks and keeps them in shared memory
+   with a halo of one block (plus a pixel on the right and bottom):
+   the visibility of an edge depends on the noise of the block across
+   it and its taps reach 2 pixels into that block. The luma is handled
+   as 8-bit integer levels, fetched through the texture cache, with the
+   thresholds and the rounding of analyse_buffer. The source is
+   prefixed by analysis_shader_prefix and, for a single stream, by
+   analysis_shader_specialize.
+   With BATCH the frames of several streams are the layers of frames,
+   gl_WorkGroupID.z selects the stream and its parameters */
+#define TILE_SIZE 4
 
 static const char* shader_source =
-        "#version 430\n"
         "#extension GL_ARB_compute_shader : enable\n"
         "#extension GL_ARB_shader_storage_buffer_object : enable\n"
+        "#ifdef SUBGROUP\n"
+        "#extension GL_KHR_shader_subgroup_basic : require\n"
+        "#extension GL_KHR_shader_subgroup_arithmetic : require\n"
+        "#endif\n"
         "\n"
-        //"precision highp float;\n"
-        "\n"
+        "/* the levels and the thresholds of the CPU analyser */\n"
         "#define WHT_LVL 210\n"
-        "// 210 //0.90196078\n"
         "#define BLK_LVL 40\n"
-        "// 40 //0.15625\n"
         "#define WHT_DIFF 6\n"
-        "// 6 //0.0234375\n"
         "#define GRH_DIFF 2\n"
-        "// 2 //0.0078125\n"
         "#define KNORM 4\n"
         "#define L_DIFF 5\n"
         "\n"
         "#define BLOCK_SIZE 8\n"
+        "#define TILE_BLOCKS (TILE_SIZE * TILE_SIZE)\n"
+        "/* tile blocks with their neighbours */\n"
+        "#define RING (TILE_SIZE + 2)\n"
+        "#define HALO_W (RING * BLOCK_SIZE + 1)\n"
+        "#define GROUP_SIZE 256\n"
+        "/* invocations per block, each one takes 2x2 pixels */\n"
+        "#define BLOCK_INV (GROUP_SIZE / TILE_BLOCKS)\n"
+        "/* inner pixels of a block the noize is counted on, 1..5 */\n"
+        "#define INNER 5\n"
         "\n"
         "struct Noize {\n"
         "        float frozen;\n"
@@ -39,106 +60,262 @@ static const char* shader_source =
         "        int   visible;\n"
         "};\n"
         "\n"
-        "layout (r8) uniform image2D tex;\n"
-        "layout (r8) uniform image2D tex_prev;\n"
-        "uniform int width;\n"
-        "uniform int height;\n"
-        "uniform int stride;\n"
-        "uniform int black_bound;\n"
-        "uniform int freez_bound;\n"
+        "#ifdef BATCH\n"
+        "struct Stream {\n"
+        "        int   width;\n"
+        "        int   height;\n"
+        "        int   black_bound;\n"
+        "        int   freez_bound;\n"
+        "        int   cur;\n"
+        "        int   prev;\n"
+        "        int   offset;\n"
+        "        int   blocks;\n"
+        "};\n"
+        "\n"
+        "/* r8ui, the frames are copied in as they are */\n"
+        "layout (binding=0) uniform usampler2DArray frames;\n"
+        "\n"
+        "layout (std430, binding=12) readonly buffer Streams {\n"
+        "         Stream streams [];\n"
+        "};\n"
+        "\n"
+        "/* the layers are as large as the largest frame */\n"
+        "int load(ivec2 p, ivec2 size, int layer) {\n"
+        "        if (any(lessThan(p, ivec2(0))) || any(greaterThanEqual(p, size)))\n"
+        "                return 0;\n"
+        "        return int(texelFetch(frames, ivec3(p, layer), 0).r);\n"
+        "}\n"
+        "#define LOAD(p)      load(p, size, st.cur)\n"
+        "#define LOAD_PREV(p) load(p, size, st.prev)\n"
+        "#else\n"
+        "layout (binding=0) uniform sampler2D tex;\n"
+        "layout (binding=1) uniform sampler2D tex_prev;\n"
+        "\n"
+        "/* the unorm samples are n / 255 exactly, so are the levels */\n"
+        "int load(sampler2D s, ivec2 p, ivec2 size) {\n"
+        "        if (any(lessThan(p, ivec2(0))) || any(greaterThanEqual(p, size)))\n"
+        "                return 0;\n"
+        "        return int(texelFetch(s, p, 0).r * 255.0 + 0.5);\n"
+        "}\n"
+        "#define LOAD(p)      load(tex, p, size)\n"
+        "#define LOAD_PREV(p) load(tex_prev, p, size)\n"
+        "#endif\n"
         "\n"
         "layout (std430, binding=10) buffer Interm {\n"
         "         Noize noize_data [];\n"
         "};\n"
         "\n"
-        "layout (local_size_x = BLOCK_SIZE, local_size_y = BLOCK_SIZE, local_size_z = 1) in; \n"
-        "\n"
-        "        shared int noize;"
-        "        shared int bright;"
-        "        shared int diff_counter;"
-        "        shared int black;"
-        "        shared int frozen;"
+        "layout (local_size_x = GROUP_SIZE, local_size_y = 1, local_size_z = 1) in;\n"
+        "\n"
+        "const int wht_coef[20] = int[20](6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 8, 8, 8, 9, 9, 10, 12, 15, 25);\n"
+        "const int ght_coef[20] = int[20](2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 5, 5, 6, 8, 11, 21);\n"
+        "\n"
+        "shared int   pixels [HALO_W * HALO_W];\n"
+        "shared int   noize [RING * RING];\n"
+        "shared int   edges [TILE_BLOCKS * 4];\n"
+        "#ifdef SUBGROUP\n"
+        "/* one atomic per subgroup and block */\n"
+        "shared int   bright [TILE_BLOCKS];\n"
+        "shared int   diff   [TILE_BLOCKS];\n"
+        "shared int   black  [TILE_BLOCKS];\n"
+        "shared int   frozen [TILE_BLOCKS];\n"
+        "#else\n"
+        "/* tree reduction within each block */\n"
+        "shared int   bright [GROUP_SIZE];\n"
+        "shared int   diff   [GROUP_SIZE];\n"
+        "shared int   black  [GROUP_SIZE];\n"
+        "shared int   frozen [GROUP_SIZE];\n"
+        "#endif\n"
+        "\n"
+        "/* noize in whole percents, the table ends at 95 */\n"
+        "int get_coef(int noize, const int array[20]) {\n"
+        "        if((noize>100) || (noize<0))\n"
+        "                return 0;\n"
+        "        return array[min(noize/5, 19)];\n"
+        "}\n"
         "\n"
-        "int abs_int(int x) { return x * sign(x); } \n"
+        "/* p is relative to the tile origin */\n"
+        "int pixel_at(ivec2 p) { return pixels[p.y * HALO_W + p.x]; }\n"
         "\n"
         "void main() {\n"
-        "        uint  block_pos = (gl_WorkGroupID.y * (width / BLOCK_SIZE)) + gl_WorkGroupID.x;\n"
-        "        ivec2 pix_pos   = ivec2(gl_GlobalInvocationID.xy);\n"                      
-        "\n"
-        "        /* init shared*/\n"
-        "        if (gl_LocalInvocationID.xy == ivec2(0,0)) {\n"
-        "             noize = 0;\n"
-        "             bright = 0;\n"
-        "             diff_counter = 0;\n"
-        "             black = 0;\n"
-        "             frozen = 0;\n"
+        "#ifdef BATCH\n"
+        "        Stream st          = streams[gl_WorkGroupID.z];\n"
+        "        ivec2 size         = ivec2(st.width, st.height);\n"
+        "        int   black_bound  = st.black_bound;\n"
+        "        int   freez_bound  = st.freez_bound;\n"
+        "        uint  base         = st.offset;\n"
+        "#else\n"
+        "        /* constants of the specialized program */\n"
+        "        ivec2 size         = ivec2(WIDTH, HEIGHT);\n"
+        "        int   black_bound  = BLACK_BOUND;\n"
+        "        int   freez_bound  = FREEZ_BOUND;\n"
+        "        uint  base         = 0;\n"
+        "#endif\n"
+        "        uint  idx    = gl_LocalInvocationIndex;\n"
+        "        ivec2 blocks = size / BLOCK_SIZE;\n"
+        "        ivec2 origin = ivec2(gl_WorkGroupID.xy) * (TILE_SIZE * BLOCK_SIZE) - BLOCK_SIZE;\n"
+        "\n"
+        "        /* the grid fits the largest of the streams */\n"
+        "        if (any(greaterThanEqual(ivec2(gl_WorkGroupID.xy) * TILE_SIZE, blocks)))\n"
+        "                return;\n"
+        "\n"
+        "        /* Load the tile, pixels outside the frame read as 0 */\n"
+        "        for (uint i = idx; i < HALO_W * HALO_W; i += GROUP_SIZE)\n"
+        "                pixels[i] = LOAD(origin + ivec2(i % HALO_W, i / HALO_W));\n"
+        "        for (uint i = idx; i < RING * RING; i += GROUP_SIZE)\n"
+        "                noize[i] = 0;\n"
+        "#ifdef SUBGROUP\n"
+        "        if (idx < TILE_BLOCKS) {\n"
+        "                bright[idx] = 0;\n"
+        "                diff[idx] = 0;\n"
+        "                black[idx] = 0;\n"
+        "                frozen[idx] = 0;\n"
         "        }\n"
-        "        memoryBarrierShared();"
-        "        barrier();"
-        "\n"
-        "        int   pix       = int(imageLoad(tex, pix_pos).r * 255.0);\n"
-        "        int   pix_right = int(imageLoad(tex, ivec2(pix_pos.x + 1, pix_pos.y)).r * 255.0);\n"
-        "        int   pix_down  = int(imageLoad(tex, ivec2(pix_pos.x, pix_pos.y + 1)).r * 255.0);\n"
-        "        /* Noize */\n"
-        "        int   lvl = WHT_DIFF;\n"
-        "        if ((pix < WHT_LVL) && (pix > BLK_LVL)) {\n"
-        "              lvl = GRH_DIFF;\n"
+        "#endif\n"
+        "        memoryBarrierShared();\n"
+        "        barrier();\n"
+        "\n"
+        "        /* Noize of the tile blocks and of their neighbours: the inner\n"
+        "           pixels against their right and lower ones, a row per invocation */\n"
+        "        for (uint r = idx; r < RING * RING * INNER; r += GROUP_SIZE) {\n"
+        "                uint  rb = r / INNER;\n"
+        "                ivec2 p  = ivec2(rb % RING, rb / RING) * BLOCK_SIZE + ivec2(1, 1 + r % INNER);\n"
+        "                int   n  = 0;\n"
+        "                for (int x = 0; x < INNER; x++, p.x++) {\n"
+        "                        int pix = pixel_at(p);\n"
+        "                        int lvl = WHT_DIFF;\n"
+        "                        if ((pix < WHT_LVL) && (pix > BLK_LVL)) {\n"
+        "                                lvl = GRH_DIFF;\n"
+        "                        }\n"
+        "                        n += int(abs(pix - pixel_at(p + ivec2(1, 0))) >= lvl)\n"
+        "                                + int(abs(pix - pixel_at(p + ivec2(0, 1))) >= lvl);\n"
+        "                }\n"
+        "                atomicAdd(noize[rb], n);\n"
         "        }\n"
-        "        if (abs(pix - pix_right) > lvl) {\n"
-        "            atomicAdd(noize, 1);\n"
+        "\n"
+        "        /* Brightness, black, diff and frozen of the tile blocks */\n"
+        "        uint  blk  = idx / BLOCK_INV;\n"
+        "        uint  sub  = idx % BLOCK_INV;\n"
+        "        ivec2 quad = (ivec2(blk % TILE_SIZE, blk / TILE_SIZE) + 1) * BLOCK_SIZE\n"
+        "                     + ivec2(sub % 4, sub / 4) * 2;\n"
+        "        int   s_bright = 0, s_diff = 0, s_black = 0, s_frozen = 0;\n"
+        "        for (int q = 0; q < 4; q++) {\n"
+        "                ivec2 p        = quad + ivec2(q % 2, q / 2);\n"
+        "                int   pix      = pixel_at(p);\n"
+        "                int   diff_pix = abs(pix - LOAD_PREV(origin + p));\n"
+        "                s_bright += pix;\n"
+        "                s_black  += int(pix <= black_bound);\n"
+        "                s_diff   += diff_pix;\n"
+        "                s_frozen += int(diff_pix <= freez_bound);\n"
         "        }\n"
-        "        if (abs(pix - pix_down) > lvl) {\n"
-        "            atomicAdd(noize, 1);\n"
+        "#ifdef SUBGROUP\n"
+        "        /* a subgroup may span several blocks */\n"
+        "        uint last = subgroupMax(blk);\n"
+        "        for (uint b = subgroupMin(blk); b <= last; b++) {\n"
+        "                ivec4 s = subgroupAdd(blk == b\n"
+        "                                      ? ivec4(s_bright, s_diff, s_black, s_frozen)\n"
+        "                                      : ivec4(0));\n"
+        "                if (subgroupElect()) {\n"
+        "                        atomicAdd(bright[b], s.x);\n"
+        "                        atomicAdd(diff[b], s.y);\n"
+        "                        atomicAdd(black[b], s.z);\n"
+        "                        atomicAdd(frozen[b], s.w);\n"
+        "                }\n"
         "        }\n"
-        "        /* Brightness */\n"
-        "        atomicAdd(bright, pix);\n"
-        "        /* Black */\n"
-        "        if (pix <= black_bound) {\n"
-        "            atomicAdd(black, 1);\n"
+        "        memoryBarrierShared();\n"
+        "        barrier();\n"
+        "#else\n"
+        "        bright[idx] = s_bright;\n"
+        "        diff[idx] = s_diff;\n"
+        "        black[idx] = s_black;\n"
+        "        frozen[idx] = s_frozen;\n"
+        "        memoryBarrierShared();\n"
+        "        barrier();\n"
+        "        for (uint s = BLOCK_INV / 2; s > 0; s >>= 1) {\n"
+        "                if (sub < s) {\n"
+        "                        bright[idx] += bright[idx + s];\n"
+        "                        diff[idx] += diff[idx + s];\n"
+        "                        black[idx] += black[idx + s];\n"
+        "                        frozen[idx] += frozen[idx + s];\n"
+        "                }\n"
+        "                memoryBarrierShared();\n"
+        "                barrier();\n"
         "        }\n"
-        "        /* Diff */\n"
-        "        int   pix_prev = int(imageLoad(tex_prev, pix_pos).r * 255.0);\n"
-        "        int   diff_pix = abs_int(pix - pix_prev);\n"
-        "        atomicAdd(diff_counter, diff_pix);\n"
-        "        /* Frozen */\n"
-        //       TODO consider diff_pid = int(abs(imageLoad(tex_prev, pix_pos).r - imageLoad(tex, pix_pos).r) * 255.0)
-        //       TODO <=
-        "        if (diff_pix < freez_bound) {\n"
-        "            atomicAdd(frozen, 1);\n"
+        "#endif\n"
+        "\n"
+        "        /* Edge visibility, an edge of a tile block per invocation.\n"
+        "           l (-1, 0) d (0, -1) r (1, 0) u (0, 1) */\n"
+        "        if (idx < TILE_BLOCKS * 4) {\n"
+        "                uint  b    = idx / 4;\n"
+        "                uint  edge = idx % 4;\n"
+        "                ivec2 edge_off = ivec2 ( mod(edge + 1, 2) * int(edge - 1),\n"
+        "                                         mod(edge, 2) * int(edge - 2));\n"
+        "                ivec2 c    = ivec2(b % TILE_SIZE, b / TILE_SIZE) + 1;\n"
+        "                ivec2 nc   = c + edge_off;\n"
+        "                ivec2 dir  = abs(edge_off);\n"
+        "                /* the taps cross the edge from the first pixel\n"
+        "                   of the right or lower block, as on the CPU */\n"
+        "                ivec2 p    = max(c, nc) * BLOCK_SIZE;\n"
+        "                /* Noize coeffs */\n"
+        "                int   noize_v = 100 * max(noize[c.y * RING + c.x], noize[nc.y * RING + nc.x])\n"
+        "                                / (6 * INNER * 2);\n"
+        "                int   white = get_coef(noize_v, wht_coef);\n"
+        "                int   grey  = get_coef(noize_v, ght_coef);\n"
+        "                int   vis   = 0;\n"
+        "\n"
+        "                for (int pixel_off = 0; pixel_off < BLOCK_SIZE; pixel_off++, p += dir.yx) {\n"
+        "                        int pixel     = pixel_at(p);\n"
+        "                        int next      = pixel_at(p - dir);\n"
+        "                        int next_next = pixel_at(p - 2 * dir);\n"
+        "                        int prev      = pixel_at(p + dir);\n"
+        "                        int coef      = ((pixel < WHT_LVL) && (pixel > BLK_LVL)) ? grey : white;\n"
+        "                        /* rounded half up, and norm > coef without the division */\n"
+        "                        int denom     = (abs(prev - pixel) + abs(next - next_next) + KNORM / 2) / KNORM;\n"
+        "                        if (abs(next - pixel) > coef * max(denom, 1))\n"
+        "                                vis++;\n"
+        "                }\n"
+        "                edges[idx] = int(vis > L_DIFF);\n"
         "        }\n"
-        "        memoryBarrierShared();"
-        "        barrier();"
+        "        memoryBarrierShared();\n"
+        "        barrier();\n"
+        "\n"
         "        /* Store results */\n"
-        "        if (gl_LocalInvocationID.xy == ivec2(0,0)) {\n"
-        "            noize_data[block_pos].noize  = float(noize) / (8.0 * 8.0 * 2.0);\n"
-        "            noize_data[block_pos].black  = float(black);\n"
-        "            noize_data[block_pos].frozen = float(frozen);\n"
-        "            noize_data[block_pos].bright = float(bright) / 256.0;\n"
-        "            noize_data[block_pos].diff   = float(diff_counter);\n"
-        "            noize_data[block_pos].visible = 0;\n"
-        "        }\n"    
+        "        if (idx < TILE_BLOCKS) {\n"
+        "                ivec2 c  = ivec2(idx % TILE_SIZE, idx / TILE_SIZE);\n"
+        "                ivec2 bp = ivec2(gl_WorkGroupID.xy) * TILE_SIZE + c;\n"
+        "                /* the reduced values of a block are at its first invocation\n"
+        "                   without subgroups */\n"
+        "#ifdef SUBGROUP\n"
+        "                uint  res = idx;\n"
+        "#else\n"
+        "                uint  res = idx * BLOCK_INV;\n"
+        "#endif\n"
+        "                if (bp.x < blocks.x && bp.y < blocks.y) {\n"
+        "                        uint block_pos = base + bp.y * blocks.x + bp.x;\n"
+        "                        int  visible = edges[idx * 4] + edges[idx * 4 + 1]\n"
+        "                                + edges[idx * 4 + 2] + edges[idx * 4 + 3];\n"
+        "                        noize_data[block_pos].noize  = float(noize[(c.y + 1) * RING + c.x + 1]) / (6.0 * INNER * 2.0);\n"
+        "                        noize_data[block_pos].black  = float(black[res]);\n"
+        "                        noize_data[block_pos].frozen = float(frozen[res]);\n"
+        "                        noize_data[block_pos].bright = float(bright[res]);\n"
+        "                        noize_data[block_pos].diff   = float(diff[res]);\n"
+        "                        /* Would not compute blocks on the borders */\n"
+        "                        noize_data[block_pos].visible =\n"
+        "                                (any(equal(bp, ivec2(0))) || any(equal(bp, blocks - 1)))\n"
+        "                                ? 0 : int(visible >= 2);\n"
+        "                }\n"
+        "        }\n"
         "}\n";
 
-static const char* shader_source_block =
-        "#version 430\n"
+/* Sums the per-block accumulators into a single one in one workgroup,
+   each invocation folds every REDUCE_SIZE-th block and the partial
+   sums are then added pairwise in shared memory. Prefixed as
+   shader_source, with BATCH a workgroup per stream */
+static const char* shader_source_reduce =
         "#extension GL_ARB_compute_shader : enable\n"
-        "#extension GL_ARB_shader_image_load_store : enable\n"
         "#extension GL_ARB_shader_storage_buffer_object : enable\n"
         "\n"
-        "//precision lowp float;\n"
-        "\n"
-        "#define WHT_LVL 0.90196078\n"
-        "// 210\n"
-        "#define BLK_LVL 0.15625\n"
-        "// 40\n"
-        "#define WHT_DIFF 0.0234375\n"
-        "// 6\n"
-        "#define GRH_DIFF 0.0078125\n"
-        "// 2\n"
-        "#define KNORM 4.0\n"
-        "#define L_DIFF 5\n"
-        "\n"
-        "#define BLOCK_SIZE 8\n"
+        "#define REDUCE_SIZE 256\n"
         "\n"
         "struct Noize {\n"
         "        float frozen;\n"
@@ -149,110 +326,130 @@ static const char* shader_source_block =
         "        int   visible;\n"
         "};\n"
         "\n"
-        "layout (r8, binding = 0) uniform image2D tex;\n"
+        "#ifdef BATCH\n"
+        "struct Stream {\n"
+        "        int   width;\n"
+        "        int   height;\n"
+        "        int   black_bound;\n"
+        "        int   freez_bound;\n"
+        "        int   cur;\n"
+        "        int   prev;\n"
+        "        int   offset;\n"
+        "        int   blocks;\n"
+        "};\n"
         "\n"
-        "uniform int width;\n"
-        "uniform int height;\n"
+        "layout (std430, binding=12) readonly buffer Streams {\n"
+        "         Stream streams [];\n"
+        "};\n"
+        "#endif\n"
         "\n"
-        "layout (std430, binding=10) buffer Interm {\n"
+        "layout (std430, binding=10) readonly buffer Interm {\n"
         "         Noize noize_data [];\n"
         "};\n"
         "\n"
-        "//const uint wht_coef[20] = {8, 8, 8, 8, 9, 9, 9, 9, 9, 9, 9, 10, 10, 10, 11, 11, 12, 14, 17, 27};\n"
-        "//const uint ght_coef[20] = {4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 6, 6, 6, 7, 7, 8, 10, 13, 23};\n"
-        "//const uint wht_coef[20] = {10, 10, 10, 10, 11, 11, 11, 11, 11, 11, 11, 12, 12, 12, 13, 13, 14, 16, 19, 29};	       \n"
-        "//const uint ght_coef[20] = {6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 8, 8, 8, 9, 9, 10, 12, 15, 25};\n"
-        "const uint wht_coef[20] = {6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 8, 8, 8, 9, 9, 10, 12, 15, 25};\n"
-        "const uint ght_coef[20] = {2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 5, 5, 6, 8, 11, 21};\n"
-        "\n"
-        "/* x = Edge pixel offset, y = Edge ID */\n"
-        "layout (local_size_x = 8, local_size_y = 4, local_size_z = 1) in;\n"
+        "layout (std430, binding=11) writeonly buffer Totals {\n"
+        "         Noize totals [];\n"
+        "};\n"
         "\n"
-        "float get_coef(float noize, uint array[20]) {\n"
-        "        uint ret_val;                                     \n"
-        "        if((noize>100) || (noize<0))\n"
-        "                ret_val = 0;                              \n"
-        "        else                                              \n"
-        "                ret_val = array[uint(noize/5)];                 \n"
-        "        return float(ret_val/255.0);\n"
-        "}\n"
+        "layout (local_size_x = REDUCE_SIZE, local_size_y = 1, local_size_z = 1) in;\n"
         "\n"
-        "int abs_int(int x) { return x * sign(x); } \n"
+        "shared float frozen  [REDUCE_SIZE];\n"
+        "shared float black   [REDUCE_SIZE];\n"
+        "shared float bright  [REDUCE_SIZE];\n"
+        "shared float diff    [REDUCE_SIZE];\n"
+        "shared int   visible [REDUCE_SIZE];\n"
         "\n"
         "void main() {\n"
-        "        uint block_pos = (gl_WorkGroupID.y * (width / BLOCK_SIZE)) + gl_WorkGroupID.x;\n"
-        "        /* l d r u */\n"
-        "        uint pixel_off = gl_LocalInvocationID.x;\n"
-        "        uint edge = gl_LocalInvocationID.y;\n"
-        "        /* l (-1, 0) d (0, -1) r (1, 0) u (0, 1) */ \n"
-        "        ivec2 edge_off = ivec2 ( mod(edge + 1, 2) * int(edge - 1),\n"
-        "                                 mod(edge, 2) * int(edge - 2));\n"
-        "\n"
-        "        /* Would not compute blocks near the borders */\n"
-        "        if (gl_WorkGroupID.x == 0\n"
-        "            || gl_WorkGroupID.x >= (width / BLOCK_SIZE)\n"
-        "            || gl_WorkGroupID.y == 0\n"
-        "            || gl_WorkGroupID.y >= (height / BLOCK_SIZE))\n"
-        "                return;\n"
-        "\n"
-        "        shared int loc_counter;\n"
-        "        shared int vis[4];\n"
-        "        /* Noize coeffs */\n"
-        "        uint pos = block_pos + edge_off.x + (edge_off.y * width / BLOCK_SIZE);\n"
-        "        float noize = 100.0 * max(noize_data[block_pos].noize, noize_data[pos].noize);\n"
-        "        float white = get_coef(noize, wht_coef);\n"
-        "        float grey  = get_coef(noize, ght_coef);\n"
-        "\n"
-        "        if (gl_LocalInvocationID.x == 0) {\n"
-        "\n"
-        "                loc_counter = 0;\n"
-        "                atomicExchange(vis[edge], 0);\n"
-        "\n"
+        "        uint i = gl_LocalInvocationID.x;\n"
+        "        uint z = gl_WorkGroupID.z;\n"
+        "#ifdef BATCH\n"
+        "        uint base = streams[z].offset;\n"
+        "        uint end  = base + streams[z].blocks;\n"
+        "#else\n"
+        "        uint base = 0;\n"
+        "        uint end  = (WIDTH / 8) * (HEIGHT / 8);\n"
+        "#endif\n"
+        "        Noize acc = Noize(0.0, 0.0, 0.0, 0.0, 0.0, 0);\n"
+        "\n"
+        "        for (uint n = base + i; n < end; n += REDUCE_SIZE) {\n"
+        "                acc.frozen  += noize_data[n].frozen;\n"
+        "                acc.black   += noize_data[n].black;\n"
+        "                acc.bright  += noize_data[n].bright;\n"
+        "                acc.diff    += noize_data[n].diff;\n"
+        "                acc.visible += noize_data[n].visible;\n"
         "        }\n"
+        "        frozen[i]  = acc.frozen;\n"
+        "        black[i]   = acc.black;\n"
+        "        bright[i]  = acc.bright;\n"
+        "        diff[i]    = acc.diff;\n"
+        "        visible[i] = acc.visible;\n"
+        "        memoryBarrierShared();\n"
+        "        barrier();\n"
         "\n"
-        "        ivec2 zero = ivec2(gl_WorkGroupID.x * BLOCK_SIZE,\n"
-        "                           gl_WorkGroupID.y * BLOCK_SIZE);\n"
-        "        float pixel = imageLoad(tex, ivec2(zero.x + abs_int(edge_off.y) * pixel_off +\n"
-        "                                           (edge_off.x == 1 ? (BLOCK_SIZE-1) : 0),\n"
-        "                                           zero.y + abs_int(edge_off.x) * pixel_off +\n"
-        "                                           (edge_off.y == 1 ? (BLOCK_SIZE-1) : 0))).r;\n"
-        "        float prev  = imageLoad(tex, ivec2(zero.x + abs_int(edge_off.y) * pixel_off + \n"
-        "                                           (edge_off.x == 1 ? (BLOCK_SIZE-2) : 0) + \n"
-        "                                           (edge_off.x == -1 ? 1 : 0), \n"
-        "                                           zero.y + abs_int(edge_off.x) * pixel_off + \n"
-        "                                           (edge_off.y == 1 ? (BLOCK_SIZE-2) : 0) + \n"
-        "                                           (edge_off.y == 1 ? 1 : 0))).r;\n"
-        "        float next  = imageLoad(tex, ivec2(zero.x + abs_int(edge_off.y) * pixel_off + \n"
-        "                                           (edge_off.x == 1 ? BLOCK_SIZE : 0) + \n"
-        "                                           (edge_off.x == -1 ? -1 : 0),\n"
-        "                                           zero.y + abs_int(edge_off.x) * pixel_off + \n"
-        "                                           (edge_off.y == 1 ? BLOCK_SIZE : 0) + \n"
-        "                                           (edge_off.y == 1 ? -1 : 0))).r;\n"
-        "        float next_next  = imageLoad(tex, ivec2(zero.x + abs_int(edge_off.y) * pixel_off + \n"
-        "                                                (edge_off.x == 1 ? (BLOCK_SIZE+1) : 0) + \n"
-        "                                                (edge_off.x == -1 ? -2 : 0), \n"
-        "                                                zero.y + abs_int(edge_off.x) * pixel_off + \n"
-        "                                                (edge_off.y == 1 ? (BLOCK_SIZE+1) : 0) + \n"
-        "                                                (edge_off.y == 1 ? -2 : 0))).r;\n"
-        "        float coef = ((pixel < WHT_LVL) && (pixel > BLK_LVL)) ? grey : white;\n"
-        "        float denom = round( (abs(prev-pixel) + abs(next-next_next) ) / KNORM);\n"
-        "        denom = (denom == 0.0) ? 1.0 : denom;\n"
-        "        float norm = abs(next-pixel) / denom;\n"
-        "        \n"
-        "        if (norm > coef)\n"
-        "                atomicAdd(vis[edge], 1);\n"
-        "\n"
-        "        /* counting visible blocks */\n"
-        "\n"
-        "        if (gl_LocalInvocationID.x == 0) {\n"
-        "                if (vis[edge] > L_DIFF)\n"
-        "                        atomicAdd(loc_counter, 1);\n"
+        "        for (uint s = REDUCE_SIZE / 2; s > 0; s >>= 1) {\n"
+        "                if (i < s) {\n"
+        "                        frozen[i]  += frozen[i + s];\n"
+        "                        black[i]   += black[i + s];\n"
+        "                        bright[i]  += bright[i + s];\n"
+        "                        diff[i]    += diff[i + s];\n"
+        "                        visible[i] += visible[i + s];\n"
+        "                }\n"
+        "                memoryBarrierShared();\n"
+        "                barrier();\n"
         "        }\n"
         "\n"
-        "        barrier();\n"
-        "\n"
-        "        if (gl_LocalInvocationID.xy == ivec2(0,0)) {\n"
-        "                if (loc_counter >= 2)\n"
-        "                        noize_data[block_pos].visible = 1;\n"
+        "        if (i == 0) {\n"
+        "                totals[z].frozen  = frozen[0];\n"
+        "                totals[z].black   = black[0];\n"
+        "                totals[z].bright  = bright[0];\n"
+        "                totals[z].diff    = diff[0];\n"
+        "                totals[z].noize   = 0.0;\n"
+        "                totals[z].visible = visible[0];\n"
         "        }\n"
         "}\n";
+
+/* Subgroup arithmetic in compute shaders replaces the shared-memory
+   reduction of the block statistics where it is available */
+static inline gboolean
+analysis_has_subgroup (GstGLContext * context)
+{
+  GLint stages = 0, features = 0;
+  const GLint needed = GL_SUBGROUP_FEATURE_BASIC_BIT_KHR
+    | GL_SUBGROUP_FEATURE_ARITHMETIC_BIT_KHR;
+
+  if (!gst_gl_context_check_feature (context, "GL_KHR_shader_subgroup"))
+    return FALSE;
+
+  glGetIntegerv (GL_SUBGROUP_SUPPORTED_STAGES_KHR, &stages);
+  glGetIntegerv (GL_SUBGROUP_SUPPORTED_FEATURES_KHR, &features);
+  return (stages & GL_COMPUTE_SHADER_BIT) && (features & needed) == needed;
+}
+
+/* The #version line and the defines the shaders above are built with */
+static inline gchar *
+analysis_shader_prefix (gboolean subgroup, gboolean batch)
+{
+  return g_strdup_printf ("#version 430\n"
+                          "#define TILE_SIZE %d\n"
+                          "%s%s",
+                          TILE_SIZE,
+                          subgroup ? "#define SUBGROUP\n" : "",
+                          batch ? "#define BATCH\n" : "");
+}
+
+/* The frame size and the bounds of a single stream as constants,
+   so that a program is built per caps and bounds */
+static inline gchar *
+analysis_shader_specialize (const gchar * prefix,
+                            gint width,
+                            gint height,
+                            guint black_bound,
+                            guint freez_bound)
+{
+  return g_strdup_printf ("%s"
+                          "#define WIDTH %d\n"
+                          "#define HEIGHT %d\n"
+                          "#define BLACK_BOUND %u\n"
+                          "#define FREEZ_BOUND %u\n",
+                          prefix, width, height, black_bound, freez_bound);
+}
@@ -38,6 +38,7 @@ void
 data_ctx_init (struct data_ctx * ctx)
 {
   ctx->ptr = NULL;
+  ctx->columns = NULL;
 }
 
 void
@@ -50,6 +51,7 @@ data_ctx_reset (struct data_ctx * ctx,
     free (ctx->ptr);
 
   ctx->limit = length;
+  ctx->columns = NULL;
 
   ctx->ptr = malloc (sizeof (struct flags) * PARAM_NUMBER
                      + (sizeof (struct data) + length * sizeof (struct point)) * PARAM_NUMBER);
@@ -69,6 +71,32 @@ data_ctx_reset (struct data_ctx * ctx,
   }
 }
 
+G_STATIC_ASSERT (PARAM_NUMBER == METRIC_COLUMNS_PARAMS);
+
+void
+data_ctx_reset_columns (struct data_ctx * ctx,
+                        guint32 length,
+                        guint32 time_step)
+{
+  if (ctx->ptr != NULL)
+    free (ctx->ptr);
+
+  ctx->limit = length;
+
+  ctx->ptr = malloc (sizeof (struct flags) * PARAM_NUMBER
+                     + metric_columns_size (length));
+
+  for (int i = 0; i < PARAM_NUMBER; i++) {
+    ctx->errs[i] = ctx->ptr + i * sizeof(struct flags);
+    ctx->current[i] = NULL;
+    ctx->counters[i] = 0;
+    ctx->point_counter[i] = &ctx->counters[i];
+  }
+
+  ctx->columns = ctx->ptr + PARAM_NUMBER * sizeof(struct flags);
+  metric_columns_init (ctx->columns, length, time_step);
+}
+
 void
 data_ctx_delete (struct data_ctx * ctx)
 {
@@ -76,6 +104,7 @@ data_ctx_delete (struct data_ctx * ctx)
     free (ctx->ptr);
 
   ctx->ptr = NULL;
+  ctx->columns = NULL;
 }
 
 void
@@ -88,6 +117,12 @@ data_ctx_add_point (struct data_ctx * ctx,
 
   if (G_UNLIKELY (*ctx->point_counter[p] >= ctx->limit))
     return; /* TODO assert? */
+
+  if (ctx->columns) {
+    metric_columns_set (ctx->columns, p, *ctx->point_counter[p], t, v);
+    (*ctx->point_counter[p])++;
+    return;
+  }
     
   ctx->current[p]->time = t;
   ctx->current[p]->data = v;
@@ -108,16 +143,44 @@ data_ctx_pull_out_data (struct data_ctx * ctx,
     sz += sizeof (struct flags) * PARAM_NUMBER;
 
     /* Assume all measurments are of the same size */
-    sz += (sizeof (struct data) + ctx->limit * sizeof (struct point)) * PARAM_NUMBER;
+    if (ctx->columns)
+      sz += metric_columns_size (ctx->limit);
+    else
+      sz += (sizeof (struct data) + ctx->limit * sizeof (struct point)) * PARAM_NUMBER;
   }
   
   ctx->ptr = NULL;
+  ctx->columns = NULL;
 
   *size = sz;
   
   return data;
 }
 
+void
+data_ctx_payload_layout (const void * payload,
+                         const struct flags ** flags,
+                         const struct data * data [PARAM_NUMBER])
+{
+  const void * data_ptr = payload + PARAM_NUMBER * sizeof(struct flags);
+
+  *flags = payload;
+
+  for (int i = 0; i < PARAM_NUMBER; i++) {
+    data[i] = data_ptr;
+    data_ptr += sizeof(struct data) + sizeof(struct point) * data[i]->length;
+  }
+}
+
+void
+data_ctx_payload_columns (const void * payload,
+                          const struct flags ** flags,
+                          const MetricColumns ** columns)
+{
+  *flags = payload;
+  *columns = payload + PARAM_NUMBER * sizeof(struct flags);
+}
+
 void
 data_ctx_flags_cmp (struct data_ctx * ctx,
                     PARAMETER param,
@@ -125,7 +188,9 @@ data_ctx_flags_cmp (struct data_ctx * ctx,
                     gboolean upper,
                     float * dur,
                     float dur_d,
-                    double val)
+                    double val,
+                    gboolean * peak_out,
+                    gboolean * cont_out)
 {
   gboolean peak = FALSE, cont = FALSE;
   struct flags * flags = ctx->errs [param];
@@ -147,4 +212,9 @@ data_ctx_flags_cmp (struct data_ctx * ctx,
     flags->peak_flag.value = peak;
   if (cont)
     flags->cont_flag.value = cont;
+
+  if (peak_out)
+    *peak_out = peak;
+  if (cont_out)
+    *cont_out = cont;
 }
@@ -3,6 +3,7 @@
 
 #include <gst/gst.h>
 #include <glib.h>
+#include "metriccolumns.h"
 
 typedef enum {
   BLACK,
@@ -52,7 +53,11 @@ struct data_ctx {
   struct point * current [PARAM_NUMBER];
   guint * point_counter [PARAM_NUMBER];
   guint limit;
-  /* flags [PARAM_NUMBER] data [PARAM_NUMBER] */
+  /* set by data_ctx_reset_columns, current is unused then */
+  MetricColumns * columns;
+  guint counters [PARAM_NUMBER];
+  /* flags [PARAM_NUMBER] data [PARAM_NUMBER]
+     or flags [PARAM_NUMBER] MetricColumns */
   void * ptr;
 };
 
@@ -61,6 +66,11 @@ void data_ctx_init (struct data_ctx * ctx);
 void data_ctx_reset (struct data_ctx * ctx,
                      guint32 length);
 
+/* compact payload, time_step is the frame duration in us */
+void data_ctx_reset_columns (struct data_ctx * ctx,
+                             guint32 length,
+                             guint32 time_step);
+
 void data_ctx_delete (struct data_ctx * ctx);
 
 void data_ctx_add_point (struct data_ctx * ctx,
@@ -72,13 +82,26 @@ void data_ctx_add_point (struct data_ctx * ctx,
 void * data_ctx_pull_out_data (struct data_ctx * ctx,
                                size_t * size);
 
+/* locates flags and per-parameter data in a pulled out payload */
+void data_ctx_payload_layout (const void * payload,
+                              const struct flags ** flags,
+                              const struct data * data [PARAM_NUMBER]);
+
+/* the same for a data_ctx_reset_columns payload */
+void data_ctx_payload_columns (const void * payload,
+                               const struct flags ** flags,
+                               const MetricColumns ** columns);
+
+/* peak and cont (nullable) receive the frame's own flags */
 void data_ctx_flags_cmp (struct data_ctx * ctx,
                          PARAMETER param,
                          struct boundary * bounds,
                          gboolean upper,
                          float * dur,
                          float dur_d,
-                         double val);
+                         double val,
+                         gboolean * peak_out,
+                         gboolean * cont_out);
 
 /*
 void err_reset (Error*, guint);
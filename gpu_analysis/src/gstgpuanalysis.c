@@ -34,12 +34,16 @@
 #include <GLES3/gl31.h>
 #include <assert.h>
 #include <math.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "gstgpuanalysis.h"
 
 #include "analysis.h"
+#include "streambatch.h"
+#include "programcache.h"
+#include "lumacache.h"
 
 #define MODULUS(n,m)                            \
   ({                                            \
@@ -64,7 +68,7 @@ static void gst_gpu_analysis_get_property (GObject * object,
                                            GValue * value,
                                            GParamSpec * pspec);
 
-//static void gst_gpu_analysis_finalize(GObject *object);
+static void gst_gpu_analysis_finalize (GObject *object);
 
 static void gst_gpu_analysis_dispose (GObject *object);
 
@@ -78,7 +82,23 @@ static gboolean gst_gpu_analysis_set_caps (GstBaseTransform * trans,
 static GstFlowReturn gst_gpu_analysis_transform_ip (GstBaseTransform * filter,
                                                     GstBuffer * inbuf);
 
-static gboolean gpu_analysis_apply (GstGPUAnalysis * va, GstGLMemory * mem);
+static gboolean gpu_analysis_apply (GstGPUAnalysis * va, GstBuffer * buf);
+
+static void _drain (GstGLContext * context, GstGPUAnalysis * va);
+
+static void _release_frames (GstGLContext * context, GstGPUAnalysis * va);
+
+static void _stream_batch_leave (GstGLContext * context, GstGPUAnalysis * va);
+
+static void _programs_release (GstGLContext * context, GstGPUAnalysis * va);
+
+static void _gl_release (GstGLContext * context, GstGPUAnalysis * va);
+
+static void _result_free (struct analysis_result * result);
+
+static struct analysis_result * _consume_results (GstGPUAnalysis * va,
+                                                  gboolean peak [PARAM_NUMBER],
+                                                  gboolean cont [PARAM_NUMBER]);
 
 //static void gst_gpu_analysis_timeout_loop (GstGPUAnalysis * va);
 
@@ -127,15 +147,26 @@ enum
     PROP_BLOCKY_PEAK,
     PROP_BLOCKY_PEAK_EN,
     PROP_BLOCKY_DURATION,
+    PROP_BATCH_PERIODS,
+    PROP_ATTACH_META,
+    PROP_SHM_NAME,
+    PROP_METRICS_SOCKET,
+    PROP_COMPACT,
+    PROP_HISTORY_FILE,
+    PROP_EVENTS_FILE,
+    PROP_BLOCK_GRID,
+    PROP_BATCH_STREAMS,
     LAST_PROP
   };
 
 static guint      signals[LAST_SIGNAL]   = { 0 };
 static GParamSpec *properties[LAST_PROP] = { NULL, };
 
-/* pad templates */
+/* pad templates, the Y plane of system memory frames is uploaded
+   by the element itself */
 static const gchar caps_string[] =
-  "video/x-raw(memory:GLMemory),format=(string){I420,NV12,NV21,YV12}";
+  "video/x-raw(memory:GLMemory),format=(string){I420,NV12,NV21,YV12}; "
+  "video/x-raw,format=(string){I420,NV12,NV21,YV12}";
 
 /* class initialization */
 G_DEFINE_TYPE_WITH_CODE (GstGPUAnalysis,
@@ -174,7 +205,7 @@ gst_gpu_analysis_class_init (GstGPUAnalysisClass * klass)
 
   gobject_class->set_property = gst_gpu_analysis_set_property;
   gobject_class->get_property = gst_gpu_analysis_get_property;
-  //gobject_class->finalize     = gst_gpu_analysis_finalize;
+  gobject_class->finalize     = gst_gpu_analysis_finalize;
   gobject_class->dispose      = gst_gpu_analysis_dispose;
   element_class->change_state = gst_gpu_analysis_change_state;
   
@@ -204,8 +235,9 @@ gst_gpu_analysis_class_init (GstGPUAnalysisClass * klass)
                       1, G_MAXUINT, 10, G_PARAM_READWRITE);
   properties [PROP_LATENCY] =
     g_param_spec_uint("latency", "Latency",
-                      "Measurment latency (frame), bigger latency may reduce GPU stalling. 1 - instant measurment, 2 - 1-frame latency, etc.",
-                      1, MAX_LATENCY, 3, G_PARAM_READWRITE);
+                      "Frames in flight on the GPU, bigger latency may reduce GPU stalling. Measurments come back up to latency frames late, frames beyond it are not analysed.",
+                      1, MAX_LATENCY, 3,
+                      G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY);
   properties [PROP_PERIOD] =
     g_param_spec_uint("period", "Period",
                       "Measuring period",
@@ -308,6 +340,42 @@ gst_gpu_analysis_class_init (GstGPUAnalysisClass * klass)
     g_param_spec_float("blocky_duration", "Blocky duration boundary",
                        "Blocky err duration",
                        0., G_MAXFLOAT, 3., G_PARAM_READWRITE);
+  properties [PROP_BATCH_PERIODS] =
+    g_param_spec_uint("batch_periods", "Batch periods",
+                      "Number of periods passed to the data callback at once",
+                      1, MAX_BATCH, 1, G_PARAM_READWRITE);
+  properties [PROP_ATTACH_META] =
+    g_param_spec_boolean("attach_meta", "Attach meta",
+                         "Attach GstGpuAnalysisMeta with the frame measurements to each buffer",
+                         FALSE, G_PARAM_READWRITE);
+  properties [PROP_SHM_NAME] =
+    g_param_spec_string("shm_name", "Shared memory name",
+                        "Publish the frame measurements into /dev/shm/<shm_name> (see metricshm.h), NULL disables the export",
+                        NULL, G_PARAM_READWRITE);
+  properties [PROP_METRICS_SOCKET] =
+    g_param_spec_string("metrics_socket", "Metrics socket",
+                        "Stream the frame measurements as the element-named channel of the process-wide Unix socket server at this path (see metricserver.h), NULL disables it",
+                        NULL, G_PARAM_READWRITE);
+  properties [PROP_COMPACT] =
+    g_param_spec_boolean("compact", "Compact",
+                         "Emit the period data as 16-bit fixed-point columns (MetricColumns) instead of struct data, takes effect from the next period",
+                         FALSE, G_PARAM_READWRITE);
+  properties [PROP_HISTORY_FILE] =
+    g_param_spec_string("history_file", "History file",
+                        "Append the frame measurements to this memory-mapped history file (see metrichistory.h), NULL disables it",
+                        NULL, G_PARAM_READWRITE);
+  properties [PROP_EVENTS_FILE] =
+    g_param_spec_string("events_file", "Events file",
+                        "Append the error spans to this event log with an interval index (see metricevents.h), NULL disables it",
+                        NULL, G_PARAM_READWRITE);
+  properties [PROP_BLOCK_GRID] =
+    g_param_spec_boolean("block_grid", "Block grid",
+                         "Keep the per-block statistics readable with gst_gpu_analysis_peek_blocks, otherwise only the frame totals are read back. Takes effect on the next caps",
+                         FALSE, G_PARAM_READWRITE);
+  properties [PROP_BATCH_STREAMS] =
+    g_param_spec_boolean("batch_streams", "Batch streams",
+                         "Analyse the frames in one dispatch with the other elements on the same GL context that set it (see streambatch.h). Takes effect on the next caps",
+                         FALSE, G_PARAM_READWRITE);
 
   g_object_class_install_properties(gobject_class, LAST_PROP, properties);
 }
@@ -353,15 +421,46 @@ gst_gpu_analysis_init (GstGPUAnalysis *gpu_analysis)
   gpu_analysis->latency = 3;
   gpu_analysis->buffer_ptr = 0;
   gpu_analysis->acc_buffer = NULL;
-  gpu_analysis->shader = NULL;
-  gpu_analysis->shader_block = NULL;
-  gpu_analysis->tex = NULL;
+  gpu_analysis->acc_columns = 0;
+  gpu_analysis->acc_rows = 0;
+  gpu_analysis->program = 0;
+  gpu_analysis->tex = 0;
   gpu_analysis->prev_buffer = NULL;
-  gpu_analysis->prev_tex = NULL;
+  gpu_analysis->prev_tex = 0;
+  gpu_analysis->system_memory = FALSE;
+  gpu_analysis->luma_cache = NULL;
+  gpu_analysis->prev_plane = NULL;
   gpu_analysis->gl_settings_unchecked = TRUE;
+  gpu_analysis->batch_periods = 1;
+  gpu_analysis->attach_meta = FALSE;
+  gpu_analysis->shm_name = NULL;
+  gpu_analysis->shm = NULL;
+  gpu_analysis->metrics_socket = NULL;
+  gpu_analysis->compact = FALSE;
+  gpu_analysis->history_file = NULL;
+  gpu_analysis->history = NULL;
+  gpu_analysis->events_file = NULL;
+  gpu_analysis->events = NULL;
+  gpu_analysis->block_grid = FALSE;
+  gpu_analysis->batch_streams = FALSE;
+  gpu_analysis->stream_batch = NULL;
+  gpu_analysis->program_reduce = 0;
+  gpu_analysis->programs_ready = FALSE;
+  gpu_analysis->programs_stale = FALSE;
+  gpu_analysis->results = g_async_queue_new_full ((GDestroyNotify) _result_free);
+  gpu_analysis->jobs_queued = 0;
+  gpu_analysis->frames_seen = 0;
+  gpu_analysis->results_frame = 0;
+  gpu_analysis->channel = NULL;
+  gpu_analysis->batch_len = 0;
 
   for (int i = 0; i < MAX_LATENCY; i++) {
     gpu_analysis->buffer[i] = 0;
+    gpu_analysis->totals[i] = 0;
+    gpu_analysis->totals_mapped[i] = NULL;
+    gpu_analysis->slot_frame[i] = G_MAXUINT64;
+    gpu_analysis->mapped[i] = NULL;
+    gpu_analysis->fence[i] = NULL;
   }
 
   data_ctx_init (&gpu_analysis->errors);
@@ -375,6 +474,159 @@ gst_gpu_analysis_init (GstGPUAnalysis *gpu_analysis)
   */  
 }
 
+/* result may be NULL */
+static void
+_result_free (struct analysis_result * result)
+{
+  if (result == NULL)
+    return;
+  g_free (result->blocks);
+  g_free (result);
+}
+
+/* Callbacks */
+
+static void
+_batch_release (GstGPUAnalysis * va)
+{
+  for (guint i = 0; i < va->batch_len; i++)
+    {
+      gst_buffer_unmap (va->batch_buffers[i], &va->batch_maps[i]);
+      gst_buffer_unref (va->batch_buffers[i]);
+    }
+  va->batch_len = 0;
+}
+
+struct _GstGPUAnalysisCallbacksRef {
+  gint                    refs;
+  GstGPUAnalysisCallbacks callbacks;
+  gpointer                user_data;
+  GDestroyNotify          notify;
+};
+
+/* The current callbacks for a call, NULL if unset */
+static GstGPUAnalysisCallbacksRef *
+_callbacks_get (GstGPUAnalysis * va)
+{
+  GstGPUAnalysisCallbacksRef * ref;
+
+  GST_OBJECT_LOCK (va);
+  ref = va->callbacks;
+  if (ref)
+    g_atomic_int_inc (&ref->refs);
+  GST_OBJECT_UNLOCK (va);
+  return ref;
+}
+
+/* ref may be NULL, the data goes along with the last ref */
+static void
+_callbacks_unref (GstGPUAnalysisCallbacksRef * ref)
+{
+  if (ref == NULL || !g_atomic_int_dec_and_test (&ref->refs))
+    return;
+  if (ref->notify)
+    ref->notify (ref->user_data);
+  g_free (ref);
+}
+
+static gboolean
+_has_data_callback (GstGPUAnalysis * va)
+{
+  gboolean rval;
+
+  GST_OBJECT_LOCK (va);
+  rval = va->callbacks && va->callbacks->callbacks.data;
+  GST_OBJECT_UNLOCK (va);
+  return rval;
+}
+
+static void
+_batch_flush (GstGPUAnalysis * va)
+{
+  GstGPUAnalysisCallbacksRef * ref;
+
+  if (va->batch_len == 0)
+    return;
+
+  ref = _callbacks_get (va);
+  if (ref && ref->callbacks.data)
+    ref->callbacks.data (va, va->batch, va->batch_len, ref->user_data);
+  _callbacks_unref (ref);
+
+  _batch_release (va);
+}
+
+/* Keeps the period payload mapped until the batch is full */
+static void
+_batch_push (GstGPUAnalysis * va, GstBuffer * data, gboolean compact)
+{
+  guint n = va->batch_len;
+
+  if (!gst_buffer_map (data, &va->batch_maps[n], GST_MAP_READ))
+    return;
+
+  va->batch_buffers[n] = gst_buffer_ref (data);
+  if (compact) {
+    data_ctx_payload_columns (va->batch_maps[n].data,
+                              &va->batch[n].flags,
+                              &va->batch[n].columns);
+    memset (va->batch[n].data, 0, sizeof (va->batch[n].data));
+  } else {
+    data_ctx_payload_layout (va->batch_maps[n].data,
+                             &va->batch[n].flags,
+                             va->batch[n].data);
+    va->batch[n].columns = NULL;
+  }
+  va->batch_len++;
+
+  if (va->batch_len >= va->batch_periods)
+    _batch_flush (va);
+}
+
+void
+gst_gpu_analysis_set_callbacks (GstGPUAnalysis * gpu_analysis,
+                                const GstGPUAnalysisCallbacks * callbacks,
+                                gpointer user_data,
+                                GDestroyNotify notify)
+{
+  GstGPUAnalysisCallbacksRef * ref = NULL;
+  GstGPUAnalysisCallbacksRef * old;
+
+  g_return_if_fail (GST_IS_GPUANALYSIS (gpu_analysis));
+
+  if (callbacks || notify)
+    {
+      ref = g_new0 (GstGPUAnalysisCallbacksRef, 1);
+      ref->refs = 1;
+      if (callbacks)
+        ref->callbacks = *callbacks;
+      ref->user_data = user_data;
+      ref->notify = notify;
+    }
+
+  GST_OBJECT_LOCK (gpu_analysis);
+  old = gpu_analysis->callbacks;
+  gpu_analysis->callbacks = ref;
+  GST_OBJECT_UNLOCK (gpu_analysis);
+
+  /* A call in progress keeps the old data until it returns */
+  _callbacks_unref (old);
+}
+
+const struct accumulator *
+gst_gpu_analysis_peek_blocks (GstGPUAnalysis * gpu_analysis,
+                              guint * columns,
+                              guint * rows)
+{
+  g_return_val_if_fail (GST_IS_GPUANALYSIS (gpu_analysis), NULL);
+
+  if (columns)
+    *columns = gpu_analysis->acc_columns;
+  if (rows)
+    *rows = gpu_analysis->acc_rows;
+  return gpu_analysis->acc_buffer;
+}
+
 static void
 gst_gpu_analysis_dispose (GObject *object)  
 //gst_gpu_analysis_finalize(GObject *object)
@@ -388,14 +640,43 @@ gst_gpu_analysis_dispose (GObject *object)
   data_ctx_delete (&gpu_analysis->errors);
   //printf ("GPU dispose 3\n");
   //gst_object_unref (gpu_analysis->timeout_task);
-  gst_object_unref (gpu_analysis->shader);
-  gst_object_unref (gpu_analysis->shader_block);
+  _batch_release (gpu_analysis);
+  metric_shm_close (gpu_analysis->shm);
+  gpu_analysis->shm = NULL;
+  g_free (gpu_analysis->shm_name);
+  gpu_analysis->shm_name = NULL;
+  metric_channel_unregister (gpu_analysis->channel);
+  gpu_analysis->channel = NULL;
+  metric_history_close (gpu_analysis->history);
+  gpu_analysis->history = NULL;
+  g_free (gpu_analysis->history_file);
+  gpu_analysis->history_file = NULL;
+  metric_events_close (gpu_analysis->events);
+  gpu_analysis->events = NULL;
+  g_free (gpu_analysis->events_file);
+  gpu_analysis->events_file = NULL;
+  g_free (gpu_analysis->metrics_socket);
+  gpu_analysis->metrics_socket = NULL;
+  _callbacks_unref (gpu_analysis->callbacks);
+  gpu_analysis->callbacks = NULL;
   //printf ("GPU dispose 4\n");
   //G_OBJECT_CLASS (parent_class)->finalize(object);
   G_OBJECT_CLASS (parent_class)->dispose(object);
   //printf ("GPU dispose 5\n");
 }
 
+/* dispose may run more than once, what is freed only once goes here */
+static void
+gst_gpu_analysis_finalize (GObject *object)
+{
+  GstGPUAnalysis *gpu_analysis = GST_GPUANALYSIS (object);
+
+  g_async_queue_unref (gpu_analysis->results);
+  g_free (gpu_analysis->acc_buffer);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
 static void
 gst_gpu_analysis_set_property (GObject * object,
                                guint property_id,
@@ -411,16 +692,24 @@ gst_gpu_analysis_set_property (GObject * object,
     gpu_analysis->timeout = g_value_get_uint(value);
     break;
   case PROP_LATENCY:
-    gpu_analysis->latency = g_value_get_uint(value);
+    /* It sizes the job queue and the result ring built on caps */
+    GST_OBJECT_LOCK (gpu_analysis);
+    if (GST_STATE (gpu_analysis) > GST_STATE_READY)
+      GST_WARNING_OBJECT (gpu_analysis, "Latency can only be changed in READY or NULL");
+    else
+      gpu_analysis->latency = g_value_get_uint(value);
+    GST_OBJECT_UNLOCK (gpu_analysis);
     break;
   case PROP_PERIOD:
     gpu_analysis->period = g_value_get_uint(value);
     break;
   case PROP_BLACK_PIXEL_LB:
     gpu_analysis->black_pixel_lb = g_value_get_uint(value);
+    g_atomic_int_set (&gpu_analysis->programs_stale, TRUE);
     break;
   case PROP_PIXEL_DIFF_LB:
     gpu_analysis->pixel_diff_lb = g_value_get_uint(value);
+    g_atomic_int_set (&gpu_analysis->programs_stale, TRUE);
     break;
   case PROP_BLACK_CONT:
     gpu_analysis->params_boundary[BLACK].cont = g_value_get_float(value);
@@ -497,6 +786,37 @@ gst_gpu_analysis_set_property (GObject * object,
   case PROP_BLOCKY_DURATION:
     gpu_analysis->params_boundary[BLOCKY].duration = g_value_get_float(value);
     break;
+  case PROP_BATCH_PERIODS:
+    gpu_analysis->batch_periods = g_value_get_uint(value);
+    break;
+  case PROP_ATTACH_META:
+    gpu_analysis->attach_meta = g_value_get_boolean(value);
+    break;
+  case PROP_SHM_NAME:
+    g_free(gpu_analysis->shm_name);
+    gpu_analysis->shm_name = g_value_dup_string(value);
+    break;
+  case PROP_METRICS_SOCKET:
+    g_free(gpu_analysis->metrics_socket);
+    gpu_analysis->metrics_socket = g_value_dup_string(value);
+    break;
+  case PROP_COMPACT:
+    gpu_analysis->compact = g_value_get_boolean(value);
+    break;
+  case PROP_HISTORY_FILE:
+    g_free(gpu_analysis->history_file);
+    gpu_analysis->history_file = g_value_dup_string(value);
+    break;
+  case PROP_EVENTS_FILE:
+    g_free(gpu_analysis->events_file);
+    gpu_analysis->events_file = g_value_dup_string(value);
+    break;
+  case PROP_BLOCK_GRID:
+    gpu_analysis->block_grid = g_value_get_boolean(value);
+    break;
+  case PROP_BATCH_STREAMS:
+    gpu_analysis->batch_streams = g_value_get_boolean(value);
+    break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     break;
@@ -604,6 +924,33 @@ gst_gpu_analysis_get_property (GObject * object,
   case PROP_BLOCKY_DURATION:
     g_value_set_float(value, gpu_analysis->params_boundary[BLOCKY].duration);
     break;
+  case PROP_BATCH_PERIODS:
+    g_value_set_uint(value, gpu_analysis->batch_periods);
+    break;
+  case PROP_ATTACH_META:
+    g_value_set_boolean(value, gpu_analysis->attach_meta);
+    break;
+  case PROP_SHM_NAME:
+    g_value_set_string(value, gpu_analysis->shm_name);
+    break;
+  case PROP_METRICS_SOCKET:
+    g_value_set_string(value, gpu_analysis->metrics_socket);
+    break;
+  case PROP_COMPACT:
+    g_value_set_boolean(value, gpu_analysis->compact);
+    break;
+  case PROP_HISTORY_FILE:
+    g_value_set_string(value, gpu_analysis->history_file);
+    break;
+  case PROP_EVENTS_FILE:
+    g_value_set_string(value, gpu_analysis->events_file);
+    break;
+  case PROP_BLOCK_GRID:
+    g_value_set_boolean(value, gpu_analysis->block_grid);
+    break;
+  case PROP_BATCH_STREAMS:
+    g_value_set_boolean(value, gpu_analysis->batch_streams);
+    break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     break;
@@ -615,8 +962,55 @@ gst_gpu_analysis_change_state (GstElement * element,
                                GstStateChange transition)
 {
   GstGPUAnalysis *gpu_analysis = GST_GPUANALYSIS (element);
+  GstGLContext *context = NULL;
+  GstStateChangeReturn ret;
 
   switch (transition) {
+  case GST_STATE_CHANGE_READY_TO_PAUSED:
+    if (gpu_analysis->shm_name)
+      {
+        gpu_analysis->shm = metric_shm_create (gpu_analysis->shm_name,
+                                               "gpuanalysis",
+                                               METRIC_SHM_CAPACITY);
+        if (gpu_analysis->shm == NULL)
+          GST_WARNING_OBJECT (gpu_analysis, "Could not create shared memory %s",
+                              gpu_analysis->shm_name);
+      }
+    if (gpu_analysis->metrics_socket)
+      {
+        gpu_analysis->channel =
+          metric_channel_register (gpu_analysis->metrics_socket,
+                                   GST_OBJECT_NAME (gpu_analysis));
+        if (gpu_analysis->channel == NULL)
+          GST_WARNING_OBJECT (gpu_analysis, "Could not serve metrics at %s",
+                              gpu_analysis->metrics_socket);
+      }
+    if (gpu_analysis->history_file)
+      {
+        gpu_analysis->history =
+          metric_history_create (gpu_analysis->history_file,
+                                 GST_OBJECT_NAME (gpu_analysis),
+                                 METRIC_HISTORY_CHUNK_FRAMES);
+        if (gpu_analysis->history == NULL)
+          GST_WARNING_OBJECT (gpu_analysis, "Could not open history file %s,"
+                              " another writer may have it open",
+                              gpu_analysis->history_file);
+      }
+    if (gpu_analysis->events_file)
+      {
+        gpu_analysis->events =
+          metric_events_create (gpu_analysis->events_file,
+                                GST_OBJECT_NAME (gpu_analysis));
+        if (gpu_analysis->events == NULL)
+          GST_WARNING_OBJECT (gpu_analysis, "Could not open event log %s",
+                              gpu_analysis->events_file);
+      }
+    break;
+  case GST_STATE_CHANGE_PAUSED_TO_READY:
+    /* the parent may drop it along with the pads */
+    if (GST_GL_BASE_FILTER (gpu_analysis)->context)
+      context = gst_object_ref (GST_GL_BASE_FILTER (gpu_analysis)->context);
+    break;
     /* Initialize task and clocks */
   case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
     {
@@ -636,9 +1030,12 @@ gst_gpu_analysis_change_state (GstElement * element,
     break;
   case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
     {
-      gpu_analysis->tex = NULL;
-      gst_buffer_replace(&gpu_analysis->prev_buffer, NULL);
-      gpu_analysis->prev_tex = NULL;
+      /* The measurements of the frames in flight are queued,
+         they go out with the next frame or on PAUSED_TO_READY */
+      if (GST_GL_BASE_FILTER (gpu_analysis)->context)
+        gst_gl_context_thread_add (GST_GL_BASE_FILTER (gpu_analysis)->context,
+                                   (GstGLContextThreadFunc) _release_frames,
+                                   gpu_analysis);
       /*
       atomic_store(&gpu_analysis->task_should_run, FALSE);
 
@@ -650,9 +1047,44 @@ gst_gpu_analysis_change_state (GstElement * element,
     break;
   }
 
-  return
-    GST_ELEMENT_CLASS (gst_gpu_analysis_parent_class)->change_state (element,
-                                                                     transition);
+  ret = GST_ELEMENT_CLASS (gst_gpu_analysis_parent_class)->change_state (element,
+                                                                        transition);
+
+  switch (transition) {
+  case GST_STATE_CHANGE_PAUSED_TO_READY:
+    /* The pads are deactivated, no frame is posted any more */
+    if (context)
+      {
+        gst_gl_context_thread_add (context,
+                                   (GstGLContextThreadFunc) _release_frames,
+                                   gpu_analysis);
+        gst_gl_context_thread_add (context,
+                                   (GstGLContextThreadFunc) _gl_release,
+                                   gpu_analysis);
+        gst_object_unref (context);
+      }
+    {
+      gboolean peak [PARAM_NUMBER] = { 0 };
+      gboolean cont [PARAM_NUMBER] = { 0 };
+
+      _result_free (_consume_results (gpu_analysis, peak, cont));
+    }
+    /* The batch belongs to the streaming thread until now */
+    _batch_flush (gpu_analysis);
+    metric_shm_close (gpu_analysis->shm);
+    gpu_analysis->shm = NULL;
+    metric_channel_unregister (gpu_analysis->channel);
+    gpu_analysis->channel = NULL;
+    metric_history_close (gpu_analysis->history);
+    gpu_analysis->history = NULL;
+    metric_events_close (gpu_analysis->events);
+    gpu_analysis->events = NULL;
+    break;
+  default:
+    break;
+  }
+
+  return ret;
 }
 
 static gboolean
@@ -667,67 +1099,303 @@ _find_local_gl_context (GstGLBaseFilter * filter)
   return FALSE;
 }
 
-static void
-shader_create (GstGLContext * context, GstGPUAnalysis * va)
+/* Without GL upstream or downstream, as with system memory, the
+   element runs on the context of its display any other element of
+   the process may share, so are the uploads and the stream batch */
+static gboolean
+_create_gl_context (GstGLBaseFilter * filter)
 {
-  GError * error;
-  if (!(va->shader =
-        gst_gl_shader_new_link_with_stages(context,
-                                           &error,
-                                           gst_glsl_stage_new_with_string (context,
-                                                                           GL_COMPUTE_SHADER,
-                                                                           GST_GLSL_VERSION_450,
-                                                                           GST_GLSL_PROFILE_CORE,
-                                                                           shader_source),
-                                           NULL)))
+  GstGLContext * other_context = NULL;
+  GError * error = NULL;
+
+  if (!gst_gl_ensure_element_data (filter, &filter->display, &other_context))
+    return FALSE;
+
+  GST_OBJECT_LOCK (filter->display);
+  do
     {
-      GST_ELEMENT_ERROR (va, RESOURCE, NOT_FOUND,
-                         ("Failed to initialize shader"), (NULL));
+      if (filter->context)
+        {
+          gst_object_unref (filter->context);
+          filter->context = NULL;
+        }
+      filter->context = gst_gl_display_get_gl_context_for_thread (filter->display, NULL);
+      if (filter->context == NULL
+          && !gst_gl_display_create_context (filter->display, other_context,
+                                             &filter->context, &error))
+        break;
     }
-  if (!(va->shader_block =
-        gst_gl_shader_new_link_with_stages(context,
-                                           &error,
-                                           gst_glsl_stage_new_with_string (context,
-                                                                           GL_COMPUTE_SHADER,
-                                                                           GST_GLSL_VERSION_450,
-                                                                           GST_GLSL_PROFILE_CORE,
-                                                                           shader_source_block),
-                                           NULL)))
+  while (!gst_gl_display_add_context (filter->display, filter->context));
+  GST_OBJECT_UNLOCK (filter->display);
+
+  if (other_context)
+    gst_object_unref (other_context);
+  if (error)
     {
-      GST_ELEMENT_ERROR (va, RESOURCE, NOT_FOUND,
-                         ("Failed to initialize shader block"), (NULL));
+      GST_ELEMENT_ERROR (filter, RESOURCE, NOT_FOUND,
+                         ("Could not create a GL context"), ("%s", error->message));
+      g_clear_error (&error);
+      return FALSE;
     }
+  return TRUE;
+}
 
-  for (int i = 0; i < va->latency; i++)
+static void
+_buffers_release (GstGPUAnalysis * va)
+{
+  for (int i = 0; i < MAX_LATENCY; i++)
     {
+      if (va->fence[i])
+        {
+          glDeleteSync (va->fence[i]);
+          va->fence[i] = NULL;
+        }
+      va->slot_frame[i] = G_MAXUINT64;
       if (va->buffer[i])
         {
-          glDeleteBuffers(1, &va->buffer[i]);
+          glBindBuffer (GL_SHADER_STORAGE_BUFFER, va->buffer[i]);
+          if (va->mapped[i])
+            glUnmapBuffer (GL_SHADER_STORAGE_BUFFER);
+          glDeleteBuffers (1, &va->buffer[i]);
           va->buffer[i] = 0;
         }
+      if (va->totals[i])
+        {
+          glBindBuffer (GL_SHADER_STORAGE_BUFFER, va->totals[i]);
+          glUnmapBuffer (GL_SHADER_STORAGE_BUFFER);
+          glDeleteBuffers (1, &va->totals[i]);
+          va->totals[i] = 0;
+        }
+      va->mapped[i] = NULL;
+      va->totals_mapped[i] = NULL;
+    }
+  glBindBuffer (GL_SHADER_STORAGE_BUFFER, 0);
+  va->buffer_ptr = 0;
+}
+
+/* The ring is immutable storage mapped once for the lifetime of the
+   caps, coherent so that the results are visible as soon as the fence
+   of the frame is signalled without any map or copy per frame.
+   The per-block buffers stay on the GPU unless block_grid is set */
+static void
+_buffers_create (GstGLContext * context, GstGPUAnalysis * va)
+{
+  const GstGLFuncs * gl = context->gl_vtable;
+  GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  GLsizeiptr size = (va->in_info.width / 8)
+    * (va->in_info.height / 8)
+    * sizeof(struct accumulator);
+
+  _buffers_release (va);
+
+  if (G_UNLIKELY (gl->BufferStorage == NULL))
+    {
+      GST_ELEMENT_ERROR (va, RESOURCE, SETTINGS,
+                         ("GL_ARB_buffer_storage is not supported"), (NULL));
+      return;
+    }
+
+  for (int i = 0; i < va->latency; i++)
+    {
       glGenBuffers(1, &va->buffer[i]);
       glBindBuffer(GL_SHADER_STORAGE_BUFFER, va->buffer[i]);
-      glBufferData(GL_SHADER_STORAGE_BUFFER,
-                   (va->in_info.width / 8)
-                   * (va->in_info.height / 8)
-                   * sizeof(struct accumulator),
-                   NULL,
-                   GL_DYNAMIC_COPY);
+      if (va->block_grid)
+        {
+          gl->BufferStorage(GL_SHADER_STORAGE_BUFFER, size, NULL, flags);
+          va->mapped[i] = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, size, flags);
+          if (va->mapped[i] == NULL)
+            GST_ELEMENT_ERROR (va, RESOURCE, NO_SPACE_LEFT,
+                               ("Failed to map the accumulator buffer"), (NULL));
+        }
+      else
+        gl->BufferStorage(GL_SHADER_STORAGE_BUFFER, size, NULL, 0);
+
+      glGenBuffers(1, &va->totals[i]);
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, va->totals[i]);
+      gl->BufferStorage(GL_SHADER_STORAGE_BUFFER, sizeof(struct accumulator), NULL, flags);
+      va->totals_mapped[i] = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0,
+                                              sizeof(struct accumulator), flags);
+      if (va->totals_mapped[i] == NULL)
+        GST_ELEMENT_ERROR (va, RESOURCE, NO_SPACE_LEFT,
+                           ("Failed to map the totals buffer"), (NULL));
+    }
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+static void
+_stream_batch_leave (GstGLContext * context, GstGPUAnalysis * va)
+{
+  if (va->stream_batch)
+    {
+      stream_batch_leave (va->stream_batch, va);
+      va->stream_batch = NULL;
     }
 }
 
+/* The planes held are released before leaving */
+static void
+_luma_cache_leave (GstGLContext * context, GstGPUAnalysis * va)
+{
+  if (va->luma_cache == NULL)
+    return;
+
+  luma_plane_release (va->luma_cache, va->prev_plane);
+  va->prev_plane = NULL;
+  va->prev_tex = 0;
+  luma_cache_leave (va->luma_cache);
+  va->luma_cache = NULL;
+}
+
+/* Drops the programs along with the stream batch using them */
+static void
+_programs_release (GstGLContext * context, GstGPUAnalysis * va)
+{
+  _stream_batch_leave (context, va);
+  g_atomic_int_set (&va->programs_ready, FALSE);
+  program_cache_release (context, va->program);
+  program_cache_release (context, va->program_reduce);
+  va->program = 0;
+  va->program_reduce = 0;
+}
+
+/* Lets the frames be analysed once the programs are linked */
+static void
+_programs_poll (GstGLContext * context, GstGPUAnalysis * va)
+{
+  GError * error = NULL;
+
+  if (va->program == 0 || va->program_reduce == 0)
+    return;
+
+  if (!program_cache_ready (context, va->program, &error)
+      || !program_cache_ready (context, va->program_reduce, &error))
+    {
+      if (error)
+        {
+          GST_ELEMENT_ERROR (va, RESOURCE, NOT_FOUND,
+                             ("Failed to link the analysis programs"),
+                             ("%s", error->message));
+          g_clear_error (&error);
+          _programs_release (context, va);
+        }
+      return;
+    }
+
+  if (va->stream_batch && !stream_batch_ready (va->stream_batch, &error))
+    {
+      if (error == NULL)
+        return;
+      GST_WARNING_OBJECT (va, "Batch programs failed to link, analysing alone: %s",
+                          error->message);
+      g_clear_error (&error);
+      _stream_batch_leave (context, va);
+    }
+
+  g_atomic_int_set (&va->programs_ready, TRUE);
+}
+
+/* Programs built for the caps and the bounds. Those missing from the
+   cache are linked in the background, the frames pass through
+   unanalysed in the meantime */
+static void
+_programs_specialize (GstGLContext * context, GstGPUAnalysis * va)
+{
+  gboolean subgroup = analysis_has_subgroup (context);
+  gchar * prefix = analysis_shader_prefix (subgroup, FALSE);
+  gchar * specialized = analysis_shader_specialize (prefix,
+                                                    va->in_info.width,
+                                                    va->in_info.height,
+                                                    va->black_pixel_lb,
+                                                    va->pixel_diff_lb);
+  GLuint program = va->program;
+  GLuint program_reduce = va->program_reduce;
+
+  GST_INFO_OBJECT (va, "Block statistics are reduced %s",
+                   subgroup ? "with subgroup arithmetic" : "in shared memory");
+
+  g_atomic_int_set (&va->programs_ready, FALSE);
+  /* the old ones are released afterwards, unchanged programs
+     are then taken from the cache as they are */
+  va->program = program_cache_get (context, specialized, shader_source);
+  va->program_reduce = program_cache_get (context, specialized, shader_source_reduce);
+  program_cache_release (context, program);
+  program_cache_release (context, program_reduce);
+  if (va->program == 0 || va->program_reduce == 0)
+    GST_ELEMENT_ERROR (va, RESOURCE, NOT_FOUND,
+                       ("Failed to create the analysis programs"), (NULL));
+  g_free (specialized);
+  g_free (prefix);
+}
+
+/* Everything the element holds on the GL thread, the context
+   may be shared and outlive the element */
+static void
+_gl_release (GstGLContext * context, GstGPUAnalysis * va)
+{
+  _programs_release (context, va);
+  _luma_cache_leave (context, va);
+  _buffers_release (va);
+}
+
+static void
+shader_create (GstGLContext * context, GstGPUAnalysis * va)
+{
+  _stream_batch_leave (context, va);
+  _luma_cache_leave (context, va);
+  if (va->system_memory)
+    va->luma_cache = luma_cache_join (context);
+
+  g_atomic_int_set (&va->programs_stale, FALSE);
+  _programs_specialize (context, va);
+
+  _buffers_create (context, va);
+
+  if (va->batch_streams)
+    {
+      va->stream_batch = stream_batch_join (context, va);
+      if (va->stream_batch == NULL)
+        GST_WARNING_OBJECT (va, "Could not join the stream batch, analysing alone");
+    }
+
+  _programs_poll (context, va);
+}
+
+/* Fresh period storage in the layout selected by compact */
+static void
+_reset_period (GstGPUAnalysis * va)
+{
+  guint32 length = va->period * va->frames_prealloc_per_s;
+
+  if (va->compact)
+    data_ctx_reset_columns (&va->errors, length, va->frame_duration_us);
+  else
+    data_ctx_reset (&va->errors, length);
+}
+
 static gboolean
 gst_gpu_analysis_set_caps (GstBaseTransform * trans,
                            GstCaps * incaps,
                            GstCaps * outcaps)
 {
   GstGPUAnalysis *gpu_analysis = GST_GPUANALYSIS (trans);
+
+  /* The frames in flight are measured with the caps they came with */
+  if (GST_GL_BASE_FILTER (trans)->context)
+    gst_gl_context_thread_add (GST_GL_BASE_FILTER (trans)->context,
+                               (GstGLContextThreadFunc) _drain,
+                               gpu_analysis);
   
   if (!gst_video_info_from_caps (&gpu_analysis->in_info, incaps))
     goto wrong_caps;
   if (!gst_video_info_from_caps (&gpu_analysis->out_info, outcaps))
     goto wrong_caps;
 
+  gpu_analysis->system_memory =
+    !gst_caps_features_contains (gst_caps_get_features (incaps, 0),
+                                 GST_CAPS_FEATURE_MEMORY_GL_MEMORY);
+
+  _batch_flush (gpu_analysis);
+
   gpu_analysis->frame_duration_double =
     (double) gpu_analysis->in_info.fps_d / (double) gpu_analysis->in_info.fps_n;
 
@@ -742,20 +1410,12 @@ gst_gpu_analysis_set_caps (GstBaseTransform * trans,
                            gpu_analysis->in_info.fps_n * 110,
                            gpu_analysis->in_info.fps_d * 100);
   
-  data_ctx_reset (&gpu_analysis->errors,
-                  (gpu_analysis->period
-                   * gpu_analysis->frames_prealloc_per_s));
-  
-  if (gpu_analysis->acc_buffer)
-    free(gpu_analysis->acc_buffer);
-
-  gpu_analysis->acc_buffer =
-    (struct accumulator *) malloc((gpu_analysis->in_info.width / 8)
-                                  * (gpu_analysis->in_info.height / 8)
-                                  * sizeof(struct accumulator));
+  _reset_period (gpu_analysis);
 
   if ( (! GST_GL_BASE_FILTER (trans)->context)
-       && (! _find_local_gl_context(GST_GL_BASE_FILTER(trans))))
+       && (! _find_local_gl_context(GST_GL_BASE_FILTER(trans)))
+       && (! gpu_analysis->system_memory
+           || ! _create_gl_context(GST_GL_BASE_FILTER(trans))))
     {
       GST_WARNING ("Could not find a context");
       return FALSE;
@@ -811,7 +1471,9 @@ _set_flags (struct data_ctx * ctx,
             struct boundary bounds [PARAM_NUMBER],
             struct state * state,
             double frame_duration,
-            double values [PARAM_NUMBER])
+            double values [PARAM_NUMBER],
+            gboolean peak [PARAM_NUMBER],
+            gboolean cont [PARAM_NUMBER])
 {
   for (int p = 0; p < PARAM_NUMBER; p++)
     {
@@ -821,22 +1483,114 @@ _set_flags (struct data_ctx * ctx,
                           param_boundary_is_upper (p),
                           &(state->cont_err_duration[p]),
                           frame_duration,
-                          values[p]);
+                          values[p],
+                          &peak[p],
+                          &cont[p]);
     }
 }
 
 #include <time.h>
 
+G_STATIC_ASSERT (PARAM_NUMBER == METRIC_SHM_PARAMS);
+G_STATIC_ASSERT (PARAM_NUMBER == METRIC_SRV_PARAMS);
+G_STATIC_ASSERT (PARAM_NUMBER == METRIC_HISTORY_PARAMS);
+
+/* out-of-process consumers: shared memory, the socket server,
+   the history file and the event log */
+static void
+_export (GstGPUAnalysis * gpu_analysis,
+         gint64 time,
+         double values [PARAM_NUMBER],
+         gboolean peak [PARAM_NUMBER],
+         gboolean cont [PARAM_NUMBER])
+{
+  gfloat  v [METRIC_SHM_PARAMS];
+  guint32 flags = 0;
+
+  for (int p = 0; p < PARAM_NUMBER; p++)
+    {
+      v[p] = values[p];
+      if (cont[p])
+        flags |= METRIC_SHM_CONT_FLAG (p);
+      if (peak[p])
+        flags |= METRIC_SHM_PEAK_FLAG (p);
+    }
+  if (gpu_analysis->shm)
+    metric_shm_write (gpu_analysis->shm, time, v, flags);
+  if (gpu_analysis->channel)
+    metric_channel_push (gpu_analysis->channel, time, v, flags);
+  if (gpu_analysis->history)
+    metric_history_append (gpu_analysis->history, time, v, flags);
+  if (gpu_analysis->events
+      && !metric_events_track (gpu_analysis->events, time, flags))
+    GST_WARNING_OBJECT (gpu_analysis, "Could not log an error span to %s",
+                        gpu_analysis->events_file);
+}
+
+/* Accounts the queued measurements in the period and the exports,
+   returns the latest one, NULL if none. On the streaming thread or
+   once it is stopped */
+static struct analysis_result *
+_consume_results (GstGPUAnalysis * va,
+                  gboolean peak [PARAM_NUMBER],
+                  gboolean cont [PARAM_NUMBER])
+{
+  struct analysis_result * result;
+  struct analysis_result * latest = NULL;
+
+  while ((result = g_async_queue_try_pop (va->results)))
+    {
+      /* The frames left unanalysed still take their time */
+      guint64 elapsed = result->frame > va->results_frame
+        ? result->frame - va->results_frame : 1;
+
+      va->results_frame = result->frame;
+      va->time_now_us += elapsed * va->frame_duration_us;
+
+      /* errors */
+      _set_flags (&va->errors,
+                  va->params_boundary,
+                  &va->error_state,
+                  elapsed * va->frame_duration_double,
+                  result->values,
+                  peak,
+                  cont);
+
+      if (va->shm || va->channel || va->history || va->events)
+        _export (va, va->time_now_us, result->values, peak, cont);
+
+      for (int p = 0; p < PARAM_NUMBER; p++)
+        data_ctx_add_point (&va->errors,
+                            p,
+                            result->values[p],
+                            va->time_now_us);
+
+      _result_free (latest);
+      latest = result;
+    }
+
+  /* The grid of the latest measurements is kept for peek_blocks */
+  if (latest && latest->blocks)
+    {
+      g_free (va->acc_buffer);
+      va->acc_buffer = latest->blocks;
+      va->acc_columns = latest->columns;
+      va->acc_rows = latest->rows;
+      latest->blocks = NULL;
+    }
+  return latest;
+}
+
 static GstFlowReturn
 gst_gpu_analysis_transform_ip (GstBaseTransform * trans,
                                GstBuffer * buf)
 {
-  GstMemory        *tex;
-  GstVideoFrame    gl_frame;
   GstGPUAnalysis *gpu_analysis = GST_GPUANALYSIS (trans);
-  int              height = gpu_analysis->in_info.height;
-  int              width  = gpu_analysis->in_info.width;
-  double           values [PARAM_NUMBER] = { 0 };
+  struct analysis_result * latest;
+  double           none [PARAM_NUMBER] = { 0 };
+  gboolean         peak [PARAM_NUMBER] = { 0 };
+  gboolean         cont [PARAM_NUMBER] = { 0 };
+  gboolean         analysed;
   clock_t          start, end;
   double           cpu_time_used;
 
@@ -848,44 +1602,25 @@ gst_gpu_analysis_transform_ip (GstBaseTransform * trans,
     gpu_analysis->next_data_message_ts =
       GST_BUFFER_TIMESTAMP (buf) + (GST_SECOND * gpu_analysis->period);
 
-  if (!gst_video_frame_map (&gl_frame,
-                            &gpu_analysis->in_info,
-                            buf,
-                            GST_MAP_READ | GST_MAP_GL))
-    goto inbuf_error;
-
   /* map[0] corresponds to the Y component of Yuv */
-  tex = gl_frame.map[0].memory;
-
-  if (!gst_is_gl_memory (tex))
+  if (!gpu_analysis->system_memory
+      && !gst_is_gl_memory (gst_buffer_peek_memory (buf, 0)))
     {
       GST_ERROR_OBJECT (gpu_analysis, "Input memory must be GstGLMemory");
-      goto unmap_error;
+      return GST_FLOW_ERROR;
     }
 
   start = clock ();
   
   /* Frame is fine, so inform the timeout_loop task */
   atomic_store(&gpu_analysis->got_frame, TRUE);
+  gpu_analysis->frames_seen++;
 
-  /* Evaluate the intermidiate parameters via shader */
-  gpu_analysis_apply (gpu_analysis, GST_GL_MEMORY_CAST (tex));
+  /* Post the frame to the GL thread, the shader results
+     of the frames it has finished are picked up below */
+  analysed = gpu_analysis_apply (gpu_analysis, buf);
 
-  /* Merge intermediate values */
-  for (int i = 0; i < (width * height / 64); i++)
-    {
-      values[FREEZE] += gpu_analysis->acc_buffer[i].frozen;
-      values[BLACK] += gpu_analysis->acc_buffer[i].black;
-      values[DIFF] += gpu_analysis->acc_buffer[i].diff;
-      values[LUMA] += gpu_analysis->acc_buffer[i].bright;
-      values[BLOCKY] += (float)gpu_analysis->acc_buffer[i].visible;
-    }
-  
-  values[FREEZE] = 100.0 * values[FREEZE] / (width * height);
-  values[LUMA] = 255.0 * values[LUMA] / (width * height);
-  values[DIFF] = values[DIFF] / (width * height);
-  values[BLACK] = 100.0 * values[BLACK] / (width * height);
-  values[BLOCKY] = 100.0 * values[BLOCKY] / (width * height / 64);
+  latest = _consume_results (gpu_analysis, peak, cont);
 
   end = clock ();
   cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
@@ -893,6 +1628,7 @@ gst_gpu_analysis_transform_ip (GstBaseTransform * trans,
   GstStructure * s = gst_structure_new_empty ("perf");
   gst_structure_set (s,
                      "time", G_TYPE_DOUBLE, cpu_time_used,
+                     "analysed", G_TYPE_BOOLEAN, analysed,
                      NULL);
   /* Post element message containing the performance data */
   gst_element_post_message (GST_ELEMENT (trans),
@@ -902,20 +1638,15 @@ gst_gpu_analysis_transform_ip (GstBaseTransform * trans,
   //          values[BLOCKY], values[LUMA], values[BLACK], values[DIFF], values[FREEZE]);
   //g_print ("Frame: %d Limit: %d\n", gpu_analysis->frame, gpu_analysis->frame_limit);
 
-  gpu_analysis->time_now_us += gpu_analysis->frame_duration_us;
-
-  /* errors */
-  _set_flags (&gpu_analysis->errors,
-              gpu_analysis->params_boundary,
-              &gpu_analysis->error_state,
-              gpu_analysis->frame_duration_double,
-              values);
-  
-  for (int p = 0; p < PARAM_NUMBER; p++)
-    data_ctx_add_point (&gpu_analysis->errors,
-                        p,
-                        values[p],
-                        gpu_analysis->time_now_us);
+  /* Only the latest measurements go along with the buffer,
+     the unanalysed buffers are flagged even without them */
+  if (gpu_analysis->attach_meta && (latest || !analysed))
+    gst_buffer_add_gpu_analysis_meta (buf,
+                                      latest ? latest->values : none,
+                                      cont, peak,
+                                      latest ? gpu_analysis->frames_seen - latest->frame : 0,
+                                      analysed);
+  _result_free (latest);
 
   /* Send data message if needed */
   if (GST_BUFFER_TIMESTAMP (buf)
@@ -933,98 +1664,161 @@ gst_gpu_analysis_transform_ip (GstBaseTransform * trans,
                                     &gpu_analysis->error_state,
                                     gpu_analysis->time_now_us);
 
+      gboolean compact = (gpu_analysis->errors.columns != NULL);
       gpointer d = data_ctx_pull_out_data (&gpu_analysis->errors, &data_size);
       
-      data_ctx_reset (&gpu_analysis->errors,
-                      (gpu_analysis->period
-                       * gpu_analysis->frames_prealloc_per_s));
+      _reset_period (gpu_analysis);
 
       GstBuffer* data = gst_buffer_new_wrapped (d, data_size);
-      g_signal_emit(gpu_analysis, signals[DATA_SIGNAL], 0, data);
+      /* Avoid the generic marshaller when nobody is connected */
+      if (g_signal_has_handler_pending (gpu_analysis, signals[DATA_SIGNAL], 0, FALSE))
+        g_signal_emit(gpu_analysis, signals[DATA_SIGNAL], 0, data);
+      if (_has_data_callback (gpu_analysis))
+        _batch_push (gpu_analysis, data, compact);
       
       gst_buffer_unref (data);
     }
 
-  gst_video_frame_unmap (&gl_frame);
-        
-  /* Cleanup */
-  gst_buffer_replace (&gpu_analysis->prev_buffer, buf);
-
   return GST_FLOW_OK;
-                
- unmap_error:
-  gst_video_frame_unmap (&gl_frame);
- inbuf_error:
-  return GST_FLOW_ERROR;
 }
 
+/* Analyses va->tex on its own into the buffer_ptr slot */
 static void
-analyse (GstGLContext *context, GstGPUAnalysis * va)
+dispatch (GstGLContext *context, GstGPUAnalysis * va)
 {
   const GstGLFuncs * gl = context->gl_vtable;
   int width = va->in_info.width;
   int height = va->in_info.height;
-  int stride = va->in_info.stride[0];
-  struct accumulator * data = NULL;
-        
-  glGetError();
-
-  if (G_LIKELY(va->prev_tex))
-    {
-      gl->ActiveTexture (GL_TEXTURE1);
-      gl->BindTexture (GL_TEXTURE_2D, gst_gl_memory_get_texture_id (va->prev_tex));
-      glBindImageTexture(1, gst_gl_memory_get_texture_id (va->prev_tex),
-                         0, GL_FALSE, 0, GL_READ_ONLY, GL_R8);
-    }
-
-  gl->ActiveTexture (GL_TEXTURE0);      
-  gl->BindTexture (GL_TEXTURE_2D, gst_gl_memory_get_texture_id (va->tex));
-  glBindImageTexture(0, gst_gl_memory_get_texture_id (va->tex),
-                     0, GL_FALSE, 0, GL_READ_ONLY, GL_R8);
+  /* The first frame is compared with itself */
+  GLuint prev = G_LIKELY(va->prev_tex) ? va->prev_tex : va->tex;
+
+  /* Texture units are fixed by the shader, the frame size and
+     the bounds are compiled into the program */
+  gl->ActiveTexture (GL_TEXTURE1);
+  gl->BindTexture (GL_TEXTURE_2D, prev);
+  gl->ActiveTexture (GL_TEXTURE0);
+  gl->BindTexture (GL_TEXTURE_2D, va->tex);
         
   glBindBufferBase (GL_SHADER_STORAGE_BUFFER, 10, va->buffer[va->buffer_ptr]);
         
-  gst_gl_shader_use (va->shader);
-
-  GLuint prev_ind = va->prev_tex != 0 ? 1 : 0;
-  gst_gl_shader_set_uniform_1i(va->shader, "tex", 0);
-  gst_gl_shader_set_uniform_1i(va->shader, "tex_prev", prev_ind);
-  gst_gl_shader_set_uniform_1i(va->shader, "width", width);
-  gst_gl_shader_set_uniform_1i(va->shader, "height", height);
-  gst_gl_shader_set_uniform_1i(va->shader, "stride", stride);
-  gst_gl_shader_set_uniform_1i(va->shader, "black_bound", va->black_pixel_lb);
-  gst_gl_shader_set_uniform_1i(va->shader, "freez_bound", va->pixel_diff_lb);
+  glUseProgram (va->program);
         
-  glDispatchCompute(width / 8, height / 8, 1);
+  glDispatchCompute((width / 8 + TILE_SIZE - 1) / TILE_SIZE,
+                    (height / 8 + TILE_SIZE - 1) / TILE_SIZE,
+                    1);
 
   glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
-  gst_gl_shader_use (va->shader_block);
+  glBindBufferBase (GL_SHADER_STORAGE_BUFFER, 11, va->totals[va->buffer_ptr]);
 
-  gst_gl_shader_set_uniform_1i(va->shader_block, "tex", 0);
-  gst_gl_shader_set_uniform_1i(va->shader_block, "width", width);
-  gst_gl_shader_set_uniform_1i(va->shader_block, "height", height);
+  glUseProgram (va->program_reduce);
 
-  glDispatchCompute(width / 8, height / 8, 1);
-        
-  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  glDispatchCompute(1, 1, 1);
         
-  /* Get prev results */
+  /* Shader writes must reach the persistent mapping before the fence */
+  glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
 
-  guint prev = MODULUS(((int)va->buffer_ptr - (int)va->latency + 1), (int)va->latency);
-        
-  glBindBufferBase (GL_SHADER_STORAGE_BUFFER, 0, va->buffer[prev]);
-  //glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, va->buffer[prev],
-  //                  0, (width / 8) * (height / 8) * sizeof(struct accumulator));
-  data = glMapBufferRange(GL_SHADER_STORAGE_BUFFER,
-                          0, (width / 8) * (height / 8) * sizeof(struct accumulator),
-                          GL_MAP_READ_BIT);
+  if (va->fence[va->buffer_ptr])
+    glDeleteSync (va->fence[va->buffer_ptr]);
+  va->fence[va->buffer_ptr] = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
 
-  memcpy(va->acc_buffer, data, (width / 8) * (height / 8) * sizeof(struct accumulator));
+/* Moves the measurements of the frame analysed in slot to the results
+   queue, FALSE if wait is not set and the GPU is not done with it yet */
+static gboolean
+_collect (GstGPUAnalysis * va, guint slot, gboolean wait)
+{
+  const struct accumulator * totals = va->totals_mapped[slot];
+  struct analysis_result * result;
+  int width = va->in_info.width;
+  int height = va->in_info.height;
+  GLenum status = GL_WAIT_FAILED;
 
-  /* Cleanup */
-  glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+  if (va->slot_frame[slot] == G_MAXUINT64)
+    return TRUE;
 
+  /* the round of frames it is in may still be incomplete */
+  if (va->stream_batch && va->fence[slot] == NULL)
+    {
+      if (!wait)
+        return FALSE;
+      stream_batch_wait (va->stream_batch, va, slot);
+    }
+
+  if (G_LIKELY (va->fence[slot]))
+    {
+      status = glClientWaitSync (va->fence[slot], GL_SYNC_FLUSH_COMMANDS_BIT,
+                                 wait ? GST_SECOND : 0);
+      if (status == GL_TIMEOUT_EXPIRED && !wait)
+        return FALSE;
+      glDeleteSync (va->fence[slot]);
+      va->fence[slot] = NULL;
+    }
+
+  if (G_UNLIKELY (status != GL_ALREADY_SIGNALED
+                  && status != GL_CONDITION_SATISFIED))
+    {
+      GST_WARNING_OBJECT (va, "Analysis results are lost");
+      va->slot_frame[slot] = G_MAXUINT64;
+      return TRUE;
+    }
+
+  result = g_new0 (struct analysis_result, 1);
+  result->frame = va->slot_frame[slot];
+  result->values[FREEZE] = 100.0 * totals->frozen / (width * height);
+  result->values[BLACK] = 100.0 * totals->black / (width * height);
+  result->values[DIFF] = totals->diff / (width * height);
+  result->values[LUMA] = totals->bright / (width * height);
+  /* the border blocks are never visible */
+  result->values[BLOCKY] = 100.0 * (float)totals->visible
+    / MAX ((width / 8 - 2) * (height / 8 - 2), 1);
+  if (va->mapped[slot])
+    {
+      gsize size;
+
+      result->columns = width / 8;
+      result->rows = height / 8;
+      size = (gsize) result->columns * result->rows * sizeof(struct accumulator);
+      result->blocks = g_malloc (size);
+      memcpy (result->blocks, va->mapped[slot], size);
+    }
+  g_async_queue_push (va->results, result);
+
+  va->slot_frame[slot] = G_MAXUINT64;
+  return TRUE;
+}
+
+/* Waits for all the frames in flight, oldest first */
+static void
+_drain (GstGLContext * context, GstGPUAnalysis * va)
+{
+  for (guint i = 0; i < va->latency; i++)
+    _collect (va, MODULUS((va->buffer_ptr + i), va->latency), TRUE);
+}
+
+static void
+_release_frames (GstGLContext * context, GstGPUAnalysis * va)
+{
+  _drain (context, va);
+  va->tex = 0;
+  gst_buffer_replace (&va->prev_buffer, NULL);
+  if (va->luma_cache)
+    luma_plane_release (va->luma_cache, va->prev_plane);
+  va->prev_plane = NULL;
+  va->prev_tex = 0;
+}
+
+static void
+analyse (GstGLContext *context, GstGPUAnalysis * va)
+{
+  glGetError();
+
+  if (va->stream_batch)
+    stream_batch_submit (va->stream_batch, va);
+  else
+    dispatch (context, va);
+
+  /* Cleanup */
   glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
   glBindTexture(GL_TEXTURE_2D, 0);
 
@@ -1051,39 +1845,158 @@ _check_defaults_ (GstGLContext *context, GstGPUAnalysis * va) {
     }
 }
 
-static gboolean
-gpu_analysis_apply (GstGPUAnalysis * va, GstGLMemory * tex)
+typedef struct {
+  GstGPUAnalysis * va;
+  GstBuffer      * buf;
+  guint64          frame;
+  /* FALSE if the programs were not linked when the frame was posted */
+  gboolean         analyse;
+  /* the bounds have changed since the programs were built */
+  gboolean         specialize;
+} AnalysisJob;
+
+static void
+_job_free (AnalysisJob * job)
 {
-  GstGLContext *context = GST_GL_BASE_FILTER (va)->context;
+  gst_buffer_unref (job->buf);
+  gst_object_unref (job->va);
+  g_free (job);
+}
 
-  if (G_UNLIKELY(va->shader == NULL))
+/* Runs on the GL thread in the order the frames were posted */
+static void
+_job_run (AnalysisJob * job)
+{
+  GstGPUAnalysis * va = job->va;
+  GstGLContext * context = GST_GL_BASE_FILTER (va)->context;
+  GstVideoFrame frame;
+  LumaPlane * plane = NULL;
+  GLuint tex;
+  guint slot = va->buffer_ptr;
+
+  g_atomic_int_add (&va->jobs_queued, -1);
+
+  if (job->specialize)
+    _programs_specialize (context, va);
+
+  if (!job->analyse || !g_atomic_int_get (&va->programs_ready))
     {
-      GST_WARNING("GL shader is not ready for analysis");
-      return TRUE;
+      _programs_poll (context, va);
+      return;
     }
 
-  /* Ensure that GL platform defaults meet the expectations */
-  if (G_UNLIKELY(va->gl_settings_unchecked))
+  if (va->luma_cache)
     {
-      gst_gl_context_thread_add(context, (GstGLContextThreadFunc) _check_defaults_, va);
+      /* Only the Y plane is uploaded, once for all the
+         elements analysing the same buffer */
+      if (!gst_video_frame_map (&frame, &va->in_info, job->buf, GST_MAP_READ))
+        {
+          GST_WARNING_OBJECT (va, "Could not map the frame, it is not analysed");
+          return;
+        }
+      plane = luma_cache_upload (va->luma_cache, &frame);
+      gst_video_frame_unmap (&frame);
+      if (plane == NULL)
+        {
+          GST_WARNING_OBJECT (va, "Could not upload the frame, it is not analysed");
+          return;
+        }
+      tex = luma_plane_texture (plane);
     }
-  /* Check texture format */
-  if (G_UNLIKELY(gst_gl_memory_get_texture_format(tex) != GST_GL_RED))
+  else
     {
-      GST_ERROR("GL texture format should be GL_RED");
-      exit(-1);
+      GstMemory * mem;
+
+      /* Ensure that GL platform defaults meet the expectations */
+      if (G_UNLIKELY(va->gl_settings_unchecked))
+        _check_defaults_ (context, va);
+
+      if (!gst_video_frame_map (&frame, &va->in_info, job->buf,
+                                GST_MAP_READ | GST_MAP_GL))
+        {
+          GST_WARNING_OBJECT (va, "Could not map the frame, it is not analysed");
+          return;
+        }
+
+      /* map[0] corresponds to the Y component of Yuv */
+      mem = frame.map[0].memory;
+
+      /* Check texture format */
+      if (G_UNLIKELY(gst_gl_memory_get_texture_format(GST_GL_MEMORY_CAST (mem)) != GST_GL_RED))
+        {
+          GST_ERROR("GL texture format should be GL_RED");
+          exit(-1);
+        }
+      tex = gst_gl_memory_get_texture_id (GST_GL_MEMORY_CAST (mem));
     }
 
+  /* The frame analysed latency frames ago is the only one
+     that has to be waited for, its slot is reused */
+  _collect (va, slot, TRUE);
+
   va->tex = tex;
+  va->slot_frame[slot] = job->frame;
+  analyse (context, va);
 
-  /* Compile shader */
-  //if (G_UNLIKELY (!va->shader) )
-  //        gst_gl_context_thread_add(context, (GstGLContextThreadFunc) shader_create, va);
+  /* The previous frame is kept for the next comparison */
+  if (plane)
+    {
+      luma_plane_release (va->luma_cache, va->prev_plane);
+      va->prev_plane = plane;
+    }
+  else
+    {
+      gst_video_frame_unmap (&frame);
+      gst_buffer_replace (&va->prev_buffer, job->buf);
+    }
 
-  /* Analyze */
-  gst_gl_context_thread_add(context, (GstGLContextThreadFunc) analyse, va);
+  /* Whatever else the GPU is done with, without breaking the order */
+  for (guint i = 0; i < va->latency; i++)
+    if (!_collect (va, MODULUS((va->buffer_ptr + i), va->latency), FALSE))
+      break;
+}
 
-  return TRUE;
+static gboolean
+gpu_analysis_apply (GstGPUAnalysis * va, GstBuffer * buf)
+{
+  GstGLContext *context = GST_GL_BASE_FILTER (va)->context;
+  GstGLWindow *window;
+  AnalysisJob *job;
+
+  /* The streaming thread never waits for the GL one, the frames it
+     has no room for are not analysed. Returns whether it is analysed */
+  if (g_atomic_int_get (&va->jobs_queued) >= (gint) va->latency)
+    {
+      GST_DEBUG_OBJECT (va, "GL thread is %u frames behind, frame is skipped",
+                        va->latency);
+      return FALSE;
+    }
+
+  window = gst_gl_context_get_window (context);
+  if (G_UNLIKELY (window == NULL))
+    {
+      GST_WARNING_OBJECT (va, "GL context has no window to post the frame to");
+      return FALSE;
+    }
+
+  job = g_new (AnalysisJob, 1);
+  job->va = gst_object_ref (va);
+  job->buf = gst_buffer_ref (buf);
+  job->frame = va->frames_seen;
+  job->specialize = g_atomic_int_compare_and_exchange (&va->programs_stale, TRUE, FALSE);
+  if (job->specialize)
+    g_atomic_int_set (&va->programs_ready, FALSE);
+  job->analyse = g_atomic_int_get (&va->programs_ready);
+
+  g_atomic_int_inc (&va->jobs_queued);
+  gst_gl_window_send_message_async (window,
+                                    (GstGLWindowCB) _job_run, job,
+                                    (GDestroyNotify) _job_free);
+  gst_object_unref (window);
+
+  if (!job->analyse)
+    GST_LOG_OBJECT (va, "Programs are being linked, frame is not analysed");
+  return job->analyse;
 }
 
 /*
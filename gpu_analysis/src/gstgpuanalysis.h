@@ -11,8 +11,14 @@
 #include <stdatomic.h>
 
 #include "error.h"
+#include "gstgpuanalysismeta.h"
+#include "metricshm.h"
+#include "metricserver.h"
+#include "metrichistory.h"
+#include "metricevents.h"
 
 #define MAX_LATENCY 24
+#define MAX_BATCH 32
 
 G_BEGIN_DECLS
 
@@ -33,6 +39,47 @@ GType gst_gpu_analysis_get_type (void);
 typedef struct _GstGPUAnalysis GstGPUAnalysis;
 typedef struct _GstGPUAnalysisClass GstGPUAnalysisClass;
 
+/* One period of measurements as it is passed to the callbacks */
+typedef struct {
+  const struct flags * flags; /* [PARAM_NUMBER] */
+  /* data is NULL and columns is set with the compact property */
+  const struct data  * data [PARAM_NUMBER];
+  const MetricColumns * columns;
+} GstGPUAnalysisPeriod;
+
+typedef struct {
+  /* Called on the streaming thread with batch_periods periods,
+     the data is only valid for the duration of the call */
+  void (*data) (GstGPUAnalysis * filter,
+                const GstGPUAnalysisPeriod * periods,
+                guint n_periods,
+                gpointer user_data);
+} GstGPUAnalysisCallbacks;
+
+/* The callbacks along with their data, held by the calls in progress */
+typedef struct _GstGPUAnalysisCallbacksRef GstGPUAnalysisCallbacksRef;
+
+/* Statistics of an 8x8 block as they are laid out by the shaders */
+struct accumulator {
+  GLfloat frozen;
+  GLfloat black;
+  GLfloat bright;
+  GLfloat diff;
+  GLfloat noize;
+  GLint   visible;
+};
+
+/* Measurements of a frame, handed over by the GL thread. With
+   block_grid the block statistics are copied out of the slot, which
+   the GL thread reuses regardless of the results still queued */
+struct analysis_result {
+  guint64              frame;
+  double               values [PARAM_NUMBER];
+  struct accumulator * blocks;
+  guint                columns;
+  guint                rows;
+};
+
 struct state {
   gfloat        cont_err_duration [PARAM_NUMBER];
   gint64        cont_err_past_timestamp [PARAM_NUMBER];
@@ -52,15 +99,42 @@ struct _GstGPUAnalysis
   /* GL-related stuff */
   guint              buffer_ptr;
   GLuint             buffer [MAX_LATENCY];
+  /* Frame totals summed by program_reduce */
+  GLuint             totals [MAX_LATENCY];
+  /* Persistently mapped contents of totals and, with block_grid,
+     of buffer; fence is set once the frame written there is analysed */
+  struct accumulator * totals_mapped [MAX_LATENCY];
+  struct accumulator * mapped [MAX_LATENCY];
+  GLsync             fence [MAX_LATENCY];
+  /* Number of the frame analysed in the slot, G_MAXUINT64 if none */
+  guint64            slot_frame [MAX_LATENCY];
   gboolean           gl_settings_unchecked;
 
-  GstGLShader      * shader;
-  GstGLShader      * shader_block;
+  /* Frames are posted to the GL thread without waiting for it,
+     results come back through the queue in the order of frames */
+  GAsyncQueue      * results;
+  gint               jobs_queued;
+  guint64            frames_seen;
+  /* Number of the frame the latest consumed result comes from,
+     the frames in between were skipped or their results lost */
+  guint64            results_frame;
+
+  /* From the program cache, built for the caps and the bounds.
+     The frames are only analysed once programs_ready is set by the
+     GL thread, programs_stale is set once the bounds change */
+  GLuint             program;
+  GLuint             program_reduce;
+  gint               programs_ready;
+  gint               programs_stale;
   //GstGLShader *      shader_accum;
-  /* Textures */
-  GstGLMemory      * tex;
+  /* Textures, owned by the GL thread. The previous one is kept
+     by prev_buffer with GL memory and by prev_plane otherwise */
+  GLuint             tex;
   GstBuffer        * prev_buffer;
-  GstGLMemory      * prev_tex;
+  GLuint             prev_tex;
+  gboolean           system_memory;
+  struct _LumaCache *luma_cache;
+  struct _LumaPlane *prev_plane;
 
   /* VideoInfo */
   GstVideoInfo       in_info;
@@ -78,8 +152,20 @@ struct _GstGPUAnalysis
   float       fps_period;
   guint       frames_in_sec;
 
-  /* Interm values */
-  struct accumulator *acc_buffer;
+  /* Block statistics of the latest measurements, taken over from
+     the result by the streaming thread, NULL until the first one.
+     Only kept with block_grid */
+  struct accumulator * acc_buffer;
+  guint                acc_columns;
+  guint                acc_rows;
+
+  /* Callbacks, replaced under the object lock, NULL if unset */
+  GstGPUAnalysisCallbacksRef * callbacks;
+  /* Periods waiting for the callback */
+  guint                batch_len;
+  GstGPUAnalysisPeriod batch [MAX_BATCH];
+  GstBuffer          * batch_buffers [MAX_BATCH];
+  GstMapInfo           batch_maps [MAX_BATCH];
         
   /* Parameters */
   guint              latency;
@@ -88,6 +174,20 @@ struct _GstGPUAnalysis
   guint              black_pixel_lb;
   guint              pixel_diff_lb;
   struct boundary    params_boundary [PARAM_NUMBER];
+  guint              batch_periods;
+  gboolean           attach_meta;
+  gchar             *shm_name;
+  MetricShm         *shm;
+  gchar             *metrics_socket;
+  MetricChannel     *channel;
+  gboolean           compact;
+  gchar             *history_file;
+  MetricHistory     *history;
+  gchar             *events_file;
+  MetricEvents      *events;
+  gboolean           block_grid;
+  gboolean           batch_streams;
+  struct _StreamBatch *stream_batch;
 };
 
 struct _GstGPUAnalysisClass
@@ -99,6 +199,22 @@ struct _GstGPUAnalysisClass
   void (*stream_found_signal) (GstVideoFilter *filter);
 };
 
+/* Typed alternative to the data signal, NULL callbacks unset them.
+   notify is called once the callbacks in progress have returned,
+   then possibly on the streaming thread */
+void gst_gpu_analysis_set_callbacks (GstGPUAnalysis * filter,
+                                     const GstGPUAnalysisCallbacks * callbacks,
+                                     gpointer user_data,
+                                     GDestroyNotify notify);
+
+/* Per-block statistics of the frame the latest measurements come from,
+   columns x rows blocks of 8x8 pixels row by row. NULL unless block_grid
+   is set. Called on the streaming thread, e.g. from the callbacks or a
+   pad probe, the grid is valid until the next buffer is transformed */
+const struct accumulator * gst_gpu_analysis_peek_blocks (GstGPUAnalysis * filter,
+                                                         guint * columns,
+                                                         guint * rows);
+
 static inline void
 update_all_timestamps(struct state * state, gint64 ts)
 {
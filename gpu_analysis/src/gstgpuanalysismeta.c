@@ -0,0 +1,96 @@
+#include "gstgpuanalysismeta.h"
+#include <string.h>
+
+GType
+gst_gpu_analysis_meta_api_get_type (void)
+{
+  static gsize type = 0;
+  static const gchar *tags[] = { NULL };
+
+  if (g_once_init_enter (&type))
+    {
+      GType _type = gst_meta_api_type_register ("GstGpuAnalysisMetaAPI", tags);
+      g_once_init_leave (&type, _type);
+    }
+  return type;
+}
+
+static gboolean
+gst_gpu_analysis_meta_init (GstMeta * meta,
+                            gpointer params,
+                            GstBuffer * buffer)
+{
+  GstGpuAnalysisMeta * ameta = (GstGpuAnalysisMeta *) meta;
+
+  memset (ameta->values, 0, sizeof (ameta->values));
+  memset (ameta->cont, 0, sizeof (ameta->cont));
+  memset (ameta->peak, 0, sizeof (ameta->peak));
+  ameta->delay = 0;
+  ameta->analysed = TRUE;
+  return TRUE;
+}
+
+static gboolean
+gst_gpu_analysis_meta_transform (GstBuffer * dest,
+                                 GstMeta * meta,
+                                 GstBuffer * buffer,
+                                 GQuark type,
+                                 gpointer data)
+{
+  GstGpuAnalysisMeta * ameta = (GstGpuAnalysisMeta *) meta;
+
+  /* Measurements describe the whole picture, so only
+     plain copies keep them */
+  if (! GST_META_TRANSFORM_IS_COPY (type))
+    return FALSE;
+
+  return gst_buffer_add_gpu_analysis_meta (dest,
+                                           ameta->values,
+                                           ameta->cont,
+                                           ameta->peak,
+                                           ameta->delay,
+                                           ameta->analysed) != NULL;
+}
+
+const GstMetaInfo *
+gst_gpu_analysis_meta_get_info (void)
+{
+  static const GstMetaInfo * meta_info = NULL;
+
+  if (g_once_init_enter ((GstMetaInfo **) &meta_info))
+    {
+      const GstMetaInfo * mi =
+        gst_meta_register (GST_GPU_ANALYSIS_META_API_TYPE,
+                           "GstGpuAnalysisMeta",
+                           sizeof (GstGpuAnalysisMeta),
+                           gst_gpu_analysis_meta_init,
+                           NULL,
+                           gst_gpu_analysis_meta_transform);
+      g_once_init_leave ((GstMetaInfo **) &meta_info, (GstMetaInfo *) mi);
+    }
+  return meta_info;
+}
+
+GstGpuAnalysisMeta *
+gst_buffer_add_gpu_analysis_meta (GstBuffer * buffer,
+                                  const gdouble values [PARAM_NUMBER],
+                                  const gboolean cont [PARAM_NUMBER],
+                                  const gboolean peak [PARAM_NUMBER],
+                                  guint delay,
+                                  gboolean analysed)
+{
+  GstGpuAnalysisMeta * meta;
+
+  g_return_val_if_fail (GST_IS_BUFFER (buffer), NULL);
+
+  meta = (GstGpuAnalysisMeta *) gst_buffer_add_meta (buffer, GST_GPU_ANALYSIS_META_INFO, NULL);
+  if (meta == NULL)
+    return NULL;
+
+  memcpy (meta->values, values, sizeof (meta->values));
+  memcpy (meta->cont, cont, sizeof (meta->cont));
+  memcpy (meta->peak, peak, sizeof (meta->peak));
+  meta->delay = delay;
+  meta->analysed = analysed;
+  return meta;
+}
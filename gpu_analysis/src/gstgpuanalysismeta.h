@@ -0,0 +1,45 @@
+/*
+ * TODO copyright
+ */
+
+#ifndef _GSTGPUANALYSISMETA_
+#define _GSTGPUANALYSISMETA_
+
+#include <gst/gst.h>
+
+#include "error.h"
+
+G_BEGIN_DECLS
+
+#define GST_GPU_ANALYSIS_META_API_TYPE (gst_gpu_analysis_meta_api_get_type())
+#define GST_GPU_ANALYSIS_META_INFO     (gst_gpu_analysis_meta_get_info())
+
+/* Measurements lag behind the buffer by delay frames, they are
+   of the latest frame the GPU was done with when it passed */
+typedef struct {
+  GstMeta  meta;
+  gdouble  values [PARAM_NUMBER];
+  gboolean cont [PARAM_NUMBER];
+  gboolean peak [PARAM_NUMBER];
+  guint    delay;
+  /* FALSE if the buffer itself was not analysed, its
+     measurements never arrive */
+  gboolean analysed;
+} GstGpuAnalysisMeta;
+
+GType               gst_gpu_analysis_meta_api_get_type (void);
+const GstMetaInfo * gst_gpu_analysis_meta_get_info (void);
+
+#define gst_buffer_get_gpu_analysis_meta(b)                             \
+  ((GstGpuAnalysisMeta*)gst_buffer_get_meta((b),GST_GPU_ANALYSIS_META_API_TYPE))
+
+GstGpuAnalysisMeta * gst_buffer_add_gpu_analysis_meta (GstBuffer * buffer,
+                                                       const gdouble values [PARAM_NUMBER],
+                                                       const gboolean cont [PARAM_NUMBER],
+                                                       const gboolean peak [PARAM_NUMBER],
+                                                       guint delay,
+                                                       gboolean analysed);
+
+G_END_DECLS
+
+#endif /* _GSTGPUANALYSISMETA_ */
@@ -0,0 +1,352 @@
+/*
+ * TODO copyright
+ */
+
+#include <gst/gl/gstglfuncs.h>
+#include <GL/gl.h>
+#include <GLES3/gl31.h>
+#include <string.h>
+
+#include "lumacache.h"
+
+#define GST_CAT_DEFAULT luma_cache_debug
+GST_DEBUG_CATEGORY_STATIC (luma_cache_debug);
+
+/* uploads in flight before the first one has to be waited for */
+#define PBO_RING 3
+
+struct _LumaPlane {
+  /* the memory holding the Y plane and where the plane starts in
+     it, as the branches of a tee may each get a copy of the buffer
+     sharing the memory. The memory is held as long as the plane may
+     match, so its address is never taken by another allocation, and
+     the timestamp tells apart the frames a pool writes into it */
+  GstMemory *       memory;
+  gsize             memory_offset;
+  GstClockTime      pts;
+  gint              stride;
+  gint              width;
+  gint              height;
+  GLuint            texture;
+  guint             refs;
+  /* upload number, the oldest free plane is reused first */
+  guint64           stamp;
+};
+
+struct _LumaCache {
+  GstGLContext * context;
+  guint          users;
+  /* LumaPlane */
+  GPtrArray *    planes;
+  guint64        uploads;
+  /* persistently mapped, each one is reused once the
+     upload made from it PBO_RING frames ago is done */
+  GLuint         pbo [PBO_RING];
+  guint8 *       pbo_mapped [PBO_RING];
+  GLsync         pbo_fence [PBO_RING];
+  gsize          pbo_size;
+  guint          pbo_next;
+};
+
+/* GstGLContext -> LumaCache */
+static GHashTable * caches = NULL;
+static GMutex       caches_lock;
+
+static void
+_pbos_release (LumaCache * cache)
+{
+  for (int i = 0; i < PBO_RING; i++)
+    {
+      if (cache->pbo_fence[i])
+        {
+          glDeleteSync (cache->pbo_fence[i]);
+          cache->pbo_fence[i] = NULL;
+        }
+      if (cache->pbo[i])
+        {
+          glBindBuffer (GL_PIXEL_UNPACK_BUFFER, cache->pbo[i]);
+          glUnmapBuffer (GL_PIXEL_UNPACK_BUFFER);
+          glDeleteBuffers (1, &cache->pbo[i]);
+          cache->pbo[i] = 0;
+        }
+      cache->pbo_mapped[i] = NULL;
+    }
+  glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+  cache->pbo_size = 0;
+  cache->pbo_next = 0;
+}
+
+/* FALSE without GL_ARB_buffer_storage, the planes
+   are then uploaded from the frames themselves */
+static gboolean
+_pbos_create (LumaCache * cache, gsize size)
+{
+  const GstGLFuncs * gl = cache->context->gl_vtable;
+  GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+  _pbos_release (cache);
+
+  if (gl->BufferStorage == NULL)
+    return FALSE;
+
+  for (int i = 0; i < PBO_RING; i++)
+    {
+      glGenBuffers (1, &cache->pbo[i]);
+      glBindBuffer (GL_PIXEL_UNPACK_BUFFER, cache->pbo[i]);
+      gl->BufferStorage (GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+      cache->pbo_mapped[i] = glMapBufferRange (GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+      if (cache->pbo_mapped[i] == NULL)
+        {
+          GST_WARNING ("Could not map the upload buffers");
+          _pbos_release (cache);
+          return FALSE;
+        }
+    }
+  glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+  cache->pbo_size = size;
+  return TRUE;
+}
+
+/* The plane is never matched again */
+static void
+_plane_forget (LumaPlane * plane)
+{
+  if (plane->memory)
+    gst_memory_unref (plane->memory);
+  plane->memory = NULL;
+}
+
+static void
+_plane_free (LumaPlane * plane)
+{
+  _plane_forget (plane);
+  if (plane->texture)
+    glDeleteTextures (1, &plane->texture);
+  g_free (plane);
+}
+
+/* The memory the Y plane of frame starts in, NULL if it can not be
+   told apart from the other frames */
+static GstMemory *
+_frame_memory (GstVideoFrame * frame, gsize * memory_offset)
+{
+  GstBuffer * buffer = frame->buffer;
+  guint       idx, length;
+  gsize       skip;
+
+  if (!GST_BUFFER_PTS_IS_VALID (buffer)
+      || !gst_buffer_find_memory (buffer, GST_VIDEO_FRAME_PLANE_OFFSET (frame, 0),
+                                  1, &idx, &length, &skip))
+    return NULL;
+
+  *memory_offset = skip;
+  return gst_buffer_peek_memory (buffer, idx);
+}
+
+static LumaPlane *
+_plane_lookup (LumaCache * cache, GstVideoFrame * frame)
+{
+  gsize       memory_offset;
+  GstMemory * memory = _frame_memory (frame, &memory_offset);
+
+  if (memory == NULL)
+    return NULL;
+
+  for (guint i = 0; i < cache->planes->len; i++)
+    {
+      LumaPlane * plane = g_ptr_array_index (cache->planes, i);
+
+      if (plane->memory == memory
+          && plane->memory_offset == memory_offset
+          && plane->pts == GST_BUFFER_PTS (frame->buffer)
+          && plane->stride == GST_VIDEO_FRAME_PLANE_STRIDE (frame, 0)
+          && plane->width == GST_VIDEO_FRAME_COMP_WIDTH (frame, 0)
+          && plane->height == GST_VIDEO_FRAME_COMP_HEIGHT (frame, 0))
+        return plane;
+    }
+  return NULL;
+}
+
+/* The oldest plane no element holds, a new one if all are held */
+static LumaPlane *
+_plane_free_one (LumaCache * cache)
+{
+  LumaPlane * oldest = NULL;
+
+  for (guint i = 0; i < cache->planes->len; i++)
+    {
+      LumaPlane * plane = g_ptr_array_index (cache->planes, i);
+
+      if (plane->refs == 0 && (oldest == NULL || plane->stamp < oldest->stamp))
+        oldest = plane;
+    }
+
+  if (oldest == NULL)
+    {
+      oldest = g_new0 (LumaPlane, 1);
+      g_ptr_array_add (cache->planes, oldest);
+    }
+  return oldest;
+}
+
+/* The texture is only replaced on a size change, the dispatches
+   still reading it are ordered before the upload by the context */
+static gboolean
+_plane_upload (LumaCache * cache, LumaPlane * plane, GstVideoFrame * frame)
+{
+  gint          width = GST_VIDEO_FRAME_COMP_WIDTH (frame, 0);
+  gint          height = GST_VIDEO_FRAME_COMP_HEIGHT (frame, 0);
+  gint          stride = GST_VIDEO_FRAME_PLANE_STRIDE (frame, 0);
+  const guint8 *data = GST_VIDEO_FRAME_PLANE_DATA (frame, 0);
+  /* the rows are copied along with their padding in one go */
+  gsize         size = (gsize) stride * (height - 1) + width;
+  gconstpointer pixels = data;
+  guint         n = cache->pbo_next;
+
+  /* the errors of the analysis are not those of the upload */
+  glGetError ();
+
+  if (plane->texture == 0 || plane->width != width || plane->height != height)
+    {
+      if (plane->texture)
+        glDeleteTextures (1, &plane->texture);
+      glGenTextures (1, &plane->texture);
+      glBindTexture (GL_TEXTURE_2D, plane->texture);
+      glTexStorage2D (GL_TEXTURE_2D, 1, GL_R8, width, height);
+      glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      plane->width = width;
+      plane->height = height;
+    }
+
+  if (size > cache->pbo_size)
+    _pbos_create (cache, size);
+
+  if (cache->pbo_size)
+    {
+      if (cache->pbo_fence[n])
+        {
+          if (glClientWaitSync (cache->pbo_fence[n], GL_SYNC_FLUSH_COMMANDS_BIT,
+                                GST_SECOND) == GL_TIMEOUT_EXPIRED)
+            GST_WARNING ("Upload buffer is still in use after a second");
+          glDeleteSync (cache->pbo_fence[n]);
+          cache->pbo_fence[n] = NULL;
+        }
+      memcpy (cache->pbo_mapped[n], data, size);
+      glBindBuffer (GL_PIXEL_UNPACK_BUFFER, cache->pbo[n]);
+      /* an offset into the bound buffer */
+      pixels = NULL;
+    }
+
+  glBindTexture (GL_TEXTURE_2D, plane->texture);
+  glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+  glPixelStorei (GL_UNPACK_ROW_LENGTH, stride);
+  glTexSubImage2D (GL_TEXTURE_2D, 0, 0, 0, width, height,
+                   GL_RED, GL_UNSIGNED_BYTE, pixels);
+  glPixelStorei (GL_UNPACK_ROW_LENGTH, 0);
+  glPixelStorei (GL_UNPACK_ALIGNMENT, 4);
+  glBindTexture (GL_TEXTURE_2D, 0);
+
+  if (cache->pbo_size)
+    {
+      glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+      cache->pbo_fence[n] = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      cache->pbo_next = (n + 1) % PBO_RING;
+    }
+
+  if (glGetError () != GL_NO_ERROR)
+    return FALSE;
+
+  plane->memory = _frame_memory (frame, &plane->memory_offset);
+  if (plane->memory)
+    gst_memory_ref (plane->memory);
+  plane->pts = GST_BUFFER_PTS (frame->buffer);
+  plane->stride = stride;
+  plane->stamp = ++cache->uploads;
+  return TRUE;
+}
+
+LumaCache *
+luma_cache_join (GstGLContext * context)
+{
+  LumaCache * cache;
+
+  g_mutex_lock (&caches_lock);
+  if (caches == NULL)
+    {
+      GST_DEBUG_CATEGORY_INIT (luma_cache_debug, "gpuanalysisupload", 0,
+                               "gpuanalysis luma upload");
+      caches = g_hash_table_new (NULL, NULL);
+    }
+  cache = g_hash_table_lookup (caches, context);
+  if (cache == NULL)
+    {
+      cache = g_new0 (LumaCache, 1);
+      cache->context = context;
+      cache->planes = g_ptr_array_new_with_free_func ((GDestroyNotify) _plane_free);
+      g_hash_table_insert (caches, context, cache);
+    }
+  cache->users++;
+  g_mutex_unlock (&caches_lock);
+
+  return cache;
+}
+
+void
+luma_cache_leave (LumaCache * cache)
+{
+  g_mutex_lock (&caches_lock);
+  if (--cache->users > 0)
+    {
+      g_mutex_unlock (&caches_lock);
+      return;
+    }
+  g_hash_table_remove (caches, cache->context);
+  g_mutex_unlock (&caches_lock);
+
+  _pbos_release (cache);
+  g_ptr_array_free (cache->planes, TRUE);
+  g_free (cache);
+}
+
+LumaPlane *
+luma_cache_upload (LumaCache * cache, GstVideoFrame * frame)
+{
+  LumaPlane * plane = _plane_lookup (cache, frame);
+
+  if (plane)
+    {
+      GST_LOG ("Plane of %" GST_TIME_FORMAT " is already uploaded",
+               GST_TIME_ARGS (plane->pts));
+      plane->refs++;
+      return plane;
+    }
+
+  plane = _plane_free_one (cache);
+  /* a half written plane is never matched */
+  _plane_forget (plane);
+  if (!_plane_upload (cache, plane, frame))
+    {
+      GST_WARNING ("Could not upload the luma plane");
+      return NULL;
+    }
+
+  plane->refs = 1;
+  return plane;
+}
+
+GLuint
+luma_plane_texture (LumaPlane * plane)
+{
+  return plane->texture;
+}
+
+void
+luma_plane_release (LumaCache * cache, LumaPlane * plane)
+{
+  if (plane == NULL)
+    return;
+
+  g_return_if_fail (plane->refs > 0);
+  plane->refs--;
+}
@@ -0,0 +1,42 @@
+/*
+ * TODO copyright
+ */
+
+#ifndef _LUMACACHE_
+#define _LUMACACHE_
+
+#include <gst/gl/gl.h>
+#include <gst/video/video.h>
+
+G_BEGIN_DECLS
+
+/* Y planes of system memory frames uploaded once per GL context for
+ * all the gpuanalysis elements fed with the same frames, e.g. by the
+ * branches of a tee, which may each get a copy of the buffer. A frame
+ * is recognized by the memory holding its Y plane along with the
+ * timestamp, as the pools recycle the memory, and frames without a
+ * timestamp are never shared. The chroma planes are never uploaded.
+ *
+ * The planes go through a ring of persistently mapped pixel unpack
+ * buffers into R8 textures that are kept as long as an element holds
+ * them, i.e. as its current or previous frame.
+ *
+ * All the calls are made on the GL thread of the context. */
+typedef struct _LumaCache LumaCache;
+typedef struct _LumaPlane LumaPlane;
+
+/* the cache of context, created by the first user */
+LumaCache * luma_cache_join (GstGLContext * context);
+/* the cache is destroyed along with the last user,
+   once it has released its planes */
+void        luma_cache_leave (LumaCache * cache);
+/* a reference to the Y plane of frame, uploaded unless another
+   element did already. NULL if it could not be uploaded */
+LumaPlane * luma_cache_upload (LumaCache * cache, GstVideoFrame * frame);
+GLuint      luma_plane_texture (LumaPlane * plane);
+/* plane may be NULL */
+void        luma_plane_release (LumaCache * cache, LumaPlane * plane);
+
+G_END_DECLS
+
+#endif /* _LUMACACHE_ */
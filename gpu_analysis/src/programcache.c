@@ -0,0 +1,355 @@
+/*
+ * TODO copyright
+ */
+
+#include <gst/gl/gstglfuncs.h>
+#include <GL/gl.h>
+#include <GLES3/gl31.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "programcache.h"
+
+#define GST_CAT_DEFAULT program_cache_debug
+GST_DEBUG_CATEGORY_STATIC (program_cache_debug);
+
+/* GL_KHR_parallel_shader_compile, the ARB one has the same value */
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+typedef void (*MaxShaderCompilerThreads) (GLuint count);
+
+typedef enum {
+  PROGRAM_LINKING,
+  PROGRAM_LINKED,
+  PROGRAM_FAILED
+} ProgramState;
+
+typedef struct {
+  /* digest of the driver, the prefix and the source */
+  gchar *      key;
+  GLuint       program;
+  /* the compute stage while the program is linked from source */
+  GLuint       shader;
+  guint        refs;
+  ProgramState state;
+  /* compiler and linker output of a failed program */
+  gchar *      log;
+} Program;
+
+typedef struct {
+  GHashTable * by_key;
+  GHashTable * by_program;
+  /* GL_RENDERER and GL_VERSION, the binaries are only valid for both */
+  gchar *      driver;
+  gboolean     parallel;
+  gboolean     binaries;
+} ContextPrograms;
+
+static GMutex       caches_lock;
+/* GstGLContext -> ContextPrograms, the programs themselves
+   are only touched on the GL thread of their context */
+static GHashTable * caches = NULL;
+
+static gboolean
+_parallel_compile (GstGLContext * context)
+{
+  MaxShaderCompilerThreads max_threads = NULL;
+
+  if (gst_gl_context_check_feature (context, "GL_KHR_parallel_shader_compile"))
+    max_threads = gst_gl_context_get_proc_address (context, "glMaxShaderCompilerThreadsKHR");
+  else if (gst_gl_context_check_feature (context, "GL_ARB_parallel_shader_compile"))
+    max_threads = gst_gl_context_get_proc_address (context, "glMaxShaderCompilerThreadsARB");
+
+  if (max_threads == NULL)
+    return FALSE;
+
+  /* as many as the driver sees fit */
+  max_threads (0xFFFFFFFF);
+  return TRUE;
+}
+
+static ContextPrograms *
+_programs_of (GstGLContext * context, gboolean create)
+{
+  ContextPrograms * cp;
+
+  g_mutex_lock (&caches_lock);
+  if (caches == NULL)
+    {
+      GST_DEBUG_CATEGORY_INIT (program_cache_debug, "gpuanalysisprograms", 0,
+                               "gpuanalysis program cache");
+      caches = g_hash_table_new (NULL, NULL);
+    }
+  cp = g_hash_table_lookup (caches, context);
+  if (cp == NULL && create)
+    {
+      GLint formats = 0;
+
+      glGetIntegerv (GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+
+      cp = g_new0 (ContextPrograms, 1);
+      cp->by_key = g_hash_table_new (g_str_hash, g_str_equal);
+      cp->by_program = g_hash_table_new (NULL, NULL);
+      cp->driver = g_strdup_printf ("%s\n%s\n",
+                                    (const gchar *) glGetString (GL_RENDERER),
+                                    (const gchar *) glGetString (GL_VERSION));
+      cp->binaries = formats > 0;
+      cp->parallel = _parallel_compile (context);
+      GST_INFO ("Program binaries are %s, programs are linked %s",
+                cp->binaries ? "cached" : "not supported",
+                cp->parallel ? "in parallel" : "synchronously");
+      g_hash_table_insert (caches, context, cp);
+    }
+  g_mutex_unlock (&caches_lock);
+
+  return cp;
+}
+
+static void
+_programs_free (GstGLContext * context, ContextPrograms * cp)
+{
+  g_mutex_lock (&caches_lock);
+  g_hash_table_remove (caches, context);
+  g_mutex_unlock (&caches_lock);
+
+  g_hash_table_destroy (cp->by_key);
+  g_hash_table_destroy (cp->by_program);
+  g_free (cp->driver);
+  g_free (cp);
+}
+
+static gchar *
+_binary_path (Program * p)
+{
+  gchar * name = g_strconcat (p->key, ".bin", NULL);
+  gchar * path = g_build_filename (g_get_user_cache_dir (), "gpuanalysis", name, NULL);
+
+  g_free (name);
+  return path;
+}
+
+/* The file holds the binary format followed by the binary */
+static gboolean
+_load_binary (Program * p)
+{
+  gchar * path = _binary_path (p);
+  gchar * data = NULL;
+  gsize   size = 0;
+  GLint   status = GL_FALSE;
+  GLenum  format;
+
+  if (g_file_get_contents (path, &data, &size, NULL)
+      && size > sizeof (format))
+    {
+      memcpy (&format, data, sizeof (format));
+      glProgramBinary (p->program, format,
+                       data + sizeof (format), size - sizeof (format));
+      glGetProgramiv (p->program, GL_LINK_STATUS, &status);
+      /* the driver was updated since */
+      if (!status)
+        {
+          GST_INFO ("Program binary %s is rejected", path);
+          g_unlink (path);
+        }
+    }
+
+  g_free (data);
+  g_free (path);
+  return status == GL_TRUE;
+}
+
+static void
+_store_binary (Program * p)
+{
+  GError * error = NULL;
+  GLint    length = 0;
+  GLenum   format;
+  gchar *  data;
+  gchar *  path;
+  gchar *  dir;
+
+  glGetProgramiv (p->program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0)
+    return;
+
+  data = g_malloc (sizeof (format) + length);
+  glGetProgramBinary (p->program, length, &length, &format, data + sizeof (format));
+  memcpy (data, &format, sizeof (format));
+
+  path = _binary_path (p);
+  dir = g_path_get_dirname (path);
+  g_mkdir_with_parents (dir, 0700);
+  /* written aside and renamed, the other processes
+     never see a partial binary */
+  if (!g_file_set_contents (path, data, sizeof (format) + length, &error))
+    {
+      GST_WARNING ("Could not store the program binary: %s", error->message);
+      g_clear_error (&error);
+    }
+
+  g_free (dir);
+  g_free (path);
+  g_free (data);
+}
+
+static void
+_build (Program * p, const gchar * prefix, const gchar * source)
+{
+  const gchar * strings [] = { prefix, source };
+
+  p->shader = glCreateShader (GL_COMPUTE_SHADER);
+  glShaderSource (p->shader, 2, strings, NULL);
+  glCompileShader (p->shader);
+  glAttachShader (p->program, p->shader);
+  glProgramParameteri (p->program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  glLinkProgram (p->program);
+  /* any status query before the completion one would wait for the compiler */
+  p->state = PROGRAM_LINKING;
+}
+
+static gchar *
+_info_log (Program * p)
+{
+  GLint   shader_length = 0;
+  GLint   program_length = 0;
+  gchar * log;
+
+  glGetShaderiv (p->shader, GL_INFO_LOG_LENGTH, &shader_length);
+  glGetProgramiv (p->program, GL_INFO_LOG_LENGTH, &program_length);
+
+  log = g_malloc0 (shader_length + program_length + 1);
+  if (shader_length > 0)
+    glGetShaderInfoLog (p->shader, shader_length, NULL, log);
+  if (program_length > 0)
+    glGetProgramInfoLog (p->program, program_length, NULL, log + strlen (log));
+  return log;
+}
+
+static void
+_finish (ContextPrograms * cp, Program * p)
+{
+  GLint done = GL_TRUE;
+  GLint status = GL_FALSE;
+
+  if (cp->parallel)
+    glGetProgramiv (p->program, GL_COMPLETION_STATUS_KHR, &done);
+  if (!done)
+    return;
+
+  glGetProgramiv (p->program, GL_LINK_STATUS, &status);
+  if (status)
+    {
+      p->state = PROGRAM_LINKED;
+      if (cp->binaries)
+        _store_binary (p);
+    }
+  else
+    {
+      p->state = PROGRAM_FAILED;
+      p->log = _info_log (p);
+      GST_WARNING ("Program %s failed to link: %s", p->key, p->log);
+    }
+
+  glDetachShader (p->program, p->shader);
+  glDeleteShader (p->shader);
+  p->shader = 0;
+}
+
+GLuint
+program_cache_get (GstGLContext * context,
+                   const gchar * prefix,
+                   const gchar * source)
+{
+  ContextPrograms * cp = _programs_of (context, TRUE);
+  Program *         p;
+  gchar *           text;
+  gchar *           key;
+
+  text = g_strconcat (cp->driver, prefix, source, NULL);
+  key = g_compute_checksum_for_string (G_CHECKSUM_SHA256, text, -1);
+  g_free (text);
+
+  p = g_hash_table_lookup (cp->by_key, key);
+  if (p)
+    {
+      g_free (key);
+      p->refs++;
+      return p->program;
+    }
+
+  p = g_new0 (Program, 1);
+  p->key = key;
+  p->refs = 1;
+  p->program = glCreateProgram ();
+  if (p->program == 0)
+    {
+      g_free (p->key);
+      g_free (p);
+      if (g_hash_table_size (cp->by_program) == 0)
+        _programs_free (context, cp);
+      return 0;
+    }
+
+  if (cp->binaries && _load_binary (p))
+    {
+      GST_DEBUG ("Program %s is loaded from its binary", p->key);
+      p->state = PROGRAM_LINKED;
+    }
+  else
+    _build (p, prefix, source);
+
+  g_hash_table_insert (cp->by_key, p->key, p);
+  g_hash_table_insert (cp->by_program, GUINT_TO_POINTER (p->program), p);
+
+  return p->program;
+}
+
+gboolean
+program_cache_ready (GstGLContext * context,
+                     GLuint program,
+                     GError ** error)
+{
+  ContextPrograms * cp = _programs_of (context, FALSE);
+  Program *         p = NULL;
+
+  if (cp)
+    p = g_hash_table_lookup (cp->by_program, GUINT_TO_POINTER (program));
+  g_return_val_if_fail (p != NULL, FALSE);
+
+  if (p->state == PROGRAM_LINKING)
+    _finish (cp, p);
+
+  if (p->state == PROGRAM_FAILED)
+    g_set_error (error, GST_GLSL_ERROR, GST_GLSL_ERROR_LINK, "%s", p->log);
+
+  return p->state == PROGRAM_LINKED;
+}
+
+void
+program_cache_release (GstGLContext * context,
+                       GLuint program)
+{
+  ContextPrograms * cp = _programs_of (context, FALSE);
+  Program *         p;
+
+  if (cp == NULL || program == 0)
+    return;
+
+  p = g_hash_table_lookup (cp->by_program, GUINT_TO_POINTER (program));
+  if (p == NULL || --p->refs > 0)
+    return;
+
+  g_hash_table_remove (cp->by_program, GUINT_TO_POINTER (p->program));
+  g_hash_table_remove (cp->by_key, p->key);
+  if (p->shader)
+    glDeleteShader (p->shader);
+  glDeleteProgram (p->program);
+  g_free (p->log);
+  g_free (p->key);
+  g_free (p);
+
+  if (g_hash_table_size (cp->by_program) == 0)
+    _programs_free (context, cp);
+}
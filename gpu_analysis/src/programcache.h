@@ -0,0 +1,40 @@
+/*
+ * TODO copyright
+ */
+
+#ifndef _PROGRAMCACHE_
+#define _PROGRAMCACHE_
+
+#include <gst/gl/gl.h>
+
+G_BEGIN_DECLS
+
+/* Linked compute programs shared by the analysers of the process.
+ * A program is keyed by its source along with the prefix it is
+ * specialized with and is built once per GL context. The linked
+ * programs are also stored as glGetProgramBinary blobs in the user
+ * cache directory, so the next start skips the compiler as long as
+ * the driver takes the binaries back.
+ *
+ * A program built from source is linked in the background by the
+ * drivers with GL_KHR_parallel_shader_compile, it may only be used
+ * once program_cache_ready says so.
+ *
+ * All the calls are made on the GL thread of the context. */
+
+/* a reference to the program, 0 if it could not be created */
+GLuint   program_cache_get (GstGLContext * context,
+                            const gchar * prefix,
+                            const gchar * source);
+/* TRUE once the program is linked, FALSE while it is being linked
+   or, with error set, if it failed to. Only waits for the drivers
+   that link synchronously */
+gboolean program_cache_ready (GstGLContext * context,
+                              GLuint program,
+                              GError ** error);
+void     program_cache_release (GstGLContext * context,
+                                GLuint program);
+
+G_END_DECLS
+
+#endif /* _PROGRAMCACHE_ */
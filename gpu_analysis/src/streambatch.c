@@ -0,0 +1,377 @@
+/*
+ * TODO copyright
+ */
+
+#include <gst/gl/gstglfuncs.h>
+#include <GL/gl.h>
+#include <GLES3/gl31.h>
+#include <string.h>
+
+#include "streambatch.h"
+#include "programcache.h"
+
+#include "analysis.h"
+
+#define GST_CAT_DEFAULT stream_batch_debug
+GST_DEBUG_CATEGORY_STATIC (stream_batch_debug);
+
+/* places are added in steps of */
+#define PLACES_STEP 4
+
+typedef struct {
+  /* NULL for a free place */
+  GstGPUAnalysis * va;
+  /* layers of the latest and of the previous frame, -1 if none */
+  gint             cur;
+  gint             prev;
+  gint             width;
+  gint             height;
+  gboolean         queued;
+  guint            slot;
+} Member;
+
+/* struct Stream of the shaders, std430 */
+typedef struct {
+  GLint width;
+  GLint height;
+  GLint black_bound;
+  GLint freez_bound;
+  GLint cur;
+  GLint prev;
+  GLint offset;
+  GLint blocks;
+} StreamParams;
+
+struct _StreamBatch {
+  GstGLContext * context;
+  GLuint         program;
+  GLuint         program_reduce;
+  /* Member places, a place owns the layers 2 * n and 2 * n + 1
+     of frames and the accumulators from n * place_blocks on */
+  Member       * members;
+  guint          places;
+  guint          n_members;
+  guint          n_queued;
+  GLuint         frames;
+  gint           width;
+  gint           height;
+  guint          place_blocks;
+  GLuint         blocks;
+  /* an accumulator and a StreamParams per queued frame */
+  GLuint         totals;
+  GLuint         params;
+};
+
+/* GstGLContext -> StreamBatch */
+static GHashTable * batches = NULL;
+static GMutex       batches_lock;
+
+static Member *
+_member (StreamBatch * batch, GstGPUAnalysis * va)
+{
+  for (guint i = 0; i < batch->places; i++)
+    if (batch->members[i].va == va)
+      return &batch->members[i];
+  return NULL;
+}
+
+/* Grows the frame array and the buffers to fit places members
+   of width x height, the frames already there are kept */
+static void
+_resize (StreamBatch * batch, gint width, gint height, guint places)
+{
+  gint   new_width = MAX (batch->width, width);
+  gint   new_height = MAX (batch->height, height);
+  guint  new_places = MAX (batch->places, places);
+  GLuint frames;
+
+  if (new_width == batch->width
+      && new_height == batch->height
+      && new_places == batch->places)
+    return;
+
+  new_places = (new_places + PLACES_STEP - 1) / PLACES_STEP * PLACES_STEP;
+
+  glGenTextures (1, &frames);
+  glBindTexture (GL_TEXTURE_2D_ARRAY, frames);
+  /* the luma levels as they are, integer textures are
+     only complete with the nearest filtering */
+  glTexStorage3D (GL_TEXTURE_2D_ARRAY, 1, GL_R8UI, new_width, new_height, 2 * new_places);
+  glTexParameteri (GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri (GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  if (batch->frames)
+    {
+      glCopyImageSubData (batch->frames, GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0,
+                          frames, GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0,
+                          batch->width, batch->height, 2 * batch->places);
+      glDeleteTextures (1, &batch->frames);
+    }
+  glBindTexture (GL_TEXTURE_2D_ARRAY, 0);
+  batch->frames = frames;
+
+  batch->members = g_renew (Member, batch->members, new_places);
+  memset (batch->members + batch->places, 0,
+          (new_places - batch->places) * sizeof (Member));
+  batch->places = new_places;
+  batch->width = new_width;
+  batch->height = new_height;
+  batch->place_blocks = (new_width / 8) * (new_height / 8);
+
+  if (batch->blocks)
+    {
+      glDeleteBuffers (1, &batch->blocks);
+      glDeleteBuffers (1, &batch->totals);
+      glDeleteBuffers (1, &batch->params);
+    }
+  glGenBuffers (1, &batch->blocks);
+  glBindBuffer (GL_SHADER_STORAGE_BUFFER, batch->blocks);
+  glBufferData (GL_SHADER_STORAGE_BUFFER,
+                batch->place_blocks * new_places * sizeof (struct accumulator),
+                NULL, GL_DYNAMIC_COPY);
+  glGenBuffers (1, &batch->totals);
+  glBindBuffer (GL_SHADER_STORAGE_BUFFER, batch->totals);
+  glBufferData (GL_SHADER_STORAGE_BUFFER,
+                new_places * sizeof (struct accumulator),
+                NULL, GL_DYNAMIC_COPY);
+  glGenBuffers (1, &batch->params);
+  glBindBuffer (GL_SHADER_STORAGE_BUFFER, batch->params);
+  glBufferData (GL_SHADER_STORAGE_BUFFER,
+                new_places * sizeof (StreamParams),
+                NULL, GL_DYNAMIC_DRAW);
+  glBindBuffer (GL_SHADER_STORAGE_BUFFER, 0);
+
+  GST_DEBUG ("Stream batch of %u places, %dx%d", new_places, new_width, new_height);
+}
+
+static void
+_free (StreamBatch * batch)
+{
+  if (batch->frames)
+    glDeleteTextures (1, &batch->frames);
+  if (batch->blocks)
+    {
+      glDeleteBuffers (1, &batch->blocks);
+      glDeleteBuffers (1, &batch->totals);
+      glDeleteBuffers (1, &batch->params);
+    }
+  program_cache_release (batch->context, batch->program);
+  program_cache_release (batch->context, batch->program_reduce);
+  g_free (batch->members);
+  g_free (batch);
+}
+
+/* Analyses the queued frames and hands the results over to the members */
+static void
+_dispatch (StreamBatch * batch)
+{
+  StreamParams params [batch->places];
+  Member *     order [batch->places];
+  guint        n = 0;
+  gint         tiles_x = 0, tiles_y = 0;
+
+  if (batch->n_queued == 0)
+    return;
+
+  for (guint i = 0; i < batch->places; i++)
+    {
+      Member * m = &batch->members[i];
+
+      if (!m->queued)
+        continue;
+
+      params[n].width = m->width;
+      params[n].height = m->height;
+      params[n].black_bound = m->va->black_pixel_lb;
+      params[n].freez_bound = m->va->pixel_diff_lb;
+      params[n].cur = m->cur;
+      params[n].prev = m->prev;
+      params[n].offset = i * batch->place_blocks;
+      params[n].blocks = (m->width / 8) * (m->height / 8);
+      tiles_x = MAX (tiles_x, (m->width / 8 + TILE_SIZE - 1) / TILE_SIZE);
+      tiles_y = MAX (tiles_y, (m->height / 8 + TILE_SIZE - 1) / TILE_SIZE);
+      order[n++] = m;
+    }
+
+  glBindBuffer (GL_SHADER_STORAGE_BUFFER, batch->params);
+  glBufferSubData (GL_SHADER_STORAGE_BUFFER, 0, n * sizeof (StreamParams), params);
+
+  glActiveTexture (GL_TEXTURE0);
+  glBindTexture (GL_TEXTURE_2D_ARRAY, batch->frames);
+  glBindBufferBase (GL_SHADER_STORAGE_BUFFER, 10, batch->blocks);
+  glBindBufferBase (GL_SHADER_STORAGE_BUFFER, 11, batch->totals);
+  glBindBufferBase (GL_SHADER_STORAGE_BUFFER, 12, batch->params);
+
+  glUseProgram (batch->program);
+  glDispatchCompute (tiles_x, tiles_y, n);
+
+  glMemoryBarrier (GL_SHADER_STORAGE_BARRIER_BIT);
+
+  glUseProgram (batch->program_reduce);
+  glDispatchCompute (1, 1, n);
+
+  /* Scatter */
+  glMemoryBarrier (GL_BUFFER_UPDATE_BARRIER_BIT);
+
+  for (guint k = 0; k < n; k++)
+    {
+      Member *         m = order[k];
+      GstGPUAnalysis * va = m->va;
+
+      glBindBuffer (GL_COPY_READ_BUFFER, batch->totals);
+      glBindBuffer (GL_COPY_WRITE_BUFFER, va->totals[m->slot]);
+      glCopyBufferSubData (GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                           k * sizeof (struct accumulator), 0,
+                           sizeof (struct accumulator));
+      if (va->mapped[m->slot])
+        {
+          glBindBuffer (GL_COPY_READ_BUFFER, batch->blocks);
+          glBindBuffer (GL_COPY_WRITE_BUFFER, va->buffer[m->slot]);
+          glCopyBufferSubData (GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                               params[k].offset * sizeof (struct accumulator), 0,
+                               params[k].blocks * sizeof (struct accumulator));
+        }
+    }
+  glBindBuffer (GL_COPY_READ_BUFFER, 0);
+  glBindBuffer (GL_COPY_WRITE_BUFFER, 0);
+  glBindBuffer (GL_SHADER_STORAGE_BUFFER, 0);
+  glBindTexture (GL_TEXTURE_2D_ARRAY, 0);
+
+  for (guint k = 0; k < n; k++)
+    {
+      Member *         m = order[k];
+      GstGPUAnalysis * va = m->va;
+
+      if (va->fence[m->slot])
+        glDeleteSync (va->fence[m->slot]);
+      va->fence[m->slot] = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      m->queued = FALSE;
+    }
+  batch->n_queued = 0;
+}
+
+StreamBatch *
+stream_batch_join (GstGLContext * context, GstGPUAnalysis * va)
+{
+  StreamBatch * batch;
+  Member *      m;
+  guint         place;
+
+  g_mutex_lock (&batches_lock);
+  if (batches == NULL)
+    {
+      GST_DEBUG_CATEGORY_INIT (stream_batch_debug, "gpuanalysisbatch", 0,
+                               "gpuanalysis stream batch");
+      batches = g_hash_table_new (NULL, NULL);
+    }
+  batch = g_hash_table_lookup (batches, context);
+  if (batch == NULL)
+    {
+      gchar * prefix = analysis_shader_prefix (analysis_has_subgroup (context), TRUE);
+
+      batch = g_new0 (StreamBatch, 1);
+      batch->context = context;
+      batch->program = program_cache_get (context, prefix, shader_source);
+      batch->program_reduce = program_cache_get (context, prefix, shader_source_reduce);
+      g_free (prefix);
+      if (batch->program == 0 || batch->program_reduce == 0)
+        {
+          GST_WARNING ("Failed to create the batch programs");
+          program_cache_release (context, batch->program);
+          program_cache_release (context, batch->program_reduce);
+          g_free (batch);
+          g_mutex_unlock (&batches_lock);
+          return NULL;
+        }
+      g_hash_table_insert (batches, context, batch);
+    }
+  g_mutex_unlock (&batches_lock);
+
+  for (place = 0; place < batch->places; place++)
+    if (batch->members[place].va == NULL)
+      break;
+
+  /* members may move */
+  _resize (batch, va->in_info.width, va->in_info.height, place + 1);
+
+  m = &batch->members[place];
+  m->va = va;
+  m->cur = -1;
+  m->prev = -1;
+  m->queued = FALSE;
+  batch->n_members++;
+
+  return batch;
+}
+
+void
+stream_batch_leave (StreamBatch * batch, GstGPUAnalysis * va)
+{
+  Member * m = _member (batch, va);
+
+  if (m == NULL)
+    return;
+
+  if (m->queued)
+    batch->n_queued--;
+  memset (m, 0, sizeof (Member));
+  batch->n_members--;
+
+  if (batch->n_members == 0)
+    {
+      g_mutex_lock (&batches_lock);
+      g_hash_table_remove (batches, batch->context);
+      g_mutex_unlock (&batches_lock);
+      _free (batch);
+      return;
+    }
+
+  /* the rest of the round may only wait for it */
+  if (batch->n_queued == batch->n_members)
+    _dispatch (batch);
+}
+
+void
+stream_batch_submit (StreamBatch * batch, GstGPUAnalysis * va)
+{
+  Member * m = _member (batch, va);
+  gint     place = m - batch->members;
+  gint     layer;
+
+  /* the others lag behind */
+  if (m->queued)
+    _dispatch (batch);
+
+  layer = (m->cur == 2 * place) ? 2 * place + 1 : 2 * place;
+  m->width = va->in_info.width;
+  m->height = va->in_info.height;
+
+  /* R8 and R8UI are of the same size class, the levels are copied as they are */
+  glCopyImageSubData (va->tex, GL_TEXTURE_2D, 0, 0, 0, 0,
+                      batch->frames, GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer,
+                      m->width, m->height, 1);
+
+  m->prev = (m->cur >= 0) ? m->cur : layer;
+  m->cur = layer;
+  m->slot = va->buffer_ptr;
+  m->queued = TRUE;
+  batch->n_queued++;
+
+  if (batch->n_queued == batch->n_members)
+    _dispatch (batch);
+}
+
+void
+stream_batch_wait (StreamBatch * batch, GstGPUAnalysis * va, guint slot)
+{
+  Member * m = _member (batch, va);
+
+  if (m && m->queued && m->slot == slot)
+    _dispatch (batch);
+}
+
+gboolean
+stream_batch_ready (StreamBatch * batch, GError ** error)
+{
+  return program_cache_ready (batch->context, batch->program, error)
+    && program_cache_ready (batch->context, batch->program_reduce, error);
+}
@@ -0,0 +1,39 @@
+/*
+ * TODO copyright
+ */
+
+#ifndef _STREAMBATCH_
+#define _STREAMBATCH_
+
+#include "gstgpuanalysis.h"
+
+G_BEGIN_DECLS
+
+/* The gpuanalysis elements sharing a GL context may analyse their
+ * frames together: each frame is copied into a layer of a texture
+ * array and once every member has queued one, all of them are analysed
+ * by a single dispatch of the shaders built with BATCH. The totals and,
+ * with block_grid, the block statistics are then copied into the
+ * member's own ring slot and its fence is set, so the element reads
+ * them back as if it analysed the frame itself.
+ *
+ * All the calls are made on the GL thread of the context. */
+typedef struct _StreamBatch StreamBatch;
+
+/* the batch of context, created by the first member,
+   NULL if its programs could not be created */
+StreamBatch * stream_batch_join (GstGLContext * context, GstGPUAnalysis * va);
+/* TRUE once the programs of the batch are linked, FALSE while they
+   are being linked or, with error set, if they failed to */
+gboolean      stream_batch_ready (StreamBatch * batch, GError ** error);
+/* the batch is destroyed along with the last member */
+void          stream_batch_leave (StreamBatch * batch, GstGPUAnalysis * va);
+/* queues va->tex for the va->buffer_ptr slot, a member queueing
+   a second frame dispatches the incomplete round first */
+void          stream_batch_submit (StreamBatch * batch, GstGPUAnalysis * va);
+/* dispatches the round if the frame of va for slot is still queued */
+void          stream_batch_wait (StreamBatch * batch, GstGPUAnalysis * va, guint slot);
+
+G_END_DECLS
+
+#endif /* _STREAMBATCH_ */